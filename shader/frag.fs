@@ -9,10 +9,21 @@ uniform vec3 light_pos;
 uniform vec3 light_colour;
 uniform vec3 object_colour;
 
+// From the analysis, all 0 - 1. rms is the frame level, centroid and rolloff
+// are fractions of nyquist, flatness goes to 1 for noise, flux is onsets.
+uniform float feature_rms;
+uniform float feature_centroid;
+uniform float feature_flatness;
+uniform float feature_rolloff;
+uniform float feature_flux;
+// Pulses that jump to 1 on a beat / onset and die away in about 0.1 s.
+uniform float feature_beat;
+uniform float feature_onset;
+
 void main()
 {
   //ambient
-    float ambient_str = 0.33;
+    float ambient_str = 0.33 + 0.5 * feature_rms + 0.4 * feature_beat;
     vec3 ambience = ambient_str * light_colour;
 
   //diffuse
@@ -22,12 +33,15 @@ void main()
     vec3 diffuse = diff * light_colour;
 
   //specular
-    float spec_str = 0.5;
+    float spec_str = 0.5 + feature_flux + feature_onset;
     vec3 view_dir = normalize(view_pos - frag_pos);
     vec3 reflect_dir = reflect(-dir, normval);
     float spec = pow(max(dot(view_dir, reflect_dir), 0.0), 32);
     vec3 specular = spec_str * spec * light_colour;
     
-    vec3 result = (ambience + diffuse + specular) * object_colour;
+    // Brighter sounds push the colour warmer, noise washes it out.
+    vec3 warm = mix(object_colour, object_colour.bgr, clamp(4.0 * feature_centroid, 0.0, 1.0));
+    vec3 colour = mix(warm, vec3(dot(warm, vec3(0.333))), 0.5 * feature_flatness);
+    vec3 result = (ambience + diffuse + specular) * colour;
     frag_colour = vec4(result, 1.0);
 }
@@ -0,0 +1,192 @@
+#include "analysis.h"
+#include <math.h>
+#include <string.h>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+// The running sums drift with rounding, rebuild them from the window after
+// this many windows worth of samples.
+static const uint64_t RESYNC_WINDOWS = 16;
+
+void sched_init(Scheduler *s, const AnalyzeMode mode, const uint32_t hop)
+{
+    s->mode = mode;
+    s->hop = hop ? hop : 1;
+    sched_reset(s);
+}
+
+void sched_reset(Scheduler *s)
+{
+    s->done = 0;
+    s->primed = 0;
+}
+
+// Returns how many hops completed since the last call. The first call after a
+// reset (or a position going backwards, like a new track) is due straight
+// away so the bars don't sit empty for a hop.
+uint32_t sched_due(Scheduler *s, const uint64_t pos)
+{
+    if (!s->primed || pos < s->done) {
+        s->primed = 1;
+        s->done = pos;
+        return pos > 0;
+    }
+
+    const uint64_t hops = (pos - s->done) / s->hop;
+    s->done += hops * s->hop;
+    return (uint32_t)hops;
+}
+
+void sdft_init(SlidingDFT *d, const size_t size, const int sr)
+{
+    memset(d, 0, sizeof(SlidingDFT));
+    d->size = size;
+    d->sr = sr;
+
+    for (int b = 0; b < DIVISOR; b++) {
+        long k = lroundf(bar_frequency(b) * (float)size / (float)sr);
+        if (k < 1) {
+            k = 1;
+        }
+        if (k > (long)size / 2 - 2) {
+            k = (long)size / 2 - 2;
+        }
+
+        for (int j = 0; j < 3; j++) {
+            const double theta = 2.0 * M_PI * (double)(k - 1 + j) / (double)size;
+            d->rot[b][j].real = (float)cos(theta);
+            d->rot[b][j].imag = (float)sin(theta);
+        }
+    }
+}
+
+void sdft_reset(SlidingDFT *d)
+{
+    d->synced = 0;
+}
+
+// S = (S + x_new - x_old) * e^(i2pik/N) for every tracked bin. With old NULL
+// this is a direct Goertzel style evaluation from an empty state.
+static void sdft_feed(SlidingDFT *d, const float *x, const float *old, const size_t count)
+{
+    Compf *const state = &d->state[0][0];
+    const Compf *const rot = &d->rot[0][0];
+    const int states = DIVISOR * 3;
+
+    for (size_t n = 0; n < count; n++) {
+        const float delta = old ? x[n] - old[n] : x[n];
+        for (int i = 0; i < states; i++) {
+            const float re = state[i].real + delta;
+            const float im = state[i].imag;
+            state[i].real = re * rot[i].real - im * rot[i].imag;
+            state[i].imag = re * rot[i].imag + im * rot[i].real;
+        }
+    }
+}
+
+// hist holds histlen samples ending at push count histend, now is the stream
+// position the bars should describe. Only the samples between the last call
+// and now are fed in, unless the gap no longer fits in the history or it's
+// time to resync, then the window is evaluated directly.
+void sdft_advance(SlidingDFT *d, const float *hist, const uint32_t histlen, const uint64_t histend, const uint64_t now)
+{
+    const uint64_t lag = histend - now;
+    if (now > histend || lag + d->size > histlen) {
+        return;
+    }
+
+    const size_t end = histlen - (size_t)lag;
+    const uint64_t fresh = now - d->pos;
+    if (!d->synced || now < d->pos || fresh + d->size > end || d->since_sync >= RESYNC_WINDOWS * d->size) {
+        memset(d->state, 0, sizeof(d->state));
+        sdft_feed(d, hist + end - d->size, NULL, d->size);
+        d->synced = 1;
+        d->since_sync = 0;
+    } else {
+        const float *const x = hist + end - fresh;
+        sdft_feed(d, x, x - d->size, (size_t)fresh);
+        d->since_sync += fresh;
+    }
+    d->pos = now;
+}
+
+// Hann in the frequency domain is 0.5 X[k] - 0.25 (X[k - 1] + X[k + 1]). A
+// sine of amplitude A comes out of that as A * size / 4, scaled so it reads 1.
+void sdft_bars(const SlidingDFT *d, float *sums)
+{
+    const float norm = 16.0f / ((float)d->size * (float)d->size);
+    for (int b = 0; b < DIVISOR; b++) {
+        const Compf *const s = d->state[b];
+        const float re = 0.5f * s[1].real - 0.25f * (s[0].real + s[2].real);
+        const float im = 0.5f * s[1].imag - 0.25f * (s[0].imag + s[2].imag);
+        sums[b] = (re * re + im * im) * norm;
+    }
+}
+
+// Splits interleaved L/R frames into two signals: L and R for stereo, (L + R)
+// / 2 and (L - R) / 2 for mid/side. Mono only writes the mid signal to a.
+void deinterleave(const float *in, float *a, float *b, const size_t frames, const ChannelMode mode)
+{
+    size_t i = 0;
+#if defined(__SSE__)
+    const __m128 half = _mm_set1_ps(0.5f);
+    for (; i + 4 <= frames; i += 4) {
+        const __m128 x = _mm_loadu_ps(&in[2 * i]);
+        const __m128 y = _mm_loadu_ps(&in[2 * i + 4]);
+        const __m128 l = _mm_shuffle_ps(x, y, _MM_SHUFFLE(2, 0, 2, 0));
+        const __m128 r = _mm_shuffle_ps(x, y, _MM_SHUFFLE(3, 1, 3, 1));
+        switch (mode) {
+        case CHANNELS_MONO:
+        {
+            _mm_storeu_ps(&a[i], _mm_mul_ps(_mm_add_ps(l, r), half));
+        } break;
+        case CHANNELS_STEREO:
+        {
+            _mm_storeu_ps(&a[i], l);
+            _mm_storeu_ps(&b[i], r);
+        } break;
+        case CHANNELS_MIDSIDE:
+        {
+            _mm_storeu_ps(&a[i], _mm_mul_ps(_mm_add_ps(l, r), half));
+            _mm_storeu_ps(&b[i], _mm_mul_ps(_mm_sub_ps(l, r), half));
+        } break;
+        }
+    }
+#endif
+    for (; i < frames; i++) {
+        const float l = in[2 * i];
+        const float r = in[2 * i + 1];
+        switch (mode) {
+        case CHANNELS_MONO:
+        {
+            a[i] = 0.5f * (l + r);
+        } break;
+        case CHANNELS_STEREO:
+        {
+            a[i] = l;
+            b[i] = r;
+        } break;
+        case CHANNELS_MIDSIDE:
+        {
+            a[i] = 0.5f * (l + r);
+            b[i] = 0.5f * (l - r);
+        } break;
+        }
+    }
+}
+
+// Mirrored layout for two signals: a on the left half with its lowest
+// frequency in the middle, b on the right half going outwards. Each half has
+// room for every other bar so neighbouring pairs are merged by their max.
+void stereo_bars(const float *a, const float *b, float *sums)
+{
+    const int half = DIVISOR / 2;
+    for (int k = 0; k < half; k++) {
+        const float x = (a[2 * k] > a[2 * k + 1]) ? a[2 * k] : a[2 * k + 1];
+        const float y = (b[2 * k] > b[2 * k + 1]) ? b[2 * k] : b[2 * k + 1];
+        sums[half - 1 - k] = x;
+        sums[half + k] = y;
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include "fft.h"
+#include "rndrdef.h"
+#include <stdint.h>
+
+#define DEFAULT_HOP 1024
+
+typedef enum
+{
+    ANALYZE_FFT,
+    ANALYZE_SDFT,
+    ANALYZE_CQT,
+    ANALYZE_MULTIRES,
+} AnalyzeMode;
+
+// What gets analysed out of the interleaved stereo stream. Stereo and mid/side
+// run both signals through one complex FFT.
+typedef enum
+{
+    CHANNELS_MONO,
+    CHANNELS_STEREO,
+    CHANNELS_MIDSIDE,
+} ChannelMode;
+
+// Decides when there's enough new audio for another analysis. Positions are
+// push counts from audio_snapshot, so the cost follows the audio and not the
+// frame rate.
+typedef struct
+{
+    AnalyzeMode mode;
+    uint32_t hop;
+    uint64_t done;
+    int primed;
+} Scheduler;
+
+// Sliding DFT over just the bins behind each bar. Each bar tracks its centre
+// bin and both neighbours so a Hann window can be applied in the frequency
+// domain.
+typedef struct
+{
+    size_t size;
+    int sr;
+    int synced;
+    uint64_t pos;
+    uint64_t since_sync;
+    Compf rot[DIVISOR][3];
+    Compf state[DIVISOR][3];
+} SlidingDFT;
+
+void sched_init(Scheduler *s, AnalyzeMode mode, uint32_t hop);
+void sched_reset(Scheduler *s);
+uint32_t sched_due(Scheduler *s, uint64_t pos);
+void sdft_init(SlidingDFT *d, size_t size, int sr);
+void sdft_reset(SlidingDFT *d);
+void sdft_advance(SlidingDFT *d, const float *hist, uint32_t histlen, uint64_t histend, uint64_t now);
+void sdft_bars(const SlidingDFT *d, float *sums);
+
+void deinterleave(const float *in, float *a, float *b, size_t frames, ChannelMode mode);
+void stereo_bars(const float *a, const float *b, float *sums);
+
+#endif
@@ -1,11 +1,20 @@
 #include <errno.h>
+#include <math.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "audio.h"
+#include "audit.h"
+#include "loudness.h"
+#include "record.h"
+#include "trace.h"
 #include <SDL2/SDL_audio.h>
 
 #include <sndfile.h>
 
+// Frames per sf_readf_float call when decoding a file.
+#define DECODE_CHUNK (1 << 16)
+
 typedef struct
 {
     const int bit;
@@ -14,6 +23,17 @@ typedef struct
 
 float vol = 1.0f;
 
+// Per track loudness normalisation, set from the config at startup.
+static int normalize = 1;
+static float loudness_target = -18.0f;
+
+// Set with --record, gets every chunk the callback pushes.
+static Recorder *recorder = NULL;
+// Set while a recording is played back: the device latency it was made with,
+// and without a device the stream counts as playing.
+static int replaying = 0;
+static uint32_t replay_latency = 0;
+
 SDL_AudioDeviceID dev;
 SDL_AudioSpec want = { 0 }, have = { 0 };
 
@@ -34,20 +54,118 @@ static void print_want_have(void)
     printf("HAVE: %d %d %d %d %d %d\n", have.channels, have.format, have.freq, have.samples, have.silence, have.size);
 }
 
-// float root_mean_squared(const float *slice, const size_t size) {
-// float sum = 0.0f;
-// for (size_t i = 0; i < size; i++) {
-// sum += slice[i] * slice[i];
-//}
-// return sqrtf(sum / size);
-//}
+// Sized from the FFT size at startup. The ring is interleaved so a window of
+// fft_size frames takes twice that many floats. The device is handed about
+// fft_size floats per callback, kept between 1024 and BUFFER_SIZE so tiny
+// windows don't starve the device and huge ones don't add seconds of latency.
+// The history covers the device latency plus two windows.
+static uint32_t window_size = BUFFER_SIZE;
+static uint32_t device_size = BUFFER_SIZE;
+static uint32_t history_size = 4 * BUFFER_SIZE;
+
+void audio_configure(const size_t fft_size)
+{
+    window_size = (uint32_t)fft_size * AUDIO_CHANNELS;
+    device_size = (uint32_t)fft_size;
+    if (device_size < 1024) {
+        device_size = 1024;
+    }
+    if (device_size > BUFFER_SIZE) {
+        device_size = BUFFER_SIZE;
+    }
+    history_size = 2 * (window_size + device_size);
+}
+
+void audio_normalize(const int on, const float target)
+{
+    normalize = on;
+    loudness_target = target;
+}
+
+uint32_t audio_history(void)
+{
+    return history_size;
+}
+
+// Writes a byte on every page so whatever the callback fills has real pages
+// behind it. Fresh calloc memory is all one shared zero page until written,
+// and each first write would be a page fault on the audio thread. A plain
+// memset after the allocation gets folded back into calloc.
+void audio_prefault(void *mem, const size_t bytes)
+{
+    volatile unsigned char *const b = mem;
+    const long page = sysconf(_SC_PAGESIZE);
+    const size_t step = (page > 0) ? (size_t)page : 4096;
+    for (size_t i = 0; i < bytes; i += step) {
+        b[i] = 0;
+    }
+}
+
+void fft_push(AParams *p, const float *src, const uint32_t samples)
+{
+    if (samples > 0 && (p && p->sample_buffer && src)) {
+        const uint32_t cap = p->history;
+        const uint32_t count = (samples < cap) ? samples : cap;
+        const uint32_t head = (uint32_t)((p->pushed + (samples - count)) % cap);
+        const uint32_t first = (count < cap - head) ? count : cap - head;
+
+        src += samples - count;
+        memcpy(p->sample_buffer + head, src, first * sizeof(float));
+        memcpy(p->sample_buffer, src + first, (count - first) * sizeof(float));
+        p->pushed += samples;
+    }
+}
+
+// Copies the newest count samples out of the ring, oldest first, and returns
+// the push count they end at. Locks the device so the callback can't write
+// halfway through the copy.
+uint64_t audio_snapshot(const AParams *p, float *dst, uint32_t count)
+{
+    const uint32_t cap = p->history;
+    count = (count < cap) ? count : cap;
+    if (dev) {
+        SDL_LockAudioDevice(dev);
+    }
+
+    const uint64_t pushed = p->pushed;
+    const uint32_t tail = (uint32_t)((pushed + cap - count) % cap);
+    const uint32_t first = (count < cap - tail) ? count : cap - tail;
+    memcpy(dst, p->sample_buffer + tail, first * sizeof(float));
+    memcpy(dst + first, p->sample_buffer, (count - first) * sizeof(float));
+
+    if (dev) {
+        SDL_UnlockAudioDevice(dev);
+    }
+    return pushed;
+}
+
+// Stream position in frames of what's audible right now, on the same clock as
+// the analysis positions.
+uint64_t audio_position(const AParams *p)
+{
+    if (dev) {
+        SDL_LockAudioDevice(dev);
+    }
+    const uint64_t pushed = p->pushed;
+    if (dev) {
+        SDL_UnlockAudioDevice(dev);
+    }
+
+    const uint32_t lag = audio_latency();
+    return (pushed > lag) ? (pushed - lag) / AUDIO_CHANNELS : 0;
+}
 
-void fft_push(const uint32_t samples, const uint32_t offset, const float *srcbuf, float dstbuf[TWOBUFFER])
+// Samples the device has been handed but not played yet, analysing the
+// stream this far behind the push head keeps the bars in time with what's
+// audible.
+uint32_t audio_latency(void)
 {
-    if (samples > 0 && (srcbuf && dstbuf)) {
-        memmove(dstbuf, dstbuf + samples, samples * sizeof(float));
-        memcpy(dstbuf + samples, srcbuf + offset, samples * sizeof(float));
+    if (replaying) {
+        return replay_latency;
     }
+    const uint32_t queued = (uint32_t)have.samples * have.channels;
+    const uint32_t limit = history_size - 2 * window_size;
+    return (queued < limit) ? queued : limit;
 }
 
 static float vclampf(const float v)
@@ -82,12 +200,31 @@ int get_audio_state(void)
     if (dev) {
         return SDL_GetAudioDeviceStatus(dev);
     }
-    return 0;
+    return replaying ? SDL_AUDIO_PLAYING : 0;
+}
+
+void audio_record(Recorder *r) { recorder = r; }
+
+// Marks where a track starts in the recording, with its device open but not
+// started yet.
+void audio_record_track(const char *path, const AParams *p)
+{
+    if (recorder) {
+        recorder_track(recorder, path, p->sr, audio_latency());
+    }
+}
+
+void audio_replay(const int on, const uint32_t latency)
+{
+    replaying = on;
+    replay_latency = latency;
 }
 
 static void callback(void *usrdata, unsigned char *stream, int len)
 {
     AParams *const p = (AParams *)usrdata;
+    const uint64_t audited = audit_begin();
+    const uint64_t traced = trace_now();
     if (p && p->buffer && (len > 0 && stream)) {
         const uint32_t ulen = (uint32_t)len;
         const uint32_t samples = ulen / sizeof(p->buffer[0]);
@@ -95,21 +232,27 @@ static void callback(void *usrdata, unsigned char *stream, int len)
         const uint32_t scount = (samples < remaining) ? samples : remaining;
 
         float *fstream = (float *)stream;
+        const float gain = vol * p->gain;
         // Every common audio file format (The ones im allowing to be
         // used) is spec'd to store its samples in interleaved format, so just pass
         // the data to stream as is.
         for (uint32_t i = 0; i < scount; i++) {
             fstream[i] = 0.0f;
             if (i + p->position < p->len) {
-                fstream[i] = p->buffer[i + p->position] * vol;
+                fstream[i] = p->buffer[i + p->position] * gain;
             }
         }
 
         if (p->position + scount <= p->len) {
-            fft_push(scount, p->position, p->buffer, p->sample_buffer);
+            if (recorder) {
+                recorder_chunk(recorder, p->pushed, p->buffer + p->position, scount);
+            }
+            fft_push(p, p->buffer + p->position, scount);
             p->position += scount;
         }
     }
+    trace_end(TRACE_CALLBACK, traced);
+    audit_end(audited);
 }
 
 static void set_audio_spec(AParams *const data)
@@ -119,9 +262,9 @@ static void set_audio_spec(AParams *const data)
     want.channels = data->channels;
     want.freq = data->sr;
     want.format = AUDIO_F32SYS;
-    want.samples = BUFFER_SIZE / data->channels;
+    want.samples = device_size / data->channels;
     want.silence = 0.0f;
-    want.size = BUFFER_SIZE * sizeof(float);
+    want.size = device_size * sizeof(float);
 }
 
 static int open_device(void)
@@ -132,6 +275,7 @@ static int open_device(void)
         return 0;
     }
     print_want_have();
+    audit_device(have.samples, have.freq);
     return 1;
 }
 
@@ -169,6 +313,7 @@ void toggle_pause(void)
 
         case SDL_AUDIO_PAUSED:
         {
+            audit_resume();
             SDL_PauseAudioDevice(dev, SDL_FALSE);
         } break;
         }
@@ -178,6 +323,7 @@ void toggle_pause(void)
 void audio_start(void)
 {
     if (dev) {
+        audit_resume();
         SDL_PauseAudioDevice(dev, SDL_FALSE);
     }
 }
@@ -232,7 +378,7 @@ AParams *read_file(const char *fp)
         return data;
     }
 
-    if (sfinfo.channels != 2) {
+    if (sfinfo.channels != AUDIO_CHANNELS) {
         printf("File must have 2 channels\n");
         return data;
     }
@@ -248,25 +394,71 @@ AParams *read_file(const char *fp)
     printf("SAMPLES %zu\n", samples);
     printf("=======\n");
 
-    float *tmp = NULL;
-    if (!(tmp = calloc(samples, sizeof(float)))) {
+    if (!(data->sample_buffer = calloc(history_size, sizeof(float)))) {
         printf("Could not allocate buffer: %s\n", strerror(errno));
         sf_close(file);
         return data;
     }
+    audio_prefault(data->sample_buffer, history_size * sizeof(float));
+    data->history = history_size;
 
-    // If 0 bytes are read it mostly indicates theres nothing to read, but sndfile
-    // will return -1 from this func if it attempts to read beyond the the end of
-    // the file, and will not report an error in this case. Query for error
-    // regardless.
-    if (sf_read_float(file, tmp, samples) < 0) {
-        printf("Error reading audio data: %s\n", sf_strerror(file));
-        free(tmp);
+    float *tmp = NULL;
+    if (!(tmp = calloc(samples, sizeof(float)))) {
+        printf("Could not allocate buffer: %s\n", strerror(errno));
         sf_close(file);
         return data;
     }
+
+    // Decoded in chunks so the loudness meter sees each one while it's still
+    // in cache instead of making a second pass over the whole track.
+    LoudnessResult loud = { 0 };
+    const int cached = normalize && loudness_cache_find(fp, &loud);
+    Loudness *meter = NULL;
+    if (normalize && !cached && !(meter = malloc(sizeof(Loudness)))) {
+        printf("Could not allocate memory: %s\n", strerror(errno));
+    }
+    if (meter) {
+        loudness_init(meter, sfinfo.samplerate);
+    }
+
+    // If 0 frames are read it mostly indicates theres nothing to read, but
+    // sndfile will also return 0 on a decode error partway through. Query for
+    // the error whenever a read comes up short.
+    size_t frames = 0;
+    while (frames < (size_t)sfinfo.frames) {
+        const size_t left = (size_t)sfinfo.frames - frames;
+        const size_t want_frames = (left < DECODE_CHUNK) ? left : DECODE_CHUNK;
+        float *const chunk = tmp + frames * sfinfo.channels;
+        const sf_count_t got = sf_readf_float(file, chunk, (sf_count_t)want_frames);
+        if (got <= 0) {
+            if (sf_error(file) != SF_ERR_NO_ERROR) {
+                printf("Error reading audio data: %s\n", sf_strerror(file));
+                free(meter);
+                free(tmp);
+                sf_close(file);
+                return data;
+            }
+            break;
+        }
+        if (meter) {
+            loudness_feed(meter, chunk, (size_t)got);
+        }
+        frames += (size_t)got;
+    }
     sf_close(file);
 
+    data->gain = 1.0f;
+    if (meter) {
+        loud = loudness_result(meter);
+        loudness_cache_store(fp, &loud);
+        free(meter);
+    }
+    if (cached || meter) {
+        data->gain = loudness_gain(&loud, loudness_target);
+        printf("LOUDNESS %.1f LUFS, PEAK %.1f dBTP, GAIN %.1f dB%s\n", loud.lufs, loud.peak,
+               20.0f * log10f(data->gain), cached ? " (cached)" : "");
+    }
+
     data->channels = sfinfo.channels;
     data->sr = sfinfo.samplerate;
     data->format = sfinfo.format;
@@ -303,6 +495,17 @@ int dev_from_data(AParams *const data)
     }
 }
 
+// Same as dev_from_data but the device runs cb instead of playing the buffer,
+// for replays.
+int dev_from_callback(AParams *const data, SDL_AudioCallback cb, void *user)
+{
+    close_device();
+    set_audio_spec(data);
+    want.callback = cb;
+    want.userdata = user;
+    return open_device();
+}
+
 int callback_check_pos(const uint32_t len, const uint32_t pos)
 {
     if (pos >= len) {
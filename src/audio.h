@@ -1,17 +1,25 @@
 #ifndef AUDIO_H
 #define AUDIO_H
 
+#include <SDL2/SDL_audio.h>
 #include <stddef.h>
 #include <stdint.h>
 
 #define BUFFER_SIZE (1 << 13)
-#define TWOBUFFER   (1 << 14)
+// Files are played as interleaved L/R, anything else is rejected.
+#define AUDIO_CHANNELS 2
+
+typedef struct Recorder Recorder;
 
 typedef struct
 {
     int valid;
     float *buffer;
-    float sample_buffer[TWOBUFFER];
+    // Ring of the most recent samples handed to the device, pushed counts
+    // every sample ever written so the write head is pushed % history.
+    float *sample_buffer;
+    uint32_t history;
+    uint64_t pushed;
     uint32_t position;
     uint32_t len;
     size_t samples;
@@ -19,13 +27,26 @@ typedef struct
     int channels;
     int format;
     int sr;
+    // Loudness normalisation, applied with the volume in the callback.
+    float gain;
 } AParams;
 
-void fft_push(uint32_t samples, uint32_t offset, const float srcbuf[], float dstbuf[]);
+void audio_configure(size_t fft_size);
+void audio_normalize(int on, float target);
+uint32_t audio_history(void);
+void audio_prefault(void *mem, size_t bytes);
+void fft_push(AParams *p, const float *src, uint32_t samples);
+uint64_t audio_snapshot(const AParams *p, float *dst, uint32_t count);
+uint64_t audio_position(const AParams *p);
+uint32_t audio_latency(void);
 int get_audio_state(void);
 void toggle_pause(void);
 AParams *read_file(const char *fp);
 int dev_from_data(AParams *data);
+int dev_from_callback(AParams *data, SDL_AudioCallback cb, void *user);
+void audio_record(Recorder *r);
+void audio_record_track(const char *path, const AParams *p);
+void audio_replay(int on, uint32_t latency);
 void _vol(float change);
 void audio_start(void);
 void audio_end(void);
@@ -0,0 +1,409 @@
+#define _GNU_SOURCE
+#include "audit.h"
+#include <dlfcn.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+static const char *kind_names[AUDIT_KINDS] = { "allocation", "lock", "sleep", "I/O" };
+
+// Everything the callback writes is a relaxed atomic, whoever reports only
+// needs each counter to be whole, not a consistent set.
+typedef struct
+{
+    atomic_uint_fast64_t buckets[AUDIT_BUCKETS];
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t max_ns;
+    // Longer than the buffer period, and longer than half of it.
+    atomic_uint_fast64_t overruns;
+    atomic_uint_fast64_t late;
+    // Callbacks that came more than 1.5 periods after the one before, the
+    // device ran dry in between.
+    atomic_uint_fast64_t underruns;
+    // Of the sampled callbacks, those the thread was switched out in or took
+    // page faults in.
+    atomic_uint_fast64_t sampled;
+    atomic_uint_fast64_t blocked;
+    atomic_uint_fast64_t minor_faults;
+    atomic_uint_fast64_t major_faults;
+    atomic_uint_fast64_t violations[AUDIT_KINDS];
+    atomic_uintptr_t first_caller[AUDIT_KINDS];
+    atomic_uint_fast64_t period_ns;
+    atomic_uint_fast64_t last_start;
+} Audit;
+
+int audit_enabled = 0;
+static Audit audit;
+static _Thread_local int in_callback = 0;
+static uint64_t last_report = 0;
+static uint64_t reported_problems = 0;
+
+static uint64_t audit_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void audit_init(const int on)
+{
+    memset(&audit, 0, sizeof(audit));
+    audit_enabled = on;
+    last_report = audit_now();
+    if (on) {
+#ifdef AUDIT_WRAP
+        printf("Auditing the audio callback, allocations, locks, sleeps and I/O in it are flagged\n");
+#else
+        printf("Auditing the audio callback, build with CMAKE_BUILD_TYPE=Debug to flag allocations and locks\n");
+#endif
+    }
+}
+
+// The deadline: a callback has one buffer period to fill the next buffer.
+void audit_device(const uint32_t frames, const int freq)
+{
+    if (freq > 0) {
+        atomic_store_explicit(&audit.period_ns, (uint64_t)frames * 1000000000ull / (uint64_t)freq,
+                              memory_order_relaxed);
+    }
+    audit_resume();
+}
+
+// After a pause there's a gap that isn't the device running dry.
+void audit_resume(void) { atomic_store_explicit(&audit.last_start, 0, memory_order_relaxed); }
+
+static void thread_usage(struct rusage *ru)
+{
+    if (getrusage(RUSAGE_THREAD, ru) < 0) {
+        memset(ru, 0, sizeof(*ru));
+    }
+}
+
+// The two rusage reads are the only syscalls the audit itself makes in the
+// callback. Neither blocks, and they're only made on every
+// AUDIT_USAGE_EVERY-th call.
+static _Thread_local struct rusage usage_start;
+static _Thread_local int usage_sampled = 0;
+
+uint64_t audit_begin(void)
+{
+    if (!audit_enabled) {
+        return 0;
+    }
+    const uint64_t now = audit_now();
+    const uint64_t period = atomic_load_explicit(&audit.period_ns, memory_order_relaxed);
+    const uint64_t last = atomic_exchange_explicit(&audit.last_start, now, memory_order_relaxed);
+    if (last && period && now - last > period + period / 2) {
+        atomic_fetch_add_explicit(&audit.underruns, 1, memory_order_relaxed);
+    }
+    usage_sampled = atomic_load_explicit(&audit.count, memory_order_relaxed) % AUDIT_USAGE_EVERY == 0;
+    if (usage_sampled) {
+        thread_usage(&usage_start);
+    }
+    in_callback = 1;
+    return now;
+}
+
+void audit_end(const uint64_t start)
+{
+    if (!audit_enabled) {
+        return;
+    }
+    in_callback = 0;
+    const uint64_t ns = audit_now() - start;
+
+    int b = 0;
+    for (uint64_t us = ns / 1000; us > 0 && b < AUDIT_BUCKETS - 1; us >>= 1) {
+        b++;
+    }
+    atomic_fetch_add_explicit(&audit.buckets[b], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&audit.count, 1, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&audit.max_ns, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&audit.max_ns, &max, ns, memory_order_relaxed,
+                                                              memory_order_relaxed)) {
+    }
+
+    const uint64_t period = atomic_load_explicit(&audit.period_ns, memory_order_relaxed);
+    if (period && ns > period) {
+        atomic_fetch_add_explicit(&audit.overruns, 1, memory_order_relaxed);
+    }
+    if (period && ns > period / 2) {
+        atomic_fetch_add_explicit(&audit.late, 1, memory_order_relaxed);
+    }
+
+    if (!usage_sampled) {
+        return;
+    }
+    struct rusage ru;
+    thread_usage(&ru);
+    const long switches = ru.ru_nvcsw - usage_start.ru_nvcsw;
+    const long minor = ru.ru_minflt - usage_start.ru_minflt;
+    const long major = ru.ru_majflt - usage_start.ru_majflt;
+    atomic_fetch_add_explicit(&audit.sampled, 1, memory_order_relaxed);
+    if (switches > 0 || minor > 0 || major > 0) {
+        atomic_fetch_add_explicit(&audit.blocked, 1, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&audit.minor_faults, (uint64_t)(minor > 0 ? minor : 0), memory_order_relaxed);
+    atomic_fetch_add_explicit(&audit.major_faults, (uint64_t)(major > 0 ? major : 0), memory_order_relaxed);
+}
+
+// From the wrappers, counts only on the audio thread inside the callback.
+void audit_flag(const AuditKind kind, void *caller)
+{
+    if (!in_callback) {
+        return;
+    }
+    atomic_fetch_add_explicit(&audit.violations[kind], 1, memory_order_relaxed);
+    uintptr_t none = 0;
+    atomic_compare_exchange_strong_explicit(&audit.first_caller[kind], &none, (uintptr_t)caller,
+                                            memory_order_relaxed, memory_order_relaxed);
+}
+
+// Upper edge of the bucket the q-th fraction of callbacks falls in.
+static double bucket_quantile(const uint64_t *buckets, const uint64_t count, const double q)
+{
+    const uint64_t want = (uint64_t)((double)count * q);
+    uint64_t seen = 0;
+    for (int b = 0; b < AUDIT_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen > want) {
+            return (double)(1ull << b);
+        }
+    }
+    return (double)(1ull << (AUDIT_BUCKETS - 1));
+}
+
+static uint64_t audit_problems(void)
+{
+    uint64_t n = atomic_load(&audit.overruns) + atomic_load(&audit.underruns) + atomic_load(&audit.blocked);
+    for (int k = 0; k < AUDIT_KINDS; k++) {
+        n += atomic_load(&audit.violations[k]);
+    }
+    return n;
+}
+
+void audit_report(void)
+{
+    if (!audit_enabled) {
+        return;
+    }
+    uint64_t buckets[AUDIT_BUCKETS];
+    for (int b = 0; b < AUDIT_BUCKETS; b++) {
+        buckets[b] = atomic_load_explicit(&audit.buckets[b], memory_order_relaxed);
+    }
+    const uint64_t count = atomic_load(&audit.count);
+    const double period = (double)atomic_load(&audit.period_ns) / 1000.0;
+    printf("Audio callback: %llu calls, p50 < %.0f us, p99 < %.0f us, max %.1f us of a %.0f us period\n",
+           (unsigned long long)count, bucket_quantile(buckets, count, 0.5), bucket_quantile(buckets, count, 0.99),
+           (double)atomic_load(&audit.max_ns) / 1000.0, period);
+    printf("  %llu over the period, %llu over half of it, %llu likely underruns\n",
+           (unsigned long long)atomic_load(&audit.overruns), (unsigned long long)atomic_load(&audit.late),
+           (unsigned long long)atomic_load(&audit.underruns));
+    printf("  %llu of %llu sampled calls blocked or faulted (%llu minor, %llu major page faults)\n",
+           (unsigned long long)atomic_load(&audit.blocked), (unsigned long long)atomic_load(&audit.sampled),
+           (unsigned long long)atomic_load(&audit.minor_faults), (unsigned long long)atomic_load(&audit.major_faults));
+
+    for (int k = 0; k < AUDIT_KINDS; k++) {
+        const uint64_t n = atomic_load(&audit.violations[k]);
+        if (n == 0) {
+            continue;
+        }
+        // Offset into the object so addr2line works whatever the load address.
+        void *const caller = (void *)atomic_load(&audit.first_caller[k]);
+        Dl_info info;
+        if (dladdr(caller, &info) && info.dli_fname) {
+            printf("  %llu %s calls, first from %s+0x%lx\n", (unsigned long long)n, kind_names[k], info.dli_fname,
+                   (unsigned long)((char *)caller - (char *)info.dli_fbase));
+        } else {
+            printf("  %llu %s calls, first from %p\n", (unsigned long long)n, kind_names[k], caller);
+        }
+    }
+    reported_problems = audit_problems();
+}
+
+// From the render loop, reports every AUDIT_REPORT_MS when there's something
+// new to report.
+void audit_poll(void)
+{
+    if (!audit_enabled) {
+        return;
+    }
+    const uint64_t now = audit_now();
+    if (now - last_report >= (uint64_t)AUDIT_REPORT_MS * 1000000ull) {
+        last_report = now;
+        if (audit_problems() != reported_problems) {
+            audit_report();
+        }
+    }
+}
+
+// Debug builds link with -Wl,--wrap for each of these, so every call our code
+// makes goes through here first. The callback's own thread is flagged, the
+// rest pass straight through.
+#ifdef AUDIT_WRAP
+#include <SDL2/SDL.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define AUDIT_CALLER __builtin_return_address(0)
+
+void *__real_malloc(size_t n);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t n);
+void __real_free(void *p);
+int __real_pthread_mutex_lock(pthread_mutex_t *m);
+int __real_SDL_LockMutex(SDL_mutex *m);
+int __real_SDL_CondWait(SDL_cond *c, SDL_mutex *m);
+void __real_SDL_Delay(Uint32 ms);
+int __real_nanosleep(const struct timespec *req, struct timespec *rem);
+FILE *__real_fopen(const char *path, const char *mode);
+size_t __real_fwrite(const void *p, size_t size, size_t n, FILE *f);
+size_t __real_fread(void *p, size_t size, size_t n, FILE *f);
+ssize_t __real_write(int fd, const void *p, size_t n);
+ssize_t __real_read(int fd, void *p, size_t n);
+int __real_puts(const char *s);
+int __real_putchar(int c);
+int __real_fputc(int c, FILE *f);
+int __real_putc(int c, FILE *f);
+int __real_fputs(const char *s, FILE *f);
+
+void *__wrap_malloc(size_t n)
+{
+    audit_flag(AUDIT_ALLOC, AUDIT_CALLER);
+    return __real_malloc(n);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    audit_flag(AUDIT_ALLOC, AUDIT_CALLER);
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t n)
+{
+    audit_flag(AUDIT_ALLOC, AUDIT_CALLER);
+    return __real_realloc(p, n);
+}
+
+void __wrap_free(void *p)
+{
+    audit_flag(AUDIT_ALLOC, AUDIT_CALLER);
+    __real_free(p);
+}
+
+int __wrap_pthread_mutex_lock(pthread_mutex_t *m)
+{
+    audit_flag(AUDIT_LOCK, AUDIT_CALLER);
+    return __real_pthread_mutex_lock(m);
+}
+
+int __wrap_SDL_LockMutex(SDL_mutex *m)
+{
+    audit_flag(AUDIT_LOCK, AUDIT_CALLER);
+    return __real_SDL_LockMutex(m);
+}
+
+int __wrap_SDL_CondWait(SDL_cond *c, SDL_mutex *m)
+{
+    audit_flag(AUDIT_LOCK, AUDIT_CALLER);
+    return __real_SDL_CondWait(c, m);
+}
+
+void __wrap_SDL_Delay(Uint32 ms)
+{
+    audit_flag(AUDIT_SLEEP, AUDIT_CALLER);
+    __real_SDL_Delay(ms);
+}
+
+int __wrap_nanosleep(const struct timespec *req, struct timespec *rem)
+{
+    audit_flag(AUDIT_SLEEP, AUDIT_CALLER);
+    return __real_nanosleep(req, rem);
+}
+
+FILE *__wrap_fopen(const char *path, const char *mode)
+{
+    audit_flag(AUDIT_IO, AUDIT_CALLER);
+    return __real_fopen(path, mode);
+}
+
+size_t __wrap_fwrite(const void *p, size_t size, size_t n, FILE *f)
+{
+    audit_flag(AUDIT_IO, AUDIT_CALLER);
+    return __real_fwrite(p, size, n, f);
+}
+
+size_t __wrap_fread(void *p, size_t size, size_t n, FILE *f)
+{
+    audit_flag(AUDIT_IO, AUDIT_CALLER);
+    return __real_fread(p, size, n, f);
+}
+
+ssize_t __wrap_write(int fd, const void *p, size_t n)
+{
+    audit_flag(AUDIT_IO, AUDIT_CALLER);
+    return __real_write(fd, p, n);
+}
+
+ssize_t __wrap_read(int fd, void *p, size_t n)
+{
+    audit_flag(AUDIT_IO, AUDIT_CALLER);
+    return __real_read(fd, p, n);
+}
+
+int __wrap_puts(const char *s)
+{
+    audit_flag(AUDIT_IO, AUDIT_CALLER);
+    return __real_puts(s);
+}
+
+int __wrap_putchar(int c)
+{
+    audit_flag(AUDIT_IO, AUDIT_CALLER);
+    return __real_putchar(c);
+}
+
+int __wrap_fputc(int c, FILE *f)
+{
+    audit_flag(AUDIT_IO, AUDIT_CALLER);
+    return __real_fputc(c, f);
+}
+
+// What putchar becomes with optimisation on.
+int __wrap_putc(int c, FILE *f)
+{
+    audit_flag(AUDIT_IO, AUDIT_CALLER);
+    return __real_putc(c, f);
+}
+
+int __wrap_fputs(const char *s, FILE *f)
+{
+    audit_flag(AUDIT_IO, AUDIT_CALLER);
+    return __real_fputs(s, f);
+}
+
+// The printf family has no va_list twin to forward to under --wrap, the v
+// versions do the same job.
+int __wrap_printf(const char *fmt, ...)
+{
+    audit_flag(AUDIT_IO, AUDIT_CALLER);
+    va_list ap;
+    va_start(ap, fmt);
+    const int n = vprintf(fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+int __wrap_fprintf(FILE *f, const char *fmt, ...)
+{
+    audit_flag(AUDIT_IO, AUDIT_CALLER);
+    va_list ap;
+    va_start(ap, fmt);
+    const int n = vfprintf(f, fmt, ap);
+    va_end(ap);
+    return n;
+}
+#endif
@@ -0,0 +1,37 @@
+#ifndef AUDIT_H
+#define AUDIT_H
+
+#include <stdint.h>
+
+// Power of two microsecond buckets, the last one takes everything from
+// 2^(AUDIT_BUCKETS - 2) us up.
+#define AUDIT_BUCKETS 24
+// How often audit_poll prints, if anything went wrong since last time.
+#define AUDIT_REPORT_MS 10000
+// Every this many callbacks are checked for blocking and page faults. That
+// takes two getrusage calls in the callback, about 0.2 us each.
+#define AUDIT_USAGE_EVERY 8
+
+// What the callback shouldn't be doing. Only calls made from our own code
+// are seen, and only in builds linked with the wrappers (Debug).
+typedef enum
+{
+    AUDIT_ALLOC,
+    AUDIT_LOCK,
+    AUDIT_SLEEP,
+    AUDIT_IO,
+    AUDIT_KINDS,
+} AuditKind;
+
+extern int audit_enabled;
+
+void audit_init(int on);
+void audit_device(uint32_t frames, int freq);
+void audit_resume(void);
+uint64_t audit_begin(void);
+void audit_end(uint64_t start);
+void audit_flag(AuditKind kind, void *caller);
+void audit_poll(void);
+void audit_report(void);
+
+#endif
@@ -0,0 +1,328 @@
+#include "batch.h"
+#include "audio.h"
+#include "entry.h"
+#include "worker.h"
+#include <SDL2/SDL.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char BATCH_MAGIC[8] = { 'R', 'T', 'A', 'V', 'B', 'A', 'N', 'D' };
+
+// The track being analysed and how far the chunks of it have got. Everything
+// but frames is only touched under lock.
+typedef struct
+{
+    const Config *cfg;
+    size_t stride;
+    SDL_mutex *lock;
+    SDL_cond *work;
+    SDL_cond *done;
+
+    const AParams *p;
+    float *frames;
+    uint64_t count;
+    uint64_t chunks;
+    uint64_t next;
+    uint64_t finished;
+    int quit;
+} Batch;
+
+typedef struct
+{
+    Batch *batch;
+    Raw raw;
+    float *scratch;
+    float *warm;
+    SDL_Thread *thread;
+} BatchThread;
+
+// Chunks only share the audio they read, every frame lands in its own slot
+// of the output so the order never depends on which thread got there first.
+static void batch_chunk(BatchThread *t, const uint64_t c)
+{
+    Batch *const b = t->batch;
+    const uint64_t first = c * BATCH_CHUNK;
+    const uint64_t last = (first + BATCH_CHUNK < b->count) ? first + BATCH_CHUNK : b->count;
+
+    raw_reset(&t->raw);
+    if (first > 0) {
+        analyze_frame(&t->raw, b->p, first - 1, t->scratch, t->warm);
+    }
+    for (uint64_t k = first; k < last; k++) {
+        analyze_frame(&t->raw, b->p, k, t->scratch, b->frames + k * b->stride);
+    }
+}
+
+static int batch_thread(void *data)
+{
+    BatchThread *const t = (BatchThread *)data;
+    Batch *const b = t->batch;
+
+    SDL_LockMutex(b->lock);
+    while (!b->quit) {
+        if (b->next < b->chunks) {
+            const uint64_t c = b->next++;
+            SDL_UnlockMutex(b->lock);
+            batch_chunk(t, c);
+            SDL_LockMutex(b->lock);
+            if (++b->finished == b->chunks) {
+                SDL_CondSignal(b->done);
+            }
+            continue;
+        }
+        SDL_CondWait(b->work, b->lock);
+    }
+    SDL_UnlockMutex(b->lock);
+    return 0;
+}
+
+// Hands every chunk of a track to the threads and waits for the last one.
+static void batch_track(Batch *b, const AParams *p, float *frames, const uint64_t count)
+{
+    SDL_LockMutex(b->lock);
+    b->p = p;
+    b->frames = frames;
+    b->count = count;
+    b->chunks = (count + BATCH_CHUNK - 1) / BATCH_CHUNK;
+    b->next = 0;
+    b->finished = 0;
+    SDL_CondBroadcast(b->work);
+    while (b->finished < b->chunks) {
+        SDL_CondWait(b->done, b->lock);
+    }
+    SDL_UnlockMutex(b->lock);
+}
+
+static int write_header(FILE *out, const Config *cfg, const int csv)
+{
+    if (csv) {
+        fprintf(out, "track,frame,seconds");
+        for (int i = 0; i < DIVISOR; i++) {
+            fprintf(out, ",bar%d", i);
+        }
+        for (int i = 0; i < cfg->featurec; i++) {
+            fprintf(out, ",%s", cfg->features[i]->name);
+        }
+        return fprintf(out, "\n") > 0;
+    }
+
+    BatchHeader head = {
+        .version = BATCH_VERSION,
+        .bars = DIVISOR,
+        .featurec = (uint32_t)cfg->featurec,
+        .hop = cfg->hop,
+        .fft_size = (uint32_t)cfg->fft_size,
+        .mode = (uint32_t)cfg->mode,
+    };
+    memcpy(head.magic, BATCH_MAGIC, sizeof(head.magic));
+    int ok = fwrite(&head, sizeof(head), 1, out) == 1;
+    for (int i = 0; ok && i < cfg->featurec; i++) {
+        const char *name = cfg->features[i]->name;
+        ok = fwrite(name, 1, strlen(name) + 1, out) == strlen(name) + 1;
+    }
+    return ok;
+}
+
+static int write_track(FILE *out, const Batch *b, const char *path, const int sr, const int csv)
+{
+    if (!csv) {
+        const uint32_t len = (uint32_t)strlen(path);
+        const uint32_t rate = (uint32_t)sr;
+        const size_t values = b->count * b->stride;
+        return fwrite(&len, sizeof(len), 1, out) == 1 && fwrite(path, 1, len, out) == len &&
+               fwrite(&rate, sizeof(rate), 1, out) == 1 && fwrite(&b->count, sizeof(b->count), 1, out) == 1 &&
+               fwrite(b->frames, sizeof(float), values, out) == values;
+    }
+
+    // Quotes in the path are doubled, the CSV way.
+    char quoted[2 * PATH_MAX + 3];
+    size_t q = 0;
+    quoted[q++] = '"';
+    for (const char *c = path; *c && q < sizeof(quoted) - 2; c++) {
+        if (*c == '"') {
+            quoted[q++] = '"';
+        }
+        quoted[q++] = *c;
+    }
+    quoted[q++] = '"';
+    quoted[q] = '\0';
+
+    for (uint64_t k = 0; k < b->count; k++) {
+        const float *const frame = b->frames + k * b->stride;
+        fprintf(out, "%s,%llu,%.6f", quoted, (unsigned long long)k, (double)(k * b->cfg->hop) / sr);
+        for (size_t i = 0; i < b->stride; i++) {
+            fprintf(out, ",%.6g", frame[i]);
+        }
+        if (fprintf(out, "\n") < 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int by_path(const void *a, const void *b)
+{
+    return strcmp((*(const Entry *const *)a)->fullpath, (*(const Entry *const *)b)->fullpath);
+}
+
+static void *free_track(AParams *p)
+{
+    if (p) {
+        free(p->buffer);
+        free(p->sample_buffer);
+        free(p);
+    }
+    return NULL;
+}
+
+// Every audio file in cfg->directory, in path order so the output is the
+// same from run to run whatever order the directory lists them in.
+static int batch_tracks(Batch *b, FILE *out, const int csv)
+{
+    Entries ents = read_directory(b->cfg->directory);
+    if (ents.malformed || ents.size == 0 || parse_headers(&ents) == 0) {
+        printf("Directory contains no audio files\n");
+        free(ents.list);
+        return 0;
+    }
+
+    const Entry **tracks = malloc(ents.size * sizeof(Entry *));
+    if (!tracks) {
+        printf("Could not allocate memory: %s\n", strerror(errno));
+        free(ents.list);
+        return 0;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < ents.size; i++) {
+        if (ents.list[i].is_audio_file) {
+            tracks[count++] = &ents.list[i];
+        }
+    }
+    qsort(tracks, count, sizeof(Entry *), by_path);
+
+    const uint64_t freq = SDL_GetPerformanceFrequency();
+    const uint64_t started = SDL_GetPerformanceCounter();
+    double audio = 0.0;
+    int ok = 1;
+    for (size_t i = 0; ok && i < count; i++) {
+        const char *path = tracks[i]->fullpath;
+        const uint64_t t0 = SDL_GetPerformanceCounter();
+        AParams *p = read_file(path);
+        if (!p || !p->valid) {
+            printf("Skipping %s\n", path);
+            p = free_track(p);
+            continue;
+        }
+
+        const uint64_t frames = p->len / AUDIO_CHANNELS / b->cfg->hop + 1;
+        float *const data = malloc(frames * b->stride * sizeof(float));
+        if (!data) {
+            printf("Could not allocate memory: %s\n", strerror(errno));
+            p = free_track(p);
+            continue;
+        }
+
+        const uint64_t t1 = SDL_GetPerformanceCounter();
+        batch_track(b, p, data, frames);
+        const uint64_t t2 = SDL_GetPerformanceCounter();
+        ok = write_track(out, b, path, p->sr, csv);
+        if (!ok) {
+            printf("Could not write %s: %s\n", b->cfg->out, strerror(errno));
+        }
+
+        const double seconds = (double)p->len / AUDIO_CHANNELS / p->sr;
+        audio += seconds;
+        printf("[%zu/%zu] %s: %llu frames, decode %.2f s, analysis %.2f s, %.0fx real time\n", i + 1, count, path,
+               (unsigned long long)frames, (double)(t1 - t0) / freq, (double)(t2 - t1) / freq,
+               seconds * freq / (double)(SDL_GetPerformanceCounter() - t0));
+        free(data);
+        p = free_track(p);
+    }
+
+    const double total = (double)(SDL_GetPerformanceCounter() - started) / freq;
+    printf("Analysed %.0f s of audio in %.2f s, %.0fx real time\n", audio, total, (total > 0.0) ? audio / total : 0.0);
+    free(tracks);
+    free(ents.list);
+    return ok;
+}
+
+// Headless --analyze: no window or audio device, the tracks are decoded and
+// cut into chunks that all threads work through, one track at a time.
+int batch_run(const Config *cfg)
+{
+    const int csv = strlen(cfg->out) > 4 && strcmp(cfg->out + strlen(cfg->out) - 4, ".csv") == 0;
+    int jobs = cfg->jobs ? cfg->jobs : SDL_GetCPUCount();
+    jobs = (jobs > 0) ? jobs : 1;
+
+    Batch b = { 0 };
+    b.cfg = cfg;
+    b.stride = DIVISOR + (size_t)cfg->featurec;
+    b.lock = SDL_CreateMutex();
+    b.work = SDL_CreateCond();
+    b.done = SDL_CreateCond();
+    BatchThread *threads = calloc((size_t)jobs, sizeof(BatchThread));
+    FILE *out = NULL;
+
+    int ok = b.lock && b.work && b.done && threads;
+    if (!ok) {
+        printf("Could not allocate memory: %s\n", strerror(errno));
+    }
+
+    // All the analysis state is made up front so a thread never fails halfway.
+    // started only counts threads that are running, a slot that failed is
+    // freed here.
+    int started = 0;
+    while (ok && started < jobs) {
+        BatchThread *const t = &threads[started];
+        t->batch = &b;
+        t->scratch = fft_alloc(cfg->fft_size * AUDIO_CHANNELS, sizeof(float));
+        t->warm = malloc(b.stride * sizeof(float));
+        if (!raw_init(&t->raw, cfg) || !t->scratch || !t->warm) {
+            printf("Could not allocate memory: %s\n", strerror(errno));
+            ok = 0;
+        } else if (!(t->thread = SDL_CreateThread(batch_thread, "batch", t))) {
+            printf("Could not start an analysis thread: %s\n", SDL_GetError());
+            ok = 0;
+        }
+        if (!ok) {
+            raw_free(&t->raw);
+            free(t->scratch);
+            free(t->warm);
+            break;
+        }
+        started++;
+    }
+
+    if (ok && !(out = fopen(cfg->out, "wb"))) {
+        printf("Could not open %s: %s\n", cfg->out, strerror(errno));
+        ok = 0;
+    }
+    if (ok) {
+        printf("Analysing %s into %s (%s) on %d threads\n", cfg->directory, cfg->out, csv ? "csv" : "binary", jobs);
+        ok = write_header(out, cfg, csv) && batch_tracks(&b, out, csv);
+    }
+    if (out && fclose(out) == EOF) {
+        printf("Failed to close file: %s\n", strerror(errno));
+        ok = 0;
+    }
+
+    if (b.lock) {
+        SDL_LockMutex(b.lock);
+        b.quit = 1;
+        SDL_CondBroadcast(b.work);
+        SDL_UnlockMutex(b.lock);
+    }
+    for (int i = 0; threads && i < started; i++) {
+        SDL_WaitThread(threads[i].thread, NULL);
+        raw_free(&threads[i].raw);
+        free(threads[i].scratch);
+        free(threads[i].warm);
+    }
+    free(threads);
+    SDL_DestroyCond(b.work);
+    SDL_DestroyCond(b.done);
+    SDL_DestroyMutex(b.lock);
+    return ok;
+}
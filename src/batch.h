@@ -0,0 +1,30 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "config.h"
+#include <stdint.h>
+
+// Frames per chunk handed to a thread. Each chunk also analyses the frame
+// before it so features that look back come out the same as a straight run.
+#define BATCH_CHUNK 512
+#define BATCH_VERSION 1
+
+// Binary --out files start with this, then featurec nul terminated feature
+// names. Per track follows a uint32 path length, the path, a uint32 sample
+// rate, a uint64 frame count and frames of DIVISOR + featurec floats: bar
+// power, then the features. Frame k ends at k * hop. Tracks are in path
+// order, numbers in host byte order.
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t bars;
+    uint32_t featurec;
+    uint32_t hop;
+    uint32_t fft_size;
+    uint32_t mode;
+} BatchHeader;
+
+int batch_run(const Config *cfg);
+
+#endif
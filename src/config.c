@@ -0,0 +1,542 @@
+#include "config.h"
+#include "audio.h"
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const struct
+{
+    AnalyzeMode mode;
+    const char *name;
+} mode_names[] = {
+    { ANALYZE_FFT, "fft" },
+    { ANALYZE_SDFT, "sdft" },
+    { ANALYZE_CQT, "cqt" },
+    { ANALYZE_MULTIRES, "multires" },
+};
+
+static const size_t modec = sizeof(mode_names) / sizeof(mode_names[0]);
+
+static const struct
+{
+    ChannelMode channels;
+    const char *name;
+} channel_names[] = {
+    { CHANNELS_MONO, "mono" },
+    { CHANNELS_STEREO, "stereo" },
+    { CHANNELS_MIDSIDE, "midside" },
+};
+
+static const size_t channelc = sizeof(channel_names) / sizeof(channel_names[0]);
+
+static void config_defaults(Config *cfg)
+{
+    cfg->directory = NULL;
+    cfg->analyze = 0;
+    cfg->out = NULL;
+    cfg->jobs = 0;
+    cfg->record = NULL;
+    cfg->replay = NULL;
+    cfg->replay_fast = 0;
+    cfg->trace = 0;
+    cfg->audit = 0;
+    cfg->fft_size = BUFFER_SIZE;
+    cfg->hop = DEFAULT_HOP;
+    cfg->window = WINDOW_HAMMING;
+    cfg->kaiser_beta = 8.6f;
+    cfg->mode = ANALYZE_FFT;
+    cfg->channels = CHANNELS_MONO;
+    post_defaults(&cfg->post);
+    cfg->onset_threshold = 1.5f;
+    cfg->normalize = 1;
+    cfg->loudness_target = -18.0f;
+    cfg->spectrogram = 1;
+    cfg->spectrogram_bits = 8;
+
+    cfg->featurec = 0;
+    while (cfg->featurec < FEATURE_MAX && feature_builtin(cfg->featurec)) {
+        cfg->features[cfg->featurec] = feature_builtin(cfg->featurec);
+        cfg->featurec++;
+    }
+}
+
+static void usage(void)
+{
+    printf("Usage: rtav [options] <directory>\n");
+    printf("       rtav [options] --analyze <directory> --out <file>\n");
+    printf("  --config <file>        read options from file (key = value per line)\n");
+    printf("  --analyze <directory>  no window, write every track's bars and features to --out\n");
+    printf("  --out <file>           .csv for text, anything else for binary\n");
+    printf("  --jobs <n>             threads for --analyze, defaults to one per core\n");
+    printf("  --record <file>        log every chunk the audio callback plays\n");
+    printf("  --replay <file>        no window, play a --record log through the analysis\n");
+    printf("  --replay-speed <name>  recorded (default) or fast\n");
+    printf("  --trace <on|off>       time every stage, print p50/p99 and dump traces on SIGUSR1 or t\n");
+    printf("  --audit <on|off>       check the audio callback for overruns, underruns and blocking\n");
+    printf("  --fft-size <n>         power of two, %d-%d\n", MIN_FFT_SIZE, MAX_FFT_SIZE);
+    printf("  --hop <n>              new samples between analyses\n");
+    printf("  --window <name>        hamming, hann, blackman-harris, kaiser, flat-top\n");
+    printf("  --kaiser-beta <f>      shape of the kaiser window\n");
+    printf("  --mode <name>          fft, sdft, cqt, multires\n");
+    printf("  --channels <name>      mono, stereo, midside\n");
+    printf("  --post <list>          stages after the analysis, in order: gain, a-weight, db,\n");
+    printf("                         envelope, then peak and smear. gain and a-weight go before db\n");
+    printf("  --gain <f>             gain stage in dB\n");
+    printf("  --db-floor <f>         level in dB shown as an empty bar (0 is full scale)\n");
+    printf("  --db-ceil <f>          level in dB shown as a full bar\n");
+    printf("  --attack <ms>          envelope rise time\n");
+    printf("  --release <ms>         envelope fall time\n");
+    printf("  --peak-hold <ms>       how long a peak stays up before falling\n");
+    printf("  --peak-fall <f>        peak fall speed in bar heights per second\n");
+    printf("  --smear <ms>           smear trail time\n");
+    printf("  --features <list>      rms, centroid, flatness, rolloff, flux or none, passed to\n");
+    printf("                         the shaders as feature_<name>\n");
+    printf("  --onset-threshold <f>  deviations above the mean flux an onset needs\n");
+    printf("  --normalize <on|off>   play every track at the same loudness\n");
+    printf("  --loudness-target <f>  LUFS tracks are normalised to\n");
+    printf("  --spectrogram-cache <on|off>\n");
+    printf("                         keep every track's analysis on disk and play it back\n");
+    printf("  --spectrogram-bits <n> 8 or 16 bits per stored value\n");
+}
+
+static int parse_float(const char *value, float *out)
+{
+    char *end = NULL;
+    const float v = strtof(value, &end);
+    if (end == value || *end != '\0' || !isfinite(v)) {
+        return 0;
+    }
+    *out = v;
+    return 1;
+}
+
+static int parse_uint(const char *value, unsigned long *out)
+{
+    char *end = NULL;
+    errno = 0;
+    const unsigned long v = strtoul(value, &end, 10);
+    if (errno || end == value || *end != '\0') {
+        return 0;
+    }
+    *out = v;
+    return 1;
+}
+
+static int parse_features(Config *cfg, const char *value)
+{
+    char buf[256];
+    if (strlen(value) >= sizeof(buf)) {
+        printf("features list is too long\n");
+        return 0;
+    }
+    strcpy(buf, value);
+
+    int count = 0;
+    for (char *name = strtok(buf, ", "); name; name = strtok(NULL, ", ")) {
+        if (strcmp(name, "none") == 0) {
+            continue;
+        }
+
+        const Extractor *ex = feature_find(name);
+        if (!ex) {
+            printf("Unknown feature: %s\n", name);
+            return 0;
+        }
+        if (count >= FEATURE_MAX) {
+            printf("At most %d features\n", FEATURE_MAX);
+            return 0;
+        }
+        cfg->features[count++] = ex;
+    }
+    cfg->featurec = count;
+    return 1;
+}
+
+// Applies a single key. Keys are the long option names without the dashes.
+static int config_set(Config *cfg, const char *key, const char *value)
+{
+    unsigned long n = 0;
+    if (strcmp(key, "fft-size") == 0) {
+        if (!parse_uint(value, &n) || n < MIN_FFT_SIZE || n > MAX_FFT_SIZE || (n & (n - 1)) != 0) {
+            printf("fft-size must be a power of two between %d and %d\n", MIN_FFT_SIZE, MAX_FFT_SIZE);
+            return 0;
+        }
+        cfg->fft_size = n;
+        return 1;
+    }
+
+    if (strcmp(key, "hop") == 0) {
+        if (!parse_uint(value, &n) || n == 0) {
+            printf("hop must be a positive number of samples\n");
+            return 0;
+        }
+        cfg->hop = (uint32_t)n;
+        return 1;
+    }
+
+    if (strcmp(key, "window") == 0) {
+        if (!window_from_name(value, &cfg->window)) {
+            printf("Unknown window: %s\n", value);
+            return 0;
+        }
+        return 1;
+    }
+
+    if (strcmp(key, "kaiser-beta") == 0) {
+        float beta = 0.0f;
+        if (!parse_float(value, &beta) || beta < 0.0f) {
+            printf("kaiser-beta must be a finite, non-negative number\n");
+            return 0;
+        }
+        cfg->kaiser_beta = beta;
+        return 1;
+    }
+
+    if (strcmp(key, "post") == 0) {
+        return post_parse_stages(&cfg->post, value);
+    }
+
+    if (strcmp(key, "gain") == 0) {
+        if (!parse_float(value, &cfg->post.gain)) {
+            printf("gain must be a number\n");
+            return 0;
+        }
+        return 1;
+    }
+
+    if (strcmp(key, "db-floor") == 0) {
+        if (!parse_float(value, &cfg->post.floor)) {
+            printf("db-floor must be a number\n");
+            return 0;
+        }
+        return 1;
+    }
+
+    if (strcmp(key, "db-ceil") == 0) {
+        if (!parse_float(value, &cfg->post.ceil)) {
+            printf("db-ceil must be a number\n");
+            return 0;
+        }
+        return 1;
+    }
+
+    // Times and speeds for the post stages, none of them can go negative.
+    const struct
+    {
+        const char *key;
+        float *out;
+    } times[] = {
+        { "attack", &cfg->post.attack },
+        { "release", &cfg->post.release },
+        { "peak-hold", &cfg->post.hold },
+        { "peak-fall", &cfg->post.fall },
+        { "smear", &cfg->post.smear },
+    };
+    for (size_t i = 0; i < sizeof(times) / sizeof(times[0]); i++) {
+        if (strcmp(key, times[i].key) == 0) {
+            if (!parse_float(value, times[i].out) || *times[i].out < 0.0f) {
+                printf("%s must be a non-negative number\n", key);
+                return 0;
+            }
+            return 1;
+        }
+    }
+
+    if (strcmp(key, "onset-threshold") == 0) {
+        if (!parse_float(value, &cfg->onset_threshold) || cfg->onset_threshold < 0.0f) {
+            printf("onset-threshold must be a non-negative number\n");
+            return 0;
+        }
+        return 1;
+    }
+
+    if (strcmp(key, "normalize") == 0) {
+        if (strcmp(value, "on") != 0 && strcmp(value, "off") != 0) {
+            printf("normalize must be on or off\n");
+            return 0;
+        }
+        cfg->normalize = strcmp(value, "on") == 0;
+        return 1;
+    }
+
+    if (strcmp(key, "trace") == 0) {
+        if (strcmp(value, "on") != 0 && strcmp(value, "off") != 0) {
+            printf("trace must be on or off\n");
+            return 0;
+        }
+        cfg->trace = strcmp(value, "on") == 0;
+        return 1;
+    }
+
+    if (strcmp(key, "audit") == 0) {
+        if (strcmp(value, "on") != 0 && strcmp(value, "off") != 0) {
+            printf("audit must be on or off\n");
+            return 0;
+        }
+        cfg->audit = strcmp(value, "on") == 0;
+        return 1;
+    }
+
+    if (strcmp(key, "loudness-target") == 0) {
+        if (!parse_float(value, &cfg->loudness_target) || cfg->loudness_target > 0.0f) {
+            printf("loudness-target must be a number of LUFS at or below 0\n");
+            return 0;
+        }
+        return 1;
+    }
+
+    if (strcmp(key, "spectrogram-cache") == 0) {
+        if (strcmp(value, "on") != 0 && strcmp(value, "off") != 0) {
+            printf("spectrogram-cache must be on or off\n");
+            return 0;
+        }
+        cfg->spectrogram = strcmp(value, "on") == 0;
+        return 1;
+    }
+
+    if (strcmp(key, "replay-speed") == 0) {
+        if (strcmp(value, "recorded") != 0 && strcmp(value, "fast") != 0) {
+            printf("replay-speed must be recorded or fast\n");
+            return 0;
+        }
+        cfg->replay_fast = strcmp(value, "fast") == 0;
+        return 1;
+    }
+
+    if (strcmp(key, "jobs") == 0) {
+        if (!parse_uint(value, &n) || n > 1024) {
+            printf("jobs must be a number of threads, 0 for one per core\n");
+            return 0;
+        }
+        cfg->jobs = (int)n;
+        return 1;
+    }
+
+    if (strcmp(key, "spectrogram-bits") == 0) {
+        if (!parse_uint(value, &n) || (n != 8 && n != 16)) {
+            printf("spectrogram-bits must be 8 or 16\n");
+            return 0;
+        }
+        cfg->spectrogram_bits = (int)n;
+        return 1;
+    }
+
+    if (strcmp(key, "features") == 0) {
+        return parse_features(cfg, value);
+    }
+
+    if (strcmp(key, "mode") == 0) {
+        for (size_t i = 0; i < modec; i++) {
+            if (strcmp(mode_names[i].name, value) == 0) {
+                cfg->mode = mode_names[i].mode;
+                return 1;
+            }
+        }
+        printf("Unknown mode: %s\n", value);
+        return 0;
+    }
+
+    if (strcmp(key, "channels") == 0) {
+        for (size_t i = 0; i < channelc; i++) {
+            if (strcmp(channel_names[i].name, value) == 0) {
+                cfg->channels = channel_names[i].channels;
+                return 1;
+            }
+        }
+        printf("Unknown channels: %s\n", value);
+        return 0;
+    }
+
+    printf("Unknown option: %s\n", key);
+    return 0;
+}
+
+static char *trim(char *s)
+{
+    while (*s == ' ' || *s == '\t') {
+        s++;
+    }
+
+    char *end = s + strlen(s);
+    while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' || end[-1] == '\r')) {
+        end--;
+    }
+    *end = '\0';
+    return s;
+}
+
+// Returns 1 if the file doesn't exist and it's optional, the default config
+// file is allowed to be missing but an explicit --config isn't.
+static int config_read_file(Config *cfg, const char *path, const int optional)
+{
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        if (optional && errno == ENOENT) {
+            return 1;
+        }
+        printf("Could not open config %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    char line[512];
+    int lineno = 0, ok = 1;
+    while (ok && fgets(line, sizeof(line), file)) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash) {
+            *hash = '\0';
+        }
+
+        char *key = trim(line);
+        if (*key == '\0') {
+            continue;
+        }
+
+        char *eq = strchr(key, '=');
+        if (!eq) {
+            printf("%s:%d: expected key = value\n", path, lineno);
+            ok = 0;
+            break;
+        }
+        *eq = '\0';
+        ok = config_set(cfg, trim(key), trim(eq + 1));
+        if (!ok) {
+            printf("%s:%d: bad entry\n", path, lineno);
+        }
+    }
+
+    if (fclose(file) == EOF) {
+        printf("Failed to close file: %s\n", strerror(errno));
+    }
+    return ok;
+}
+
+static int config_read_default(Config *cfg)
+{
+    char path[512];
+    const char *xdg = getenv("XDG_CONFIG_HOME");
+    const char *home = getenv("HOME");
+    if (xdg && *xdg) {
+        snprintf(path, sizeof(path), "%s/rtav/rtav.conf", xdg);
+    } else if (home && *home) {
+        snprintf(path, sizeof(path), "%s/.config/rtav/rtav.conf", home);
+    } else {
+        return 1;
+    }
+    return config_read_file(cfg, path, 1);
+}
+
+// Returns 0 if the program shouldn't go any further, the reason has already
+// been printed.
+int config_parse(Config *cfg, const int argc, char **argv)
+{
+    config_defaults(cfg);
+    if (!config_read_default(cfg)) {
+        return 0;
+    }
+
+    // --config goes first so anything else on the command line overrides it.
+    for (int i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], "--config") == 0 && !config_read_file(cfg, argv[i + 1], 0)) {
+            return 0;
+        }
+    }
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            usage();
+            return 0;
+        }
+
+        if (strncmp(arg, "--", 2) == 0) {
+            if (i + 1 >= argc) {
+                printf("Missing value for %s\n", arg);
+                usage();
+                return 0;
+            }
+
+            // Paths are kept as pointers into argv, so these only work on
+            // the command line.
+            if (strcmp(arg, "--analyze") == 0) {
+                cfg->analyze = 1;
+                cfg->directory = argv[i + 1];
+            } else if (strcmp(arg, "--out") == 0) {
+                cfg->out = argv[i + 1];
+            } else if (strcmp(arg, "--record") == 0) {
+                cfg->record = argv[i + 1];
+            } else if (strcmp(arg, "--replay") == 0) {
+                cfg->replay = argv[i + 1];
+            } else if (strcmp(arg, "--config") != 0 && !config_set(cfg, arg + 2, argv[i + 1])) {
+                usage();
+                return 0;
+            }
+            i++;
+            continue;
+        }
+
+        if (cfg->directory) {
+            usage();
+            return 0;
+        }
+        cfg->directory = arg;
+    }
+
+    if (!cfg->directory && !cfg->replay) {
+        usage();
+        return 0;
+    }
+
+    if (cfg->hop > cfg->fft_size) {
+        printf("hop can't be larger than fft-size, using %zu\n", cfg->fft_size);
+        cfg->hop = (uint32_t)cfg->fft_size;
+    }
+
+    if (cfg->analyze && !cfg->out) {
+        printf("--analyze needs --out <file>\n");
+        return 0;
+    }
+
+    // The sliding DFT follows the live stream sample by sample, a track cut
+    // into frames is the same FFT the fft mode does.
+    if (cfg->analyze && cfg->mode == ANALYZE_SDFT) {
+        printf("sdft only runs live, analysing with fft\n");
+        cfg->mode = ANALYZE_FFT;
+    }
+
+    if (cfg->mode == ANALYZE_SDFT && cfg->channels != CHANNELS_MONO) {
+        printf("sdft only analyses the mono mix, using mono\n");
+        cfg->channels = CHANNELS_MONO;
+    }
+
+    if (cfg->post.floor >= cfg->post.ceil) {
+        printf("db-floor has to be below db-ceil\n");
+        return 0;
+    }
+    return 1;
+}
+
+void config_print(const Config *cfg)
+{
+    printf("FFT size: %zu, hop: %u, window: %s, mode: %s, channels: %s, range: %.1f to %.1f dB\n", cfg->fft_size,
+           cfg->hop, window_name(cfg->window), mode_names[cfg->mode].name, channel_names[cfg->channels].name,
+           cfg->post.floor, cfg->post.ceil);
+
+    printf("Post:");
+    for (int i = 0; i < cfg->post.count; i++) {
+        printf("%s%s", (i == 0) ? " " : ", ", post_stage_name(cfg->post.stages[i]));
+    }
+    printf("%s\n", (cfg->post.count == 0) ? " none" : "");
+
+    printf("Features:");
+    for (int i = 0; i < cfg->featurec; i++) {
+        printf("%s%s", (i == 0) ? " " : ", ", cfg->features[i]->name);
+    }
+    printf("%s\n", (cfg->featurec == 0) ? " none" : "");
+
+    if (cfg->normalize) {
+        printf("Normalising to %.1f LUFS\n", cfg->loudness_target);
+    }
+}
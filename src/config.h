@@ -0,0 +1,53 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include "analysis.h"
+#include "extractor.h"
+#include "fft.h"
+#include "post.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define MIN_FFT_SIZE 512
+#define MAX_FFT_SIZE 65536
+
+// Everything that can be changed per deployment without a rebuild. Defaults
+// first, then ~/.config/rtav/rtav.conf, then --config, then the command line.
+typedef struct
+{
+    const char *directory;
+    // Headless: analyse every track in directory into out and exit.
+    int analyze;
+    const char *out;
+    // Threads for --analyze, 0 for one per core.
+    int jobs;
+    // Log every chunk the audio callback pushes to record. Or headless: play
+    // a log back through the analysis instead of the directory, at the speed
+    // it was recorded or as fast as possible.
+    const char *record;
+    const char *replay;
+    int replay_fast;
+    // Scope timers on every stage, see trace.h.
+    int trace;
+    // Deadline and blocking checks on the audio callback, see audit.h.
+    int audit;
+    size_t fft_size;
+    uint32_t hop;
+    WindowType window;
+    float kaiser_beta;
+    AnalyzeMode mode;
+    ChannelMode channels;
+    PostConfig post;
+    const Extractor *features[FEATURE_MAX];
+    int featurec;
+    float onset_threshold;
+    int normalize;
+    float loudness_target;
+    int spectrogram;
+    int spectrogram_bits;
+} Config;
+
+int config_parse(Config *cfg, int argc, char **argv);
+void config_print(const Config *cfg);
+
+#endif
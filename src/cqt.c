@@ -0,0 +1,180 @@
+#include "cqt.h"
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Anything below this fraction of a kernel's peak is dropped. Just above the
+// Hann window's first sidelobe (-31.5 dB) so only the main lobe is kept, that
+// halves the coefficients compared to Brown & Puckette's 0.0054 and the bars
+// don't visibly change.
+static const float KERNEL_THRESHOLD = 0.03f;
+
+// Width of the dot product's accumulators, one AVX-512 vector.
+#define DOT_LANES 16
+
+void cqt_free(CQT *c)
+{
+    free(c->kre);
+    free(c->kim);
+    memset(c, 0, sizeof(CQT));
+}
+
+static int cqt_append(CQT *c, const Compf *a, const Compf *b, const int start, const int len, const float scale)
+{
+    float *kre = realloc(c->kre, (c->total + len) * sizeof(float));
+    if (kre) {
+        c->kre = kre;
+    }
+    float *kim = realloc(c->kim, (c->total + len) * sizeof(float));
+    if (kim) {
+        c->kim = kim;
+    }
+    if (!kre || !kim) {
+        printf("Could not allocate memory: %s\n", strerror(errno));
+        return 0;
+    }
+
+    // The kernel spectrum is A + iB where A and B are the spectra of its
+    // real and imaginary parts, store its conjugate.
+    for (int i = 0; i < len; i++) {
+        const Compf *const ar = &a[start + i];
+        const Compf *const bi = &b[start + i];
+        c->kre[c->total + i] = (ar->real - bi->imag) * scale;
+        c->kim[c->total + i] = -(ar->imag + bi->real) * scale;
+    }
+    c->total += len;
+    return 1;
+}
+
+int cqt_init(CQT *c, const FFTPlan *plan, const int sr)
+{
+    cqt_free(c);
+    const size_t size = plan->size;
+    const double ratio = bar_frequency(1) / bar_frequency(0);
+    const double q = 1.0 / (ratio - 1.0);
+
+    float *re = calloc(size, sizeof(float));
+    float *im = calloc(size, sizeof(float));
+    Compf *a = calloc(size, sizeof(Compf));
+    Compf *b = calloc(size, sizeof(Compf));
+    int ok = re && im && a && b;
+    if (!ok) {
+        printf("Could not allocate memory: %s\n", strerror(errno));
+    }
+
+    for (int k = 0; k < DIVISOR && ok; k++) {
+        const double freq = bar_frequency(k);
+        size_t len = (size_t)ceil(q * sr / freq);
+        len = (len < size) ? len : size;
+
+        // Hann windowed e^(-i2pifn) normalised by its length. The FFT here
+        // uses the positive exponent, the negative one puts the kernel's
+        // energy in the positive frequency half.
+        memset(re, 0, size * sizeof(float));
+        memset(im, 0, size * sizeof(float));
+        double sum = 0.0;
+        for (size_t n = 0; n < len; n++) {
+            const double w = (0.5 - 0.5 * cos(2.0 * M_PI * n / len)) / len;
+            sum += w;
+            const double phase = -2.0 * M_PI * freq * n / sr;
+            re[size - len + n] = (float)(w * cos(phase));
+            im[size - len + n] = (float)(w * sin(phase));
+        }
+        // A sine of amplitude A at freq comes out as A * sum(w) / 2.
+        c->norm[k] = (float)(4.0 / (sum * sum));
+        iter_fft(plan, re, a);
+        iter_fft(plan, im, b);
+
+        float peak = 0.0f;
+        for (size_t j = 1; j < size / 2; j++) {
+            const float mr = a[j].real - b[j].imag;
+            const float mi = a[j].imag + b[j].real;
+            const float mag = sqrtf(mr * mr + mi * mi);
+            peak = (mag > peak) ? mag : peak;
+        }
+
+        int lo = 0, hi = 0;
+        for (size_t j = 1; j < size / 2; j++) {
+            const float mr = a[j].real - b[j].imag;
+            const float mi = a[j].imag + b[j].real;
+            if (sqrtf(mr * mr + mi * mi) >= peak * KERNEL_THRESHOLD) {
+                lo = (hi == 0) ? (int)j : lo;
+                hi = (int)j + 1;
+            }
+        }
+
+        // Widen the run to whole vectors of the dot product, the extra bins
+        // are real kernel values so they only make it more accurate.
+        const int half = (int)size / 2;
+        hi = lo + ((hi - lo + DOT_LANES - 1) / DOT_LANES) * DOT_LANES;
+        if (hi > half) {
+            lo -= hi - half;
+            lo = (lo < 0) ? 0 : lo;
+            hi = half;
+        }
+
+        c->start[k] = lo;
+        c->len[k] = hi - lo;
+        c->offset[k] = c->total;
+        ok = cqt_append(c, a, b, lo, hi - lo, 1.0f / size);
+    }
+
+    free(re);
+    free(im);
+    free(a);
+    free(b);
+    if (!ok) {
+        cqt_free(c);
+        return 0;
+    }
+
+    c->sr = sr;
+    c->size = size;
+    printf("CQT kernels: %zu coefficients for %d bars (Q %.1f)\n", c->total, DIVISOR, q);
+    return 1;
+}
+
+// Complex dot product of a run of spectrum bins with a kernel, returns the
+// power. Each lane keeps its own sums so the compiler can vectorise the
+// loop without reassociating anything.
+static inline float cqt_dot(const float *restrict xr, const float *restrict xi, const float *restrict kr,
+                              const float *restrict ki, const int len)
+{
+    float lre[DOT_LANES] = { 0 }, lim[DOT_LANES] = { 0 };
+    int i = 0;
+    for (; i + DOT_LANES <= len; i += DOT_LANES) {
+        for (int l = 0; l < DOT_LANES; l++) {
+            lre[l] += xr[i + l] * kr[i + l] - xi[i + l] * ki[i + l];
+            lim[l] += xr[i + l] * ki[i + l] + xi[i + l] * kr[i + l];
+        }
+    }
+
+    // Fold the lanes in halves, a straight sum would be one long dependency
+    // chain per bar.
+    for (int w = DOT_LANES / 2; w > 0; w /= 2) {
+        for (int l = 0; l < w; l++) {
+            lre[l] += lre[l + w];
+            lim[l] += lim[l + w];
+        }
+    }
+
+    float re = lre[0], im = lim[0];
+    for (; i < len; i++) {
+        re += xr[i] * kr[i] - xi[i] * ki[i];
+        im += xr[i] * ki[i] + xi[i] * kr[i];
+    }
+    return re * re + im * im;
+}
+
+// Expects the unwindowed frame's spectrum, the kernels carry their own
+// windows.
+SPECTRUM_CLONES void cqt_bars(const CQT *c, const Spectrum *spec, float *sums)
+{
+    for (int k = 0; k < DIVISOR; k++) {
+        const int start = c->start[k];
+        sums[k] = cqt_dot(&spec->re[start], &spec->im[start], &c->kre[c->offset[k]], &c->kim[c->offset[k]], c->len[k]) *
+                  c->norm[k];
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef CQT_H
+#define CQT_H
+
+#include "fft.h"
+#include "rndrdef.h"
+
+// Constant-Q bars from one FFT using precomputed sparse spectral kernels
+// (Brown & Puckette). Each bar has its own Hann windowed kernel whose length
+// gives it the same Q as the bar spacing, so the low bars get long windows
+// and the high bars short ones. Kernels are right aligned in the frame so the
+// short ones describe the newest audio. In the frequency domain each kernel
+// is only significant over a short run of bins, that run is all that's kept.
+typedef struct
+{
+    int sr;
+    size_t size;
+    int start[DIVISOR];
+    int len[DIVISOR];
+    size_t offset[DIVISOR];
+    // Scales each bar's power so a full scale sine at its centre reads 1.
+    float norm[DIVISOR];
+    // Conjugated kernels already scaled by 1 / size, packed per bar.
+    float *kre;
+    float *kim;
+    size_t total;
+} CQT;
+
+int cqt_init(CQT *c, const FFTPlan *plan, int sr);
+void cqt_free(CQT *c);
+void cqt_bars(const CQT *c, const Spectrum *spec, float *sums);
+
+#endif
@@ -26,4 +26,5 @@ typedef struct
 int parse_headers(Entries *ent);
 Entries read_directory(const char *path);
 int close_directory(DIR *dirp);
+int cache_path(char *out, size_t len, const char *name, int create);
 #endif
@@ -0,0 +1,311 @@
+#include "extractor.h"
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Every sum is kept in this many lanes and folded at the end, so the per bin
+// loops vectorise without reassociating anything. Blocks are always a
+// multiple of it.
+#define LANES 16
+// Rolloff keeps the energy of every run of this many bins.
+#define ROLLOFF_CHUNK 16
+#define ROLLOFF_SHARE 0.85f
+
+static float fold(float *lanes)
+{
+    for (int w = LANES / 2; w > 0; w /= 2) {
+        for (int l = 0; l < w; l++) {
+            lanes[l] += lanes[l + w];
+        }
+    }
+    return lanes[0];
+}
+
+// State for the extractors that only keep (up to two) lane sums.
+static size_t lanes_state(const size_t bins)
+{
+    (void)bins;
+    return 2 * LANES;
+}
+
+static void lanes_clear(float *state, const FeatureFrame *f)
+{
+    (void)f;
+    memset(state, 0, 2 * LANES * sizeof(float));
+}
+
+// RMS of the frame from Parseval, every bin but DC counts for its mirror too.
+// The window's power is taken back out so a full scale sine reads 0.707.
+static SPECTRUM_CLONES void rms_block(float *restrict state, const FeatureFrame *f, const FeatureBlock *b)
+{
+    (void)f;
+    for (size_t i = 0; i < b->len; i += LANES) {
+        for (int l = 0; l < LANES; l++) {
+            state[l] += 2.0f * b->power[i + l];
+        }
+    }
+    if (b->lo == 0) {
+        state[0] -= b->power[0];
+    }
+}
+
+static float rms_finish(float *state, const FeatureFrame *f) { return sqrtf(fold(state) * f->rms_norm); }
+
+// Magnitude weighted mean bin, as a fraction of Nyquist.
+static SPECTRUM_CLONES void centroid_block(float *restrict state, const FeatureFrame *f, const FeatureBlock *b)
+{
+    (void)f;
+    float *restrict moment = state;
+    float *restrict total = state + LANES;
+    for (size_t i = 0; i < b->len; i += LANES) {
+        const float base = (float)(b->lo + i);
+        for (int l = 0; l < LANES; l++) {
+            const float k = base + (float)l;
+            moment[l] += k * b->mag[i + l];
+            total[l] += b->mag[i + l];
+        }
+    }
+}
+
+static float centroid_finish(float *state, const FeatureFrame *f)
+{
+    const float moment = fold(state);
+    const float total = fold(state + LANES);
+    return (total > 0.0f) ? moment / total / (float)f->bins : 0.0f;
+}
+
+// Geometric over arithmetic mean of the power, 1 for white noise and near 0
+// for a tone. DC is left out, an offset says nothing about the timbre.
+static SPECTRUM_CLONES void flatness_block(float *restrict state, const FeatureFrame *f, const FeatureBlock *b)
+{
+    (void)f;
+    float *restrict logs = state;
+    float *restrict total = state + LANES;
+    for (size_t i = 0; i < b->len; i += LANES) {
+        for (int l = 0; l < LANES; l++) {
+            const float p = b->power[i + l];
+            logs[l] += fast_log2f((p > 1e-20f) ? p : 1e-20f);
+            total[l] += p;
+        }
+    }
+    if (b->lo == 0) {
+        const float p = b->power[0];
+        logs[0] -= fast_log2f((p > 1e-20f) ? p : 1e-20f);
+        total[0] -= p;
+    }
+}
+
+static float flatness_finish(float *state, const FeatureFrame *f)
+{
+    const float n = (float)(f->bins - 1);
+    const float logs = fold(state);
+    const float mean = fold(state + LANES) / n;
+    return (mean > 0.0f) ? exp2f(logs / n) / mean : 0.0f;
+}
+
+// The bin below which ROLLOFF_SHARE of the energy sits, as a fraction of
+// Nyquist. The total isn't known until the end, so the pass keeps the energy
+// per chunk and finish walks those.
+static size_t rolloff_state(const size_t bins) { return bins / ROLLOFF_CHUNK; }
+
+static void rolloff_begin(float *state, const FeatureFrame *f) { (void)state, (void)f; }
+
+static SPECTRUM_CLONES void rolloff_block(float *restrict state, const FeatureFrame *f, const FeatureBlock *b)
+{
+    (void)f;
+    float *restrict chunks = &state[b->lo / ROLLOFF_CHUNK];
+    for (size_t c = 0; c < b->len / ROLLOFF_CHUNK; c++) {
+        float sum = 0.0f;
+        for (int l = 0; l < ROLLOFF_CHUNK; l++) {
+            sum += b->power[c * ROLLOFF_CHUNK + l];
+        }
+        chunks[c] = sum;
+    }
+}
+
+static float rolloff_finish(float *state, const FeatureFrame *f)
+{
+    const size_t chunkc = f->bins / ROLLOFF_CHUNK;
+    double total = 0.0;
+    for (size_t c = 0; c < chunkc; c++) {
+        total += state[c];
+    }
+
+    const double target = total * ROLLOFF_SHARE;
+    double below = 0.0;
+    for (size_t c = 0; c < chunkc && total > 0.0; c++) {
+        if (below + state[c] >= target) {
+            const double into = (state[c] > 0.0f) ? (target - below) / state[c] : 0.0;
+            return (float)((c + into) * ROLLOFF_CHUNK / f->bins);
+        }
+        below += state[c];
+    }
+    return 0.0f;
+}
+
+// Positive change in magnitude since the last frame over the total, 0 for a
+// steady sound and 1 when everything is new. The previous frame lives in the
+// state after the sums.
+static size_t flux_state(const size_t bins) { return 2 * LANES + bins; }
+
+static SPECTRUM_CLONES void flux_block(float *restrict state, const FeatureFrame *f, const FeatureBlock *b)
+{
+    (void)f;
+    float *restrict rise = state;
+    float *restrict total = state + LANES;
+    float *restrict prev = state + 2 * LANES + b->lo;
+    for (size_t i = 0; i < b->len; i += LANES) {
+        for (int l = 0; l < LANES; l++) {
+            const float m = b->mag[i + l];
+            const float d = m - prev[i + l];
+            rise[l] += (d > 0.0f) ? d : 0.0f;
+            total[l] += m;
+            prev[i + l] = m;
+        }
+    }
+}
+
+static float flux_finish(float *state, const FeatureFrame *f)
+{
+    (void)f;
+    const float rise = fold(state);
+    const float total = fold(state + LANES);
+    return (total > 0.0f) ? rise / total : 0.0f;
+}
+
+static const Extractor builtins[] = {
+    { "rms", 0, lanes_state, lanes_clear, rms_block, rms_finish },
+    { "centroid", 1, lanes_state, lanes_clear, centroid_block, centroid_finish },
+    { "flatness", 0, lanes_state, lanes_clear, flatness_block, flatness_finish },
+    { "rolloff", 0, rolloff_state, rolloff_begin, rolloff_block, rolloff_finish },
+    { "flux", 1, flux_state, lanes_clear, flux_block, flux_finish },
+};
+
+static const size_t builtinc = sizeof(builtins) / sizeof(builtins[0]);
+
+const Extractor *feature_find(const char *name)
+{
+    for (size_t i = 0; i < builtinc; i++) {
+        if (strcmp(builtins[i].name, name) == 0) {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+const Extractor *feature_builtin(const int i) { return (i >= 0 && (size_t)i < builtinc) ? &builtins[i] : NULL; }
+
+// The window sets the RMS scale, the same one the analysis uses.
+int features_init(Features *f, const float *window, const size_t size)
+{
+    memset(f, 0, sizeof(Features));
+    double power = 0.0;
+    for (size_t i = 0; i < size; i++) {
+        power += (double)window[i] * window[i];
+    }
+    f->frame.bins = size / 2;
+    f->frame.rms_norm = (float)(1.0 / ((double)size * power));
+
+    if (f->frame.bins % FEATURE_BLOCK != 0) {
+        printf("Features need a multiple of %d bins: %zu\n", FEATURE_BLOCK, f->frame.bins);
+        return 0;
+    }
+
+    f->power = fft_alloc(FEATURE_BLOCK, sizeof(float));
+    f->mag = fft_alloc(FEATURE_BLOCK, sizeof(float));
+    if (!f->power || !f->mag) {
+        printf("Could not allocate memory: %s\n", strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+// Registers an extractor for every following frame. Anything with the
+// Extractor hooks works, the built in ones are only the defaults.
+int features_add(Features *f, const Extractor *ex)
+{
+    if (f->count >= FEATURE_MAX) {
+        printf("Too many features, %s left out\n", ex->name);
+        return 0;
+    }
+
+    float *state = fft_alloc(ex->state(f->frame.bins), sizeof(float));
+    if (!state) {
+        printf("Could not allocate memory: %s\n", strerror(errno));
+        return 0;
+    }
+
+    f->ex[f->count] = ex;
+    f->state[f->count] = state;
+    f->value[f->count] = 0.0f;
+    f->magnitude |= ex->magnitude;
+    f->count++;
+    return 1;
+}
+
+void features_free(Features *f)
+{
+    for (int i = 0; i < f->count; i++) {
+        free(f->state[i]);
+    }
+    free(f->power);
+    free(f->mag);
+    memset(f, 0, sizeof(Features));
+}
+
+// Back to how things were before the first frame, for a new song.
+void features_reset(Features *f)
+{
+    for (int i = 0; i < f->count; i++) {
+        memset(f->state[i], 0, f->ex[i]->state(f->frame.bins) * sizeof(float));
+        f->value[i] = 0.0f;
+    }
+}
+
+static SPECTRUM_CLONES void block_power(const Spectrum *a, const Spectrum *b, const size_t lo, float *restrict power,
+                                        float *restrict mag, const int magnitude)
+{
+    const float *restrict ar = &a->re[lo];
+    const float *restrict ai = &a->im[lo];
+    if (b) {
+        const float *restrict br = &b->re[lo];
+        const float *restrict bi = &b->im[lo];
+        for (size_t i = 0; i < FEATURE_BLOCK; i++) {
+            power[i] = 0.5f * (ar[i] * ar[i] + ai[i] * ai[i] + br[i] * br[i] + bi[i] * bi[i]);
+        }
+    } else {
+        for (size_t i = 0; i < FEATURE_BLOCK; i++) {
+            power[i] = ar[i] * ar[i] + ai[i] * ai[i];
+        }
+    }
+
+    if (magnitude) {
+        for (size_t i = 0; i < FEATURE_BLOCK; i++) {
+            mag[i] = sqrtf(power[i]);
+        }
+    }
+}
+
+// One pass over the windowed half spectrum for every registered extractor.
+// With b (stereo) the features describe the mean power of both channels.
+void features_run(Features *f, const Spectrum *a, const Spectrum *b)
+{
+    const FeatureFrame *const frame = &f->frame;
+    for (int i = 0; i < f->count; i++) {
+        f->ex[i]->begin(f->state[i], frame);
+    }
+
+    for (size_t lo = 0; lo < frame->bins; lo += FEATURE_BLOCK) {
+        block_power(a, b, lo, f->power, f->mag, f->magnitude);
+        const FeatureBlock block = { lo, FEATURE_BLOCK, f->power, f->mag };
+        for (int i = 0; i < f->count; i++) {
+            f->ex[i]->block(f->state[i], frame, &block);
+        }
+    }
+
+    for (int i = 0; i < f->count; i++) {
+        f->value[i] = f->ex[i]->finish(f->state[i], frame);
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef EXTRACTOR_H
+#define EXTRACTOR_H
+
+#include "fft.h"
+
+#define FEATURE_MAX 8
+// Bins per step of the pass. Every extractor sees a block while its power
+// and magnitude are still in L1.
+#define FEATURE_BLOCK 256
+
+// What block and finish need to know about the frame.
+typedef struct
+{
+    size_t bins;
+    // rms^2 = norm * (p[0] + 2 * sum(p[k])) for the window in use.
+    float rms_norm;
+} FeatureFrame;
+
+// Bins [lo, lo + len) of the frame. Power is always there, magnitude only if
+// one of the extractors asked for it.
+typedef struct
+{
+    size_t lo;
+    size_t len;
+    const float *power;
+    const float *mag;
+} FeatureBlock;
+
+// A feature computed from the magnitude spectrum. Extractors don't scan the
+// spectrum themselves, features_run hands each of them every block in turn
+// and asks for the value at the end, so a frame is read once whatever is
+// registered. The value shows up in the shaders as uniform float
+// feature_<name>.
+typedef struct
+{
+    const char *name;
+    // Set if block reads mag, sqrt per bin isn't free.
+    int magnitude;
+    // Floats of state for a frame of bins, zeroed before the first frame.
+    size_t (*state)(size_t bins);
+    void (*begin)(float *state, const FeatureFrame *f);
+    void (*block)(float *state, const FeatureFrame *f, const FeatureBlock *b);
+    float (*finish)(float *state, const FeatureFrame *f);
+} Extractor;
+
+typedef struct
+{
+    const Extractor *ex[FEATURE_MAX];
+    float *state[FEATURE_MAX];
+    float value[FEATURE_MAX];
+    int count;
+    int magnitude;
+    FeatureFrame frame;
+    float *power;
+    float *mag;
+} Features;
+
+const Extractor *feature_find(const char *name);
+const Extractor *feature_builtin(int i);
+int features_init(Features *f, const float *window, size_t size);
+int features_add(Features *f, const Extractor *ex);
+void features_free(Features *f);
+void features_reset(Features *f);
+void features_run(Features *f, const Spectrum *a, const Spectrum *b);
+
+#endif
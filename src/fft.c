@@ -1,26 +1,24 @@
 #include "fft.h"
-#include "audio.h"
+#include "fft_simd.h"
+#include "fourstep.h"
 #include "rndrdef.h"
+#include <errno.h>
+#include <float.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
 
-const int smear = 8;
-const int smooth = 8;
 float bins[DIVISOR + 1];
 
 const float MAX_FREQ = 8000.0f;
 const float MIN_FREQ = 100.0f;
 const float RATIO = MAX_FREQ / MIN_FREQ;
 
-void ema(const float *new, float *old)
-{
-    const float a = 0.1;
-    for (int i = 0; i < DIVISOR; i++) {
-        old[i] = (a * new[i]) + ((1.0 - a) * old[i]);
-    }
-}
-
 static inline Compf c_from_real(const float real)
 {
     Compf _complex;
@@ -29,23 +27,6 @@ static inline Compf c_from_real(const float real)
     return _complex;
 }
 
-static inline Compf c_from_imag(const float imag)
-{
-    Compf _complex;
-    _complex.real = 0.0;
-    _complex.imag = imag;
-    return _complex;
-}
-
-static inline Compf compf_expf(const Compf *c)
-{
-    Compf res;
-    float exp_real = expf(c->real);
-    res.real = exp_real * cosf(c->imag);
-    res.imag = exp_real * sinf(c->imag);
-    return res;
-}
-
 static inline Compf compf_subtract(const Compf *a, const Compf *b)
 {
     Compf sub;
@@ -70,21 +51,9 @@ static inline Compf compf_mult(const Compf *a, const Compf *b)
     return mult;
 }
 
-static inline Compf compf_step(const size_t *half_len, const Compf *iota)
-{
-    Compf step;
-    float theta = (float)M_PI / *half_len;
-
-    step.real = iota->real * theta;
-    step.imag = iota->imag * theta;
-
-    step = compf_expf(&step);
-    return step;
-}
-
-static inline size_t bit_reverse(size_t index, size_t log2n)
+static inline uint32_t bit_reverse(uint32_t index, const size_t log2n)
 {
-    size_t reversed = 0;
+    uint32_t reversed = 0;
     for (size_t i = 0; i < log2n; i++) {
         reversed <<= 1;
         reversed |= (index & 1);
@@ -93,30 +62,222 @@ static inline size_t bit_reverse(size_t index, size_t log2n)
     return reversed;
 }
 
-void iter_fft(float *in, Compf *out, size_t size)
+static size_t ilog2(size_t size)
+{
+    size_t log2n = 0;
+    while (((size_t)1 << log2n) < size) {
+        log2n++;
+    }
+    return log2n;
+}
+
+FFTPlan *fft_plan_destroy(FFTPlan *plan)
+{
+    if (plan) {
+        free(plan->rev);
+        free(plan->twiddle);
+        free(plan->scratch);
+        free(plan->work);
+        plan->full = fourstep_destroy(plan->full);
+        plan->half = fourstep_destroy(plan->half);
+        free(plan);
+    }
+    return NULL;
+}
+
+FFTPlan *fft_plan_create(const size_t size)
+{
+    if (size < 2 || (size & (size - 1)) != 0) {
+        printf("FFT size must be a power of two: %zu\n", size);
+        return NULL;
+    }
+
+    FFTPlan *plan = calloc(1, sizeof(FFTPlan));
+    if (!plan) {
+        printf("Could not allocate memory: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    plan->size = size;
+    plan->log2n = ilog2(size);
+    plan->kernel = fft_kernel_best();
+    plan->rev = calloc(size, sizeof(uint32_t));
+    plan->twiddle = fft_alloc(size, sizeof(Compf));
+    plan->scratch = fft_alloc(size, sizeof(float));
+    plan->work = fft_alloc(size, sizeof(Compf));
+    if (!plan->rev || !plan->twiddle || !plan->scratch || !plan->work) {
+        printf("Could not allocate memory: %s\n", strerror(errno));
+        return fft_plan_destroy(plan);
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        plan->rev[i] = bit_reverse((uint32_t)i, plan->log2n);
+    }
+
+    // Computed directly in double rather than by repeated multiplication so
+    // the error doesn't build up across a stage.
+    for (size_t half = 1; half < size; half <<= 1) {
+        for (size_t j = 0; j < half; j++) {
+            const double theta = M_PI * (double)j / (double)half;
+            plan->twiddle[half + j].real = (float)cos(theta);
+            plan->twiddle[half + j].imag = (float)sin(theta);
+        }
+    }
+
+    if (size >= FOURSTEP_MIN && !(plan->full = fourstep_create(size))) {
+        return fft_plan_destroy(plan);
+    }
+    if (size / 2 >= FOURSTEP_MIN && !(plan->half = fourstep_create(size / 2))) {
+        return fft_plan_destroy(plan);
+    }
+    return plan;
+}
+
+void fft_radix2_stage(const Compf *twiddle, Compf *out, const size_t size, const size_t half)
+{
+    const Compf *const tw = &twiddle[half];
+    const size_t sub_arr_size = half << 1;
+    for (size_t k = 0; k < size; k += sub_arr_size) {
+        for (size_t j = 0; j < half; j++) {
+            Compf t = compf_mult(&tw[j], &out[k + j + half]);
+            Compf u = out[k + j];
+
+            out[k + j] = compf_add(&u, &t);
+            out[k + j + half] = compf_subtract(&u, &t);
+        }
+    }
+}
+
+void iter_fft(const FFTPlan *plan, const float *in, Compf *out)
 {
+    const size_t size = plan->size;
+    if (plan->full) {
+        for (size_t i = 0; i < size; i++) {
+            out[i] = c_from_real(in[i]);
+        }
+        fourstep_run(plan->full, out);
+        return;
+    }
+
     for (size_t i = 0; i < size; i++) {
-        int rev_index = bit_reverse(i, log2(size));
-        out[i] = c_from_real(in[rev_index]);
+        out[i] = c_from_real(in[plan->rev[i]]);
+    }
+    plan->kernel->stages(plan->twiddle, out, size);
+}
+
+// Packs even samples into the real part and odd samples into the imaginary
+// part, then runs the size / 2 transform. The reversal order for size / 2 is
+// the size order shifted down a bit, so the even index is rev[i] and its odd
+// partner is rev[i] + 1. The half size transform only reads stages below
+// size / 2, so the plan's own twiddle table covers it.
+static void real_pack(const FFTPlan *plan, const float *in, Compf *z)
+{
+    const size_t half_size = plan->size / 2;
+    if (plan->half) {
+        for (size_t i = 0; i < half_size; i++) {
+            z[i].real = in[2 * i];
+            z[i].imag = in[2 * i + 1];
+        }
+        fourstep_run(plan->half, z);
+        return;
     }
 
-    const Compf iota = c_from_imag(1.0f);
-    for (size_t stage = 1; stage <= log2(size); ++stage) {
-        size_t sub_arr_size = (size_t)1 << stage; // 2^stage
-        size_t half_sub_arr = sub_arr_size >> 1;
-        Compf twiddle = c_from_real(1.0f);
+    for (size_t i = 0; i < half_size; i++) {
+        const uint32_t r = plan->rev[i];
+        z[i].real = in[r];
+        z[i].imag = in[r + 1];
+    }
+    plan->kernel->stages(plan->twiddle, z, half_size);
+}
 
-        Compf step = compf_step(&half_sub_arr, &iota);
-        for (size_t j = 0; j < half_sub_arr; j++) {
-            for (size_t k = j; k < size; k += sub_arr_size) {
-                Compf t = compf_mult(&twiddle, &out[k + half_sub_arr]);
-                Compf u = out[k];
+// Splits the packed bins z[k] and z[size / 2 - k] into the even/odd spectra
+// and combines them with the last stage's twiddle, giving both output bins.
+static inline void real_unpack(const Compf a, const Compf b, const Compf *w, Compf *lo, Compf *hi)
+{
+    Compf even, odd;
+    even.real = 0.5f * (a.real + b.real);
+    even.imag = 0.5f * (a.imag - b.imag);
+    odd.real = 0.5f * (a.imag + b.imag);
+    odd.imag = -0.5f * (a.real - b.real);
 
-                out[k] = compf_add(&u, &t);
-                out[k + half_sub_arr] = compf_subtract(&u, &t);
-            }
-            twiddle = compf_mult(&twiddle, &step);
+    const Compf t = compf_mult(w, &odd);
+    *lo = compf_add(&even, &t);
+    hi->real = even.real - t.real;
+    hi->imag = -(even.imag - t.imag);
+}
+
+// k and size / 2 - k are done at the same time so it can happen in place. The
+// Nyquist bin is dropped, nothing reads it.
+void real_fft(const FFTPlan *plan, const float *in, Compf *out)
+{
+    const size_t half_size = plan->size / 2;
+    real_pack(plan, in, out);
+
+    const Compf *const tw = &plan->twiddle[half_size];
+    const Compf z0 = out[0];
+    out[0].real = z0.real + z0.imag;
+    out[0].imag = 0.0f;
+
+    for (size_t k = 1; k <= half_size / 2; k++) {
+        real_unpack(out[k], out[half_size - k], &tw[k], &out[k], &out[half_size - k]);
+    }
+}
+
+// Same transform, but the unpack pass writes the split layout directly so the
+// deinterleave costs nothing extra.
+void real_fft_split(const FFTPlan *plan, const float *in, Spectrum *out)
+{
+    const size_t half_size = plan->size / 2;
+    Compf *const z = plan->work;
+    real_pack(plan, in, z);
+
+    const Compf *const tw = &plan->twiddle[half_size];
+    out->re[0] = z[0].real + z[0].imag;
+    out->im[0] = 0.0f;
+
+    for (size_t k = 1; k <= half_size / 2; k++) {
+        Compf lo, hi;
+        real_unpack(z[k], z[half_size - k], &tw[k], &lo, &hi);
+        out->re[k] = lo.real;
+        out->im[k] = lo.imag;
+        out->re[half_size - k] = hi.real;
+        out->im[half_size - k] = hi.imag;
+    }
+}
+
+// Two real signals for the price of one complex FFT of the same size. With
+// z = a + ib, A[k] = (Z[k] + conj(Z[N - k])) / 2 and
+// B[k] = (Z[k] - conj(Z[N - k])) / 2i.
+void stereo_fft_split(const FFTPlan *plan, const float *a, const float *b, Spectrum *sa, Spectrum *sb)
+{
+    const size_t size = plan->size;
+    Compf *const z = plan->work;
+    if (plan->full) {
+        for (size_t i = 0; i < size; i++) {
+            z[i].real = a[i];
+            z[i].imag = b[i];
         }
+        fourstep_run(plan->full, z);
+    } else {
+        for (size_t i = 0; i < size; i++) {
+            const uint32_t r = plan->rev[i];
+            z[i].real = a[r];
+            z[i].imag = b[r];
+        }
+        plan->kernel->stages(plan->twiddle, z, size);
+    }
+
+    sa->re[0] = z[0].real;
+    sa->im[0] = 0.0f;
+    sb->re[0] = z[0].imag;
+    sb->im[0] = 0.0f;
+    for (size_t k = 1; k < size / 2; k++) {
+        const Compf p = z[k];
+        const Compf q = z[size - k];
+        sa->re[k] = 0.5f * (p.real + q.real);
+        sa->im[k] = 0.5f * (p.imag - q.imag);
+        sb->re[k] = 0.5f * (p.imag + q.imag);
+        sb->im[k] = 0.5f * (q.real - p.real);
     }
 }
 
@@ -129,24 +290,201 @@ void wfunc(float *in, const float *hamming, const int size)
     }
 }
 
-void calculate_window(float *hambuf)
+static const struct
+{
+    WindowType type;
+    const char *name;
+} window_names[] = {
+    { WINDOW_HAMMING, "hamming" },
+    { WINDOW_HANN, "hann" },
+    { WINDOW_BLACKMAN_HARRIS, "blackman-harris" },
+    { WINDOW_KAISER, "kaiser" },
+    { WINDOW_FLAT_TOP, "flat-top" },
+};
+
+const char *window_name(const WindowType type)
+{
+    const size_t count = sizeof(window_names) / sizeof(window_names[0]);
+    for (size_t i = 0; i < count; i++) {
+        if (window_names[i].type == type) {
+            return window_names[i].name;
+        }
+    }
+    return "?";
+}
+
+int window_from_name(const char *name, WindowType *type)
+{
+    const size_t count = sizeof(window_names) / sizeof(window_names[0]);
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(window_names[i].name, name) == 0) {
+            *type = window_names[i].type;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Zeroth order modified Bessel function of the first kind, the series
+// converges fast enough for any beta worth using.
+static double bessel_i0(const double x)
+{
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 64 && term > sum * 1e-12; k++) {
+        const double h = x / (2.0 * k);
+        term *= h * h;
+        sum += term;
+    }
+    return sum;
+}
+
+static double cosine_sum(const double *a, const int terms, const double t)
+{
+    double w = 0.0;
+    for (int k = 0; k < terms; k++) {
+        const double sign = (k & 1) ? -1.0 : 1.0;
+        w += sign * a[k] * cos(2.0 * M_PI * k * t);
+    }
+    return w;
+}
+
+// Symmetric windows, computed in double once per configuration.
+void calculate_window(float *winbuf, const size_t size, const WindowType type, const float beta)
 {
-    const float PI = 3.14159265359f;
-    for (int i = 0; i < BUFFER_SIZE; ++i) {
-        float t = (float)i / (BUFFER_SIZE - 1);
-        hambuf[i] = 0.54 - 0.46 * cosf(2 * PI * t);
+    const double hamming[] = { 0.54, 0.46 };
+    const double hann[] = { 0.5, 0.5 };
+    const double blackman_harris[] = { 0.35875, 0.48829, 0.14128, 0.01168 };
+    const double flat_top[] = { 0.21557895, 0.41663158, 0.277263158, 0.083578947, 0.006947368 };
+    const double i0_beta = bessel_i0(beta);
+
+    for (size_t i = 0; i < size; ++i) {
+        const double t = (double)i / (double)(size - 1);
+        double w = 0.0;
+        switch (type) {
+        default:
+        case WINDOW_HAMMING:
+        {
+            w = cosine_sum(hamming, 2, t);
+        } break;
+
+        case WINDOW_HANN:
+        {
+            w = cosine_sum(hann, 2, t);
+        } break;
+
+        case WINDOW_BLACKMAN_HARRIS:
+        {
+            w = cosine_sum(blackman_harris, 4, t);
+        } break;
+
+        case WINDOW_FLAT_TOP:
+        {
+            w = cosine_sum(flat_top, 5, t);
+        } break;
+
+        case WINDOW_KAISER:
+        {
+            const double r = 2.0 * t - 1.0;
+            w = bessel_i0(beta * sqrt(1.0 - r * r)) / i0_beta;
+        } break;
+        }
+        winbuf[i] = (float)w;
     }
 }
 
-void compf_to_float(float *half, Compf *fft_output)
+void compf_to_float(float *half, Compf *fft_output, const size_t size)
 {
-    const size_t half_size = BUFFER_SIZE / 2;
+    const size_t half_size = size / 2;
     for (size_t i = 0; i < half_size; i++) {
         const Compf *const c = &fft_output[i];
         half[i] = sqrtf(c->real * c->real + c->imag * c->imag);
     }
 }
 
+void *fft_alloc(const size_t count, const size_t size)
+{
+    // aligned_alloc wants the byte count to be a multiple of the alignment.
+    const size_t align = 64;
+    const size_t bytes = (count * size + align - 1) / align * align;
+    void *ptr = aligned_alloc(align, bytes ? bytes : align);
+    if (ptr) {
+        memset(ptr, 0, bytes);
+    }
+    return ptr;
+}
+
+int spectrum_init(Spectrum *s, const size_t len)
+{
+    s->len = len;
+    s->re = fft_alloc(len, sizeof(float));
+    s->im = fft_alloc(len, sizeof(float));
+    if (!s->re || !s->im) {
+        printf("Could not allocate memory: %s\n", strerror(errno));
+        spectrum_free(s);
+        return 0;
+    }
+    return 1;
+}
+
+void spectrum_free(Spectrum *s)
+{
+    free(s->re);
+    free(s->im);
+    s->re = NULL;
+    s->im = NULL;
+    s->len = 0;
+}
+
+void spectrum_clear(Spectrum *s)
+{
+    memset(s->re, 0, s->len * sizeof(float));
+    memset(s->im, 0, s->len * sizeof(float));
+}
+
+// The kernels below are plain loops over the two arrays; with the split
+// layout every lane is independent so the compiler emits full width code for
+// each clone and the loader picks the one the CPU supports.
+
+SPECTRUM_CLONES void spectrum_power(const Spectrum *s, float *restrict out)
+{
+    const float *restrict const re = __builtin_assume_aligned(s->re, 64);
+    const float *restrict const im = __builtin_assume_aligned(s->im, 64);
+    for (size_t i = 0; i < s->len; i++) {
+        out[i] = re[i] * re[i] + im[i] * im[i];
+    }
+}
+
+SPECTRUM_CLONES void spectrum_magnitude(const Spectrum *s, float *restrict out)
+{
+    const float *restrict const re = __builtin_assume_aligned(s->re, 64);
+    const float *restrict const im = __builtin_assume_aligned(s->im, 64);
+    for (size_t i = 0; i < s->len; i++) {
+        out[i] = sqrtf(re[i] * re[i] + im[i] * im[i]);
+    }
+}
+
+// Branch free atan2 approximation, within 1e-5 rad of atan2f. The selects
+// become blends so it vectorizes like the other two.
+SPECTRUM_CLONES void spectrum_phase(const Spectrum *s, float *restrict out)
+{
+    const float *restrict const re = __builtin_assume_aligned(s->re, 64);
+    const float *restrict const im = __builtin_assume_aligned(s->im, 64);
+    const float half_pi = 1.57079632679f;
+    const float pi = 3.14159265359f;
+    for (size_t i = 0; i < s->len; i++) {
+        const float ax = fabsf(re[i]);
+        const float ay = fabsf(im[i]);
+        const float hi = ax > ay ? ax : ay;
+        const float lo = ax > ay ? ay : ax;
+        const float a = lo / (hi + FLT_MIN);
+        const float q = a * a;
+        float r = a * (0.99997726f + q * (-0.33262347f + q * (0.19354346f + q * (-0.11643287f + q * (0.05265332f + q * -0.01172120f)))));
+        r = ay > ax ? half_pi - r : r;
+        r = re[i] < 0.0f ? pi - r : r;
+        out[i] = im[i] < 0.0f ? -r : r;
+    }
+}
+
 void gen_bins(const int size)
 {
     for (int i = 0; i < size; i++) {
@@ -172,48 +510,85 @@ void gen_bins(const int size)
     printf("\n====BINS====\n");
 }
 
-static void bin_slice(const float freq, const float s, float *sums,
-                      float *max)
+// Geometric centre of a bar's frequency range.
+float bar_frequency(const int bar)
 {
-    for (int j = 0; j < DIVISOR; j++) {
-        if (freq >= bins[j] && freq < bins[j + 1]) {
-            if (s > sums[j]) {
-                sums[j] = s;
-            }
+    return sqrtf(bins[bar] * bins[bar + 1]);
+}
 
-            if (sums[j] > *max) {
-                *max = sums[j];
+// Which bar every bin below MAX_FREQ falls in, worked out with the same
+// comparisons the per bin search used so the ranges match it exactly.
+void barmap_build(BarMap *map, const int sr, const size_t size)
+{
+    map->sr = sr;
+    map->size = size;
+    memset(map->lo, 0, sizeof(map->lo));
+    memset(map->hi, 0, sizeof(map->hi));
+
+    const int half_size = (int)size / 2;
+    int j = 0;
+    for (int i = 0; i < half_size && i * ((float)sr / size) < MAX_FREQ; i++) {
+        const float freq = i * ((float)sr / size);
+        while (j < DIVISOR && freq >= bins[j + 1]) {
+            j++;
+        }
+
+        if (j < DIVISOR && freq >= bins[j]) {
+            if (map->hi[j] == 0) {
+                map->lo[j] = i;
             }
-            return;
+            map->hi[j] = i + 1;
         }
     }
 }
 
-void section_bins(const int sr, float *half, float *sums)
+float power_norm(const float *window, const size_t size)
 {
-    const int half_size = BUFFER_SIZE / 2;
-    float max = half[0];
-    for (int i = 0; i < half_size && i * ((float)sr / BUFFER_SIZE) < MAX_FREQ; i++) {
-        const float freq = i * ((float)sr / BUFFER_SIZE);
-        bin_slice(freq, half[i], sums, &max);
+    // A sine of amplitude A lands in its bin as A * sum(w) / 2.
+    double sum = 0.0;
+    for (size_t i = 0; i < size; i++) {
+        sum += window[i];
     }
+    return (float)(4.0 / (sum * sum));
+}
 
-    for (int l = 0; l < DIVISOR; l++) {
-        if (sums[l] > 0.0) {
-            sums[l] /= max;
-        }
+// Power is never negative, so zero is a safe starting point.
+static float range_power_max(const float *re, const float *im, const int lo, const int hi)
+{
+    int i = lo;
+    float max = 0.0f;
+#if defined(__SSE__)
+    __m128 m0 = _mm_setzero_ps(), m1 = _mm_setzero_ps();
+    for (; i + 8 <= hi; i += 8) {
+        const __m128 r0 = _mm_loadu_ps(&re[i]), i0 = _mm_loadu_ps(&im[i]);
+        const __m128 r1 = _mm_loadu_ps(&re[i + 4]), i1 = _mm_loadu_ps(&im[i + 4]);
+        m0 = _mm_max_ps(m0, _mm_add_ps(_mm_mul_ps(r0, r0), _mm_mul_ps(i0, i0)));
+        m1 = _mm_max_ps(m1, _mm_add_ps(_mm_mul_ps(r1, r1), _mm_mul_ps(i1, i1)));
+    }
+    m0 = _mm_max_ps(m0, m1);
+    m0 = _mm_max_ps(m0, _mm_movehl_ps(m0, m0));
+    m0 = _mm_max_ss(m0, _mm_shuffle_ps(m0, m0, 1));
+    max = _mm_cvtss_f32(m0);
+#endif
+    for (; i < hi; i++) {
+        const float p = re[i] * re[i] + im[i] * im[i];
+        max = (p > max) ? p : max;
     }
+    return max;
 }
 
-static float ls(float base, float sm, int amt, int frames)
+// The loudest bin's power per bar, scaled so a full scale sine reads 1. No
+// sqrt or log here, the post chain turns it into a height.
+void section_power(const BarMap *map, const Spectrum *s, const float norm, float *sums)
 {
-    return (base - sm) * amt * (1.0 / frames);
+    section_power_bars(map, s, norm, 0, DIVISOR, sums);
 }
 
-void interpolate(float *sums, float *ssmooth, float *ssmear, const int frames)
+// section_power for bars [first, last) only, the rest of sums is left alone.
+void section_power_bars(const BarMap *map, const Spectrum *s, const float norm, const int first, const int last,
+                        float *sums)
 {
-    for (int i = 0; i < DIVISOR; i++) {
-        ssmooth[i] += ls(sums[i], ssmooth[i], smooth, frames);
-        ssmear[i] += ls(ssmooth[i], ssmear[i], smear, frames);
+    for (int j = first; j < last; j++) {
+        sums[j] = range_power_max(s->re, s->im, map->lo[j], map->hi[j]) * norm;
     }
 }
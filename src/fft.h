@@ -2,19 +2,154 @@
 #define FFT_H
 
 #include <stddef.h>
+#include <stdint.h>
+
+#include "rndrdef.h"
+
 typedef struct
 {
     float real;
     float imag;
 } Compf;
 
+typedef struct FFTKernel FFTKernel;
+typedef struct FourStep FourStep;
+
+// Contiguous [lo, hi) run of half spectrum bins behind each bar, built once
+// per sample rate and FFT size.
+typedef struct
+{
+    int sr;
+    size_t size;
+    int lo[DIVISOR];
+    int hi[DIVISOR];
+} BarMap;
+
+typedef enum
+{
+    WINDOW_HAMMING,
+    WINDOW_HANN,
+    WINDOW_BLACKMAN_HARRIS,
+    WINDOW_KAISER,
+    WINDOW_FLAT_TOP,
+} WindowType;
+
+// Split real/imaginary spectrum, both arrays 64 byte aligned so the per bin
+// kernels load full vectors straight from each.
+typedef struct
+{
+    float *re;
+    float *im;
+    size_t len;
+} Spectrum;
+
+// Everything iter_fft needs for one transform size, built once at startup so
+// the per-frame cost is just the butterflies.
+typedef struct
+{
+    size_t size;
+    size_t log2n;
+    // Bit reversed gather order for the input.
+    uint32_t *rev;
+    // Per stage twiddles, stage with half length h lives at [h, 2h).
+    Compf *twiddle;
+    // Windowing scratch, size floats.
+    float *scratch;
+    // Transform workspace for real_fft_split (size / 2 values) and
+    // stereo_fft_split (size values).
+    Compf *work;
+    // Butterfly kernel picked for this CPU.
+    const FFTKernel *kernel;
+    // Four-step paths for the size and size / 2 point complex transforms,
+    // only set once those are big enough to fall out of cache.
+    FourStep *full;
+    FourStep *half;
+} FFTPlan;
+
+// Builds the per bin loops for each of these and lets the loader pick.
+#if defined(__x86_64__) && defined(__OPTIMIZE__)
+#define SPECTRUM_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define SPECTRUM_CLONES
+#endif
+
+// log2 from the float's exponent plus the atanh series of the mantissa,
+// reduced to [sqrt(0.5), sqrt(2)) so |t| <= 0.1716. The first dropped term is
+// below 5e-8, what's left is float rounding: at most 4e-6 in log2 (1.2e-5 dB)
+// for x between 1e-20 and 1e20. x has to be a positive normal number.
+// Inline so per bin loops can vectorise it.
+static inline float fast_log2f(const float x)
+{
+    union
+    {
+        float f;
+        uint32_t u;
+    } v = { x };
+    int e = (int)(v.u >> 23) - 127;
+    v.u = (v.u & 0x007fffff) | 0x3f800000;
+    float m = v.f;
+
+    const int big = m > 1.41421356f;
+    m = big ? m * 0.5f : m;
+    e += big;
+
+    const float t = (m - 1.0f) / (m + 1.0f);
+    const float t2 = t * t;
+    const float c1 = 2.88539008f; // 2 / ln 2
+    const float c3 = 0.96179669f; // c1 / 3
+    const float c5 = 0.57707802f; // c1 / 5
+    const float c7 = 0.41219858f; // c1 / 7
+    return (float)e + t * (c1 + t2 * (c3 + t2 * (c5 + t2 * c7)));
+}
+
+// 2^x as the integer part straight into the exponent times the Taylor series
+// of 2^f around f = 0.5, so |f - 0.5| <= 0.5 and the first dropped term is
+// below 3e-6 relative. x has to be between -126 and 127. Inline so decode
+// loops can vectorise it.
+static inline float fast_exp2f(const float x)
+{
+    int i = (int)x;
+    i -= (float)i > x;
+    const float f = (x - (float)i) - 0.5f;
+    const float c1 = 0.69314718f; // ln 2
+    const float c2 = 0.24022651f; // ln 2^2 / 2
+    const float c3 = 0.05550411f; // ln 2^3 / 6
+    const float c4 = 0.00961813f; // ln 2^4 / 24
+    const float c5 = 0.00133336f; // ln 2^5 / 120
+    const float p = 1.0f + f * (c1 + f * (c2 + f * (c3 + f * (c4 + f * c5))));
+
+    union
+    {
+        float f;
+        uint32_t u;
+    } v = { .u = (uint32_t)(i + 127) << 23 };
+    return v.f * p * 1.41421356f;
+}
+
 void gen_bins(int size);
+float bar_frequency(int bar);
 float window(float in, float coeff);
 void wfunc(float *in, const float *hamming, int size);
-void calculate_window(float *hambuf);
-void iter_fft(float *in, Compf *out, size_t size);
-void compf_to_float(float *half, Compf *fft_output);
-void section_bins(int sr, float *half, float *sums);
-void interpolate(float *sums, float *ssmooth, float *ssmear, int frames);
+void calculate_window(float *winbuf, size_t size, WindowType type, float beta);
+const char *window_name(WindowType type);
+int window_from_name(const char *name, WindowType *type);
+FFTPlan *fft_plan_create(size_t size);
+FFTPlan *fft_plan_destroy(FFTPlan *plan);
+void iter_fft(const FFTPlan *plan, const float *in, Compf *out);
+void real_fft(const FFTPlan *plan, const float *in, Compf *out);
+void real_fft_split(const FFTPlan *plan, const float *in, Spectrum *out);
+void stereo_fft_split(const FFTPlan *plan, const float *a, const float *b, Spectrum *sa, Spectrum *sb);
+void *fft_alloc(size_t count, size_t size);
+int spectrum_init(Spectrum *s, size_t len);
+void spectrum_free(Spectrum *s);
+void spectrum_clear(Spectrum *s);
+void spectrum_power(const Spectrum *s, float *restrict out);
+void spectrum_magnitude(const Spectrum *s, float *restrict out);
+void spectrum_phase(const Spectrum *s, float *restrict out);
+void compf_to_float(float *half, Compf *fft_output, size_t size);
+void barmap_build(BarMap *map, int sr, size_t size);
+float power_norm(const float *window, size_t size);
+void section_power(const BarMap *map, const Spectrum *s, float norm, float *sums);
+void section_power_bars(const BarMap *map, const Spectrum *s, float norm, int first, int last, float *sums);
 
 #endif
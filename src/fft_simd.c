@@ -0,0 +1,292 @@
+#include "fft_simd.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(FFT_CODELETS)
+#include "fft_codelets.h"
+#endif
+
+// The first stages are butterflies between close neighbours. When the build
+// generated leaf codelets (tools/fftgen.c) they do all of those for a block
+// while it sits in registers, rather than sweeping the whole array once per
+// stage. Returns the half length the caller carries on from.
+static size_t leaf_stages(Compf *out, const size_t size)
+{
+#if defined(FFT_CODELETS)
+    if (size >= FFT_LEAF_SIZE) {
+        fft_leaves(out, size);
+        return FFT_LEAF_SIZE;
+    }
+#endif
+    return 1;
+}
+
+static int scalar_supported(void) { return 1; }
+
+static void scalar_stages(const Compf *twiddle, Compf *out, const size_t size)
+{
+    for (size_t half = leaf_stages(out, size); half < size; half <<= 1) {
+        fft_radix2_stage(twiddle, out, size, half);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// Stages narrower than the vector width can't be loaded as whole registers,
+// run those through the scalar butterflies first and return where the vector
+// passes should pick up.
+static size_t narrow_stages(const Compf *twiddle, Compf *out, const size_t size, const size_t width)
+{
+    size_t half = leaf_stages(out, size);
+    while (half < width && half < size) {
+        fft_radix2_stage(twiddle, out, size, half);
+        half <<= 1;
+    }
+    return half;
+}
+
+// SSE2, two complex values per register.
+
+static int sse2_supported(void) { return __builtin_cpu_supports("sse2"); }
+
+__attribute__((target("sse2"))) static inline __m128 sse2_cmul(const __m128 w, const __m128 a)
+{
+    const __m128 sign = _mm_castsi128_ps(_mm_set_epi32(0, (int)0x80000000, 0, (int)0x80000000));
+    const __m128 wr = _mm_shuffle_ps(w, w, _MM_SHUFFLE(2, 2, 0, 0));
+    const __m128 wi = _mm_shuffle_ps(w, w, _MM_SHUFFLE(3, 3, 1, 1));
+    const __m128 swapped = _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm_add_ps(_mm_mul_ps(a, wr), _mm_xor_ps(_mm_mul_ps(swapped, wi), sign));
+}
+
+__attribute__((target("sse2"))) static void sse2_radix2(const Compf *twiddle, Compf *out, const size_t size, const size_t half)
+{
+    float *const f = (float *)out;
+    const float *const tw = (const float *)&twiddle[half];
+    for (size_t k = 0; k < size; k += half << 1) {
+        for (size_t j = 0; j < half; j += 2) {
+            const size_t i0 = 2 * (k + j), i1 = i0 + 2 * half;
+            const __m128 u = _mm_loadu_ps(&f[i0]);
+            const __m128 t = sse2_cmul(_mm_loadu_ps(&tw[2 * j]), _mm_loadu_ps(&f[i1]));
+            _mm_storeu_ps(&f[i0], _mm_add_ps(u, t));
+            _mm_storeu_ps(&f[i1], _mm_sub_ps(u, t));
+        }
+    }
+}
+
+__attribute__((target("sse2"))) static void sse2_radix4(const Compf *twiddle, Compf *out, const size_t size, const size_t half)
+{
+    float *const f = (float *)out;
+    const float *const twa = (const float *)&twiddle[half];
+    const float *const twb = (const float *)&twiddle[half << 1];
+    for (size_t k = 0; k < size; k += half << 2) {
+        for (size_t j = 0; j < half; j += 2) {
+            const size_t i0 = 2 * (k + j), i1 = i0 + 2 * half;
+            const size_t i2 = i1 + 2 * half, i3 = i2 + 2 * half;
+            const __m128 wa = _mm_loadu_ps(&twa[2 * j]);
+            const __m128 x0 = _mm_loadu_ps(&f[i0]);
+            const __m128 x2 = _mm_loadu_ps(&f[i2]);
+            __m128 t = sse2_cmul(wa, _mm_loadu_ps(&f[i1]));
+            const __m128 y0 = _mm_add_ps(x0, t);
+            const __m128 y1 = _mm_sub_ps(x0, t);
+            t = sse2_cmul(wa, _mm_loadu_ps(&f[i3]));
+            const __m128 y2 = _mm_add_ps(x2, t);
+            const __m128 y3 = _mm_sub_ps(x2, t);
+
+            t = sse2_cmul(_mm_loadu_ps(&twb[2 * j]), y2);
+            _mm_storeu_ps(&f[i0], _mm_add_ps(y0, t));
+            _mm_storeu_ps(&f[i2], _mm_sub_ps(y0, t));
+            t = sse2_cmul(_mm_loadu_ps(&twb[2 * (j + half)]), y3);
+            _mm_storeu_ps(&f[i1], _mm_add_ps(y1, t));
+            _mm_storeu_ps(&f[i3], _mm_sub_ps(y1, t));
+        }
+    }
+}
+
+static void sse2_stages(const Compf *twiddle, Compf *out, const size_t size)
+{
+    size_t half = narrow_stages(twiddle, out, size, 2);
+    for (; (half << 1) < size; half <<= 2) {
+        sse2_radix4(twiddle, out, size, half);
+    }
+    if (half < size) {
+        sse2_radix2(twiddle, out, size, half);
+    }
+}
+
+// AVX2, four complex values per register.
+
+static int avx2_supported(void)
+{
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+__attribute__((target("avx2,fma"))) static inline __m256 avx2_cmul(const __m256 w, const __m256 a)
+{
+    const __m256 swapped = _mm256_permute_ps(a, 0xB1);
+    return _mm256_fmaddsub_ps(a, _mm256_moveldup_ps(w), _mm256_mul_ps(swapped, _mm256_movehdup_ps(w)));
+}
+
+__attribute__((target("avx2,fma"))) static void avx2_radix2(const Compf *twiddle, Compf *out, const size_t size, const size_t half)
+{
+    float *const f = (float *)out;
+    const float *const tw = (const float *)&twiddle[half];
+    for (size_t k = 0; k < size; k += half << 1) {
+        for (size_t j = 0; j < half; j += 4) {
+            const size_t i0 = 2 * (k + j), i1 = i0 + 2 * half;
+            const __m256 u = _mm256_loadu_ps(&f[i0]);
+            const __m256 t = avx2_cmul(_mm256_loadu_ps(&tw[2 * j]), _mm256_loadu_ps(&f[i1]));
+            _mm256_storeu_ps(&f[i0], _mm256_add_ps(u, t));
+            _mm256_storeu_ps(&f[i1], _mm256_sub_ps(u, t));
+        }
+    }
+}
+
+__attribute__((target("avx2,fma"))) static void avx2_radix4(const Compf *twiddle, Compf *out, const size_t size, const size_t half)
+{
+    float *const f = (float *)out;
+    const float *const twa = (const float *)&twiddle[half];
+    const float *const twb = (const float *)&twiddle[half << 1];
+    for (size_t k = 0; k < size; k += half << 2) {
+        for (size_t j = 0; j < half; j += 4) {
+            const size_t i0 = 2 * (k + j), i1 = i0 + 2 * half;
+            const size_t i2 = i1 + 2 * half, i3 = i2 + 2 * half;
+            const __m256 wa = _mm256_loadu_ps(&twa[2 * j]);
+            const __m256 x0 = _mm256_loadu_ps(&f[i0]);
+            const __m256 x2 = _mm256_loadu_ps(&f[i2]);
+            __m256 t = avx2_cmul(wa, _mm256_loadu_ps(&f[i1]));
+            const __m256 y0 = _mm256_add_ps(x0, t);
+            const __m256 y1 = _mm256_sub_ps(x0, t);
+            t = avx2_cmul(wa, _mm256_loadu_ps(&f[i3]));
+            const __m256 y2 = _mm256_add_ps(x2, t);
+            const __m256 y3 = _mm256_sub_ps(x2, t);
+
+            t = avx2_cmul(_mm256_loadu_ps(&twb[2 * j]), y2);
+            _mm256_storeu_ps(&f[i0], _mm256_add_ps(y0, t));
+            _mm256_storeu_ps(&f[i2], _mm256_sub_ps(y0, t));
+            t = avx2_cmul(_mm256_loadu_ps(&twb[2 * (j + half)]), y3);
+            _mm256_storeu_ps(&f[i1], _mm256_add_ps(y1, t));
+            _mm256_storeu_ps(&f[i3], _mm256_sub_ps(y1, t));
+        }
+    }
+}
+
+static void avx2_stages(const Compf *twiddle, Compf *out, const size_t size)
+{
+    size_t half = narrow_stages(twiddle, out, size, 4);
+    for (; (half << 1) < size; half <<= 2) {
+        avx2_radix4(twiddle, out, size, half);
+    }
+    if (half < size) {
+        avx2_radix2(twiddle, out, size, half);
+    }
+}
+
+// AVX-512, eight complex values per register.
+
+static int avx512_supported(void) { return __builtin_cpu_supports("avx512f"); }
+
+__attribute__((target("avx512f"))) static inline __m512 avx512_cmul(const __m512 w, const __m512 a)
+{
+    const __m512 swapped = _mm512_permute_ps(a, 0xB1);
+    return _mm512_fmaddsub_ps(a, _mm512_moveldup_ps(w), _mm512_mul_ps(swapped, _mm512_movehdup_ps(w)));
+}
+
+__attribute__((target("avx512f"))) static void avx512_radix2(const Compf *twiddle, Compf *out, const size_t size, const size_t half)
+{
+    float *const f = (float *)out;
+    const float *const tw = (const float *)&twiddle[half];
+    for (size_t k = 0; k < size; k += half << 1) {
+        for (size_t j = 0; j < half; j += 8) {
+            const size_t i0 = 2 * (k + j), i1 = i0 + 2 * half;
+            const __m512 u = _mm512_loadu_ps(&f[i0]);
+            const __m512 t = avx512_cmul(_mm512_loadu_ps(&tw[2 * j]), _mm512_loadu_ps(&f[i1]));
+            _mm512_storeu_ps(&f[i0], _mm512_add_ps(u, t));
+            _mm512_storeu_ps(&f[i1], _mm512_sub_ps(u, t));
+        }
+    }
+}
+
+__attribute__((target("avx512f"))) static void avx512_radix4(const Compf *twiddle, Compf *out, const size_t size, const size_t half)
+{
+    float *const f = (float *)out;
+    const float *const twa = (const float *)&twiddle[half];
+    const float *const twb = (const float *)&twiddle[half << 1];
+    for (size_t k = 0; k < size; k += half << 2) {
+        for (size_t j = 0; j < half; j += 8) {
+            const size_t i0 = 2 * (k + j), i1 = i0 + 2 * half;
+            const size_t i2 = i1 + 2 * half, i3 = i2 + 2 * half;
+            const __m512 wa = _mm512_loadu_ps(&twa[2 * j]);
+            const __m512 x0 = _mm512_loadu_ps(&f[i0]);
+            const __m512 x2 = _mm512_loadu_ps(&f[i2]);
+            __m512 t = avx512_cmul(wa, _mm512_loadu_ps(&f[i1]));
+            const __m512 y0 = _mm512_add_ps(x0, t);
+            const __m512 y1 = _mm512_sub_ps(x0, t);
+            t = avx512_cmul(wa, _mm512_loadu_ps(&f[i3]));
+            const __m512 y2 = _mm512_add_ps(x2, t);
+            const __m512 y3 = _mm512_sub_ps(x2, t);
+
+            t = avx512_cmul(_mm512_loadu_ps(&twb[2 * j]), y2);
+            _mm512_storeu_ps(&f[i0], _mm512_add_ps(y0, t));
+            _mm512_storeu_ps(&f[i2], _mm512_sub_ps(y0, t));
+            t = avx512_cmul(_mm512_loadu_ps(&twb[2 * (j + half)]), y3);
+            _mm512_storeu_ps(&f[i1], _mm512_add_ps(y1, t));
+            _mm512_storeu_ps(&f[i3], _mm512_sub_ps(y1, t));
+        }
+    }
+}
+
+static void avx512_stages(const Compf *twiddle, Compf *out, const size_t size)
+{
+    size_t half = narrow_stages(twiddle, out, size, 8);
+    for (; (half << 1) < size; half <<= 2) {
+        avx512_radix4(twiddle, out, size, half);
+    }
+    if (half < size) {
+        avx512_radix2(twiddle, out, size, half);
+    }
+}
+#endif
+
+// In the order fft_kernel_best tries them. avx2 comes before avx512, it
+// measured faster on AVX-512 hardware at every size from 1024 to 65536.
+static const FFTKernel kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    { "avx2", avx2_stages, avx2_supported },
+    { "avx512", avx512_stages, avx512_supported },
+    { "sse2", sse2_stages, sse2_supported },
+#endif
+    { "scalar", scalar_stages, scalar_supported },
+};
+
+static const size_t kernelc = sizeof(kernels) / sizeof(kernels[0]);
+
+// The first kernel in the table the CPU supports, so avx2 wherever it runs
+// and avx512 only through rtav_bench --kernel. Plans are made from the worker,
+// spectrogram and batch threads at once. They all come to the same answer,
+// so the first to store it wins and the rest just redo the CPU check.
+const FFTKernel *fft_kernel_best(void)
+{
+    static _Atomic(const FFTKernel *) best = NULL;
+    const FFTKernel *found = atomic_load_explicit(&best, memory_order_relaxed);
+    if (!found) {
+        for (size_t i = 0; i < kernelc && !found; i++) {
+            if (kernels[i].supported()) {
+                found = &kernels[i];
+            }
+        }
+        atomic_store_explicit(&best, found, memory_order_relaxed);
+    }
+    return found;
+}
+
+const FFTKernel *fft_kernel_find(const char *name)
+{
+    for (size_t i = 0; i < kernelc; i++) {
+        if (strcmp(kernels[i].name, name) == 0) {
+            return kernels[i].supported() ? &kernels[i] : NULL;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,23 @@
+#ifndef FFT_SIMD_H
+#define FFT_SIMD_H
+
+#include "fft.h"
+
+// Butterfly kernels for the stages after the bit reversed gather. Every
+// kernel does the same radix-2 butterflies as the scalar one in the same
+// order, the vector ones just fuse pairs of stages into a radix-4 pass and
+// run several butterflies per instruction. The only difference in the result
+// comes from FMA contraction, which keeps every bin within 1e-6 of the
+// spectrum peak of the scalar output.
+struct FFTKernel
+{
+    const char *name;
+    void (*stages)(const Compf *twiddle, Compf *out, size_t size);
+    int (*supported)(void);
+};
+
+void fft_radix2_stage(const Compf *twiddle, Compf *out, size_t size, size_t half);
+const FFTKernel *fft_kernel_best(void);
+const FFTKernel *fft_kernel_find(const char *name);
+
+#endif
@@ -0,0 +1,229 @@
+#include "fourstep.h"
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+FourStep *fourstep_destroy(FourStep *fs)
+{
+    if (fs) {
+        fs->p1 = fft_plan_destroy(fs->p1);
+        fs->p2 = fft_plan_destroy(fs->p2);
+        free(fs->tw_re);
+        free(fs->tw_im);
+        free(fs->scratch);
+        free(fs->block);
+        free(fs);
+    }
+    return NULL;
+}
+
+FourStep *fourstep_create(const size_t n)
+{
+    size_t log2n = 0;
+    while (((size_t)1 << log2n) < n) {
+        log2n++;
+    }
+    if (((size_t)1 << log2n) != n || n < FOURSTEP_BLOCK * FOURSTEP_BLOCK) {
+        printf("Four-step FFT size must be a power of two of at least %d: %zu\n", FOURSTEP_BLOCK * FOURSTEP_BLOCK, n);
+        return NULL;
+    }
+
+    FourStep *fs = calloc(1, sizeof(FourStep));
+    if (!fs) {
+        printf("Could not allocate memory: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    fs->n = n;
+    fs->n1 = (size_t)1 << (log2n / 2);
+    fs->n2 = n / fs->n1;
+    fs->p1 = fft_plan_create(fs->n1);
+    fs->p2 = fft_plan_create(fs->n2);
+    fs->tw_re = fft_alloc(n, sizeof(float));
+    fs->tw_im = fft_alloc(n, sizeof(float));
+    fs->scratch = fft_alloc(n, sizeof(Compf));
+    fs->block = fft_alloc(2 * FOURSTEP_BLOCK * fs->n2, sizeof(float));
+    if (!fs->p1 || !fs->p2 || !fs->tw_re || !fs->tw_im || !fs->scratch || !fs->block) {
+        printf("Could not allocate memory: %s\n", strerror(errno));
+        return fourstep_destroy(fs);
+    }
+
+    // Same positive exponent as the rest of the FFT, worked out in double.
+    for (size_t k1 = 0; k1 < fs->n1; k1++) {
+        for (size_t j2 = 0; j2 < fs->n2; j2++) {
+            const double theta = 2.0 * M_PI * (double)((j2 * k1) % n) / (double)n;
+            fs->tw_re[k1 * fs->n2 + j2] = (float)cos(theta);
+            fs->tw_im[k1 * fs->n2 + j2] = (float)sin(theta);
+        }
+    }
+    return fs;
+}
+
+// One butterfly across every column of the block.
+static inline void columns_butterfly(float *restrict ur, float *restrict ui, float *restrict vr, float *restrict vi,
+                                     const float wr, const float wi)
+{
+    for (size_t c = 0; c < FOURSTEP_BLOCK; c++) {
+        const float tr = wr * vr[c] - wi * vi[c];
+        const float ti = wr * vi[c] + wi * vr[c];
+        vr[c] = ur[c] - tr;
+        vi[c] = ui[c] - ti;
+        ur[c] += tr;
+        ui[c] += ti;
+    }
+}
+
+// n point FFTs of FOURSTEP_BLOCK columns side by side, element i of column c
+// at [i * FOURSTEP_BLOCK + c], already in bit reversed order. Every butterfly
+// is the same operation on all the columns so each stage is full width vector
+// code no matter how short it is.
+SPECTRUM_CLONES static void columns_stages(const Compf *twiddle, float *re, float *im, const size_t n)
+{
+    for (size_t half = 1; half < n; half <<= 1) {
+        const Compf *const tw = &twiddle[half];
+        for (size_t k = 0; k < n; k += half << 1) {
+            for (size_t j = 0; j < half; j++) {
+                const size_t u = (k + j) * FOURSTEP_BLOCK, v = u + half * FOURSTEP_BLOCK;
+                columns_butterfly(&re[u], &im[u], &re[v], &im[v], tw[j].real, tw[j].imag);
+            }
+        }
+    }
+}
+
+// One row of FOURSTEP_BLOCK complex values into and out of the split block.
+// The compiler leaves these interleaved copies scalar, so they're spelled out.
+static inline void split_row(const Compf *restrict src, float *restrict re, float *restrict im)
+{
+    size_t c = 0;
+#if defined(__SSE__)
+    const float *const f = (const float *)src;
+    for (; c < FOURSTEP_BLOCK; c += 4) {
+        const __m128 x = _mm_loadu_ps(&f[2 * c]);
+        const __m128 y = _mm_loadu_ps(&f[2 * c + 4]);
+        _mm_storeu_ps(&re[c], _mm_shuffle_ps(x, y, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_ps(&im[c], _mm_shuffle_ps(x, y, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+#endif
+    for (; c < FOURSTEP_BLOCK; c++) {
+        re[c] = src[c].real;
+        im[c] = src[c].imag;
+    }
+}
+
+static inline void join_row(const float *restrict re, const float *restrict im, Compf *restrict dst)
+{
+    size_t c = 0;
+#if defined(__SSE__)
+    float *const f = (float *)dst;
+    for (; c < FOURSTEP_BLOCK; c += 4) {
+        const __m128 r = _mm_loadu_ps(&re[c]);
+        const __m128 i = _mm_loadu_ps(&im[c]);
+        _mm_storeu_ps(&f[2 * c], _mm_unpacklo_ps(r, i));
+        _mm_storeu_ps(&f[2 * c + 4], _mm_unpackhi_ps(r, i));
+    }
+#endif
+    for (; c < FOURSTEP_BLOCK; c++) {
+        dst[c].real = re[c];
+        dst[c].imag = im[c];
+    }
+}
+
+// Writes the block's columns out as rows: column c goes to dst + c * stride.
+// Done in 4 x 4 tiles so every load and store is a whole register.
+static void store_transposed(const float *restrict re, const float *restrict im, const size_t n, Compf *restrict dst,
+                             const size_t stride)
+{
+#if defined(__SSE__)
+    for (size_t k = 0; k < n; k += 4) {
+        for (size_t c = 0; c < FOURSTEP_BLOCK; c += 4) {
+            __m128 r0 = _mm_loadu_ps(&re[k * FOURSTEP_BLOCK + c]);
+            __m128 r1 = _mm_loadu_ps(&re[(k + 1) * FOURSTEP_BLOCK + c]);
+            __m128 r2 = _mm_loadu_ps(&re[(k + 2) * FOURSTEP_BLOCK + c]);
+            __m128 r3 = _mm_loadu_ps(&re[(k + 3) * FOURSTEP_BLOCK + c]);
+            __m128 i0 = _mm_loadu_ps(&im[k * FOURSTEP_BLOCK + c]);
+            __m128 i1 = _mm_loadu_ps(&im[(k + 1) * FOURSTEP_BLOCK + c]);
+            __m128 i2 = _mm_loadu_ps(&im[(k + 2) * FOURSTEP_BLOCK + c]);
+            __m128 i3 = _mm_loadu_ps(&im[(k + 3) * FOURSTEP_BLOCK + c]);
+            _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+            _MM_TRANSPOSE4_PS(i0, i1, i2, i3);
+
+            const __m128 r[4] = { r0, r1, r2, r3 };
+            const __m128 i[4] = { i0, i1, i2, i3 };
+            for (size_t t = 0; t < 4; t++) {
+                float *const f = (float *)&dst[(c + t) * stride + k];
+                _mm_storeu_ps(f, _mm_unpacklo_ps(r[t], i[t]));
+                _mm_storeu_ps(f + 4, _mm_unpackhi_ps(r[t], i[t]));
+            }
+        }
+    }
+#else
+    for (size_t c = 0; c < FOURSTEP_BLOCK; c++) {
+        for (size_t k = 0; k < n; k++) {
+            dst[c * stride + k].real = re[k * FOURSTEP_BLOCK + c];
+            dst[c * stride + k].imag = im[k * FOURSTEP_BLOCK + c];
+        }
+    }
+#endif
+}
+
+static inline void twiddle_row(float *restrict re, float *restrict im, const float *restrict wr, const float *restrict wi)
+{
+    for (size_t c = 0; c < FOURSTEP_BLOCK; c++) {
+        const float r = re[c] * wr[c] - im[c] * wi[c];
+        im[c] = re[c] * wi[c] + im[c] * wr[c];
+        re[c] = r;
+    }
+}
+
+// FOURSTEP_BLOCK columns from c0 of the rows x stride matrix src, gathered
+// down the rows in bit reversed order and transformed.
+SPECTRUM_CLONES static void columns_fft(const FFTPlan *p, const Compf *src, const size_t stride, const size_t c0, float *re,
+                                        float *im)
+{
+    const size_t n = p->size;
+    for (size_t i = 0; i < n; i++) {
+        split_row(&src[(size_t)p->rev[i] * stride + c0], &re[i * FOURSTEP_BLOCK], &im[i * FOURSTEP_BLOCK]);
+    }
+    columns_stages(p->twiddle, re, im, n);
+}
+
+SPECTRUM_CLONES static void columns_twiddle(const FourStep *fs, const size_t j0, float *re, float *im)
+{
+    for (size_t k1 = 0; k1 < fs->n1; k1++) {
+        const size_t t = k1 * fs->n2 + j0;
+        twiddle_row(&re[k1 * FOURSTEP_BLOCK], &im[k1 * FOURSTEP_BLOCK], &fs->tw_re[t], &fs->tw_im[t]);
+    }
+}
+
+// Input index j1 * n2 + j2, output index k1 + n1 * k2:
+// X = sum over j2 of w_n^(j2 k1) w_n2^(j2 k2) (sum over j1 of x w_n1^(j1 k1)).
+void fourstep_run(const FourStep *fs, Compf *z)
+{
+    const size_t n1 = fs->n1, n2 = fs->n2;
+    float *const re = fs->block;
+    float *const im = fs->block + FOURSTEP_BLOCK * n2;
+    Compf *const mid = fs->scratch;
+
+    // n1 point FFTs down the columns of z (n1 x n2), twiddled and stored
+    // transposed as mid[j2][k1].
+    for (size_t j0 = 0; j0 < n2; j0 += FOURSTEP_BLOCK) {
+        columns_fft(fs->p1, z, n2, j0, re, im);
+        columns_twiddle(fs, j0, re, im);
+        store_transposed(re, im, n1, &mid[j0 * n1], n1);
+    }
+
+    // n2 point FFTs down the columns of mid (n2 x n1), which lands every row
+    // of the result in place at z[k2][k1].
+    for (size_t k0 = 0; k0 < n1; k0 += FOURSTEP_BLOCK) {
+        columns_fft(fs->p2, mid, n1, k0, re, im);
+        for (size_t k2 = 0; k2 < n2; k2++) {
+            join_row(&re[k2 * FOURSTEP_BLOCK], &im[k2 * FOURSTEP_BLOCK], &z[k2 * n1 + k0]);
+        }
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef FOURSTEP_H
+#define FOURSTEP_H
+
+#include "fft.h"
+
+// Transforms from this many complex points up go through the four-step path.
+#define FOURSTEP_MIN (1 << 15)
+// Columns moved per step. 16 floats of each half fill an AVX-512 register,
+// 16 complex values are two cache lines.
+#define FOURSTEP_BLOCK 16
+
+// Bailey's four-step FFT for big transforms. n = n1 * n2 is treated as an
+// n1 x n2 matrix: n1 point FFTs down the columns, a twiddle per element, then
+// n2 point FFTs down the columns of the transposed result. Both passes work
+// on sixteen columns at a time in a small buffer, so every read and write to
+// the big arrays is a whole cache line and the small FFTs stay in L1. Input is
+// in natural order, there's no bit reversal pass over the whole array.
+struct FourStep
+{
+    size_t n;
+    size_t n1;
+    size_t n2;
+    FFTPlan *p1;
+    FFTPlan *p2;
+    // w_n^(j2 k1) at [k1 * n2 + j2], split like the block.
+    float *tw_re;
+    float *tw_im;
+    // The n1 x n2 middle matrix.
+    Compf *scratch;
+    // Split real and imaginary halves for the small FFTs, FOURSTEP_BLOCK
+    // columns of up to n2 values each.
+    float *block;
+};
+
+FourStep *fourstep_create(size_t n);
+FourStep *fourstep_destroy(FourStep *fs);
+void fourstep_run(const FourStep *fs, Compf *z);
+
+#endif
@@ -0,0 +1,301 @@
+#include "loudness.h"
+#include "entry.h"
+#include "fft.h"
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// Gain never pushes the true peak above this.
+static const float PEAK_CEILING = -1.0f;
+
+// The BS.1770 filters for any sample rate, from the analog prototypes the
+// 48 kHz coefficients in the standard come from.
+static void kweight_init(Loudness *l, const int sr)
+{
+    double f0 = 1681.974450955533;
+    const double gain = 3.999843853973347;
+    double q = 0.7071752369554196;
+    double k = tan(M_PI * f0 / sr);
+    const double vh = pow(10.0, gain / 20.0);
+    const double vb = pow(vh, 0.4996667741545416);
+    double a0 = 1.0 + k / q + k * k;
+    l->shelf.b0 = (vh + vb * k / q + k * k) / a0;
+    l->shelf.b1 = 2.0 * (k * k - vh) / a0;
+    l->shelf.b2 = (vh - vb * k / q + k * k) / a0;
+    l->shelf.a1 = 2.0 * (k * k - 1.0) / a0;
+    l->shelf.a2 = (1.0 - k / q + k * k) / a0;
+
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = tan(M_PI * f0 / sr);
+    a0 = 1.0 + k / q + k * k;
+    l->highpass.b0 = 1.0;
+    l->highpass.b1 = -2.0;
+    l->highpass.b2 = 1.0;
+    l->highpass.a1 = 2.0 * (k * k - 1.0) / a0;
+    l->highpass.a2 = (1.0 - k / q + k * k) / a0;
+}
+
+// Hann windowed sinc cut at the original Nyquist, split into the four
+// phases. Each phase sums to one so DC passes at unity.
+static void true_peak_init(Loudness *l)
+{
+    const int n = TRUE_PEAK_PHASES * TRUE_PEAK_TAPS;
+    const double mid = (n - 1) / 2.0;
+    for (int p = 0; p < TRUE_PEAK_PHASES; p++) {
+        double sum = 0.0;
+        for (int k = 0; k < TRUE_PEAK_TAPS; k++) {
+            const int j = k * TRUE_PEAK_PHASES + p;
+            const double t = (j - mid) / TRUE_PEAK_PHASES;
+            const double sinc = (t == 0.0) ? 1.0 : sin(M_PI * t) / (M_PI * t);
+            const double w = 0.5 - 0.5 * cos(2.0 * M_PI * (j + 1) / (n + 1));
+            l->fir[p][k] = (float)(sinc * w);
+            sum += sinc * w;
+        }
+        for (int k = 0; k < TRUE_PEAK_TAPS; k++) {
+            l->fir[p][k] = (float)(l->fir[p][k] / sum);
+        }
+    }
+}
+
+void loudness_init(Loudness *l, const int sr)
+{
+    memset(l, 0, sizeof(Loudness));
+    l->sr = sr;
+    l->sub_len = (uint32_t)(sr / 10);
+    kweight_init(l, sr);
+    true_peak_init(l);
+}
+
+static double block_lufs(const double z) { return -0.691 + 10.0 * log10(z); }
+
+// Closes a 100 ms piece. Once there are four, the 400 ms block ending here
+// goes into the histogram if it clears the absolute gate.
+static void sub_done(Loudness *l)
+{
+    l->subs[l->subc % 4] = l->sub;
+    l->subc++;
+    l->sub = 0.0;
+    l->sub_fill = 0;
+    if (l->subc < 4) {
+        return;
+    }
+
+    const double z = (l->subs[0] + l->subs[1] + l->subs[2] + l->subs[3]) / (4.0 * l->sub_len);
+    if (z <= 0.0 || block_lufs(z) < LOUDNESS_GATE) {
+        return;
+    }
+    int bin = (int)((block_lufs(z) - LOUDNESS_GATE) * 10.0);
+    bin = (bin < LOUDNESS_BINS) ? bin : LOUDNESS_BINS - 1;
+    l->count[bin]++;
+    l->energy[bin] += z;
+}
+
+// K-weighted energy of both channels. The filters are recursive so each
+// channel is one long dependency chain, running both in the same loop lets
+// them overlap.
+static double kweight_energy(Loudness *l, const float *in, const size_t n)
+{
+    const Biquad s = l->shelf, h = l->highpass;
+    double *const zl = l->z[0], *const zr = l->z[1];
+    double l0 = zl[0], l1 = zl[1], l2 = zl[2], l3 = zl[3];
+    double r0 = zr[0], r1 = zr[1], r2 = zr[2], r3 = zr[3];
+    double suml = 0.0, sumr = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        const double xl = in[AUDIO_CHANNELS * i];
+        const double xr = in[AUDIO_CHANNELS * i + 1];
+        const double yl = s.b0 * xl + l0;
+        const double yr = s.b0 * xr + r0;
+        l0 = s.b1 * xl - s.a1 * yl + l1;
+        r0 = s.b1 * xr - s.a1 * yr + r1;
+        l1 = s.b2 * xl - s.a2 * yl;
+        r1 = s.b2 * xr - s.a2 * yr;
+        const double wl = h.b0 * yl + l2;
+        const double wr = h.b0 * yr + r2;
+        l2 = h.b1 * yl - h.a1 * wl + l3;
+        r2 = h.b1 * yr - h.a1 * wr + r3;
+        l3 = h.b2 * yl - h.a2 * wl;
+        r3 = h.b2 * yr - h.a2 * wr;
+        suml += wl * wl;
+        sumr += wr * wr;
+    }
+    zl[0] = l0, zl[1] = l1, zl[2] = l2, zl[3] = l3;
+    zr[0] = r0, zr[1] = r1, zr[2] = r2, zr[3] = r3;
+    return suml + sumr;
+}
+
+// Up to TRUE_PEAK_RUN frames. The interpolator only runs when the samples
+// come within 6 dB of the peak so far, inter-sample peaks don't get further
+// above the samples around them than that in real material. Vectorised over
+// the output samples, the taps are the outer loop.
+static SPECTRUM_CLONES void true_peak_run(Loudness *l, const float *in, const size_t n)
+{
+    float hi = 0.0f;
+    for (size_t i = 0; i < n * AUDIO_CHANNELS; i++) {
+        const float a = fabsf(in[i]);
+        hi = (a > hi) ? a : hi;
+    }
+    const int skip = 2.0f * hi <= l->peak;
+    l->peak = (hi > l->peak) ? hi : l->peak;
+
+    float x[TRUE_PEAK_TAPS - 1 + TRUE_PEAK_RUN];
+    float y[TRUE_PEAK_RUN];
+    for (int c = 0; c < AUDIO_CHANNELS; c++) {
+        memcpy(x, l->tail[c], sizeof(l->tail[c]));
+        for (size_t i = 0; i < n; i++) {
+            x[TRUE_PEAK_TAPS - 1 + i] = in[AUDIO_CHANNELS * i + c];
+        }
+
+        for (int p = 0; p < TRUE_PEAK_PHASES && !skip; p++) {
+            memset(y, 0, n * sizeof(float));
+            for (int k = 0; k < TRUE_PEAK_TAPS; k++) {
+                const float tap = l->fir[p][k];
+                const float *const src = &x[TRUE_PEAK_TAPS - 1 - k];
+                for (size_t i = 0; i < n; i++) {
+                    y[i] += tap * src[i];
+                }
+            }
+            float m = l->peak;
+            for (size_t i = 0; i < n; i++) {
+                const float a = fabsf(y[i]);
+                m = (a > m) ? a : m;
+            }
+            l->peak = m;
+        }
+        memcpy(l->tail[c], &x[n], sizeof(l->tail[c]));
+    }
+}
+
+// Interleaved frames in stream order, any number per call.
+void loudness_feed(Loudness *l, const float *frames, size_t count)
+{
+    for (size_t done = 0; done < count;) {
+        const size_t left = count - done;
+        const size_t room = l->sub_len - l->sub_fill;
+        const size_t n = (left < room) ? left : room;
+        l->sub += kweight_energy(l, frames + AUDIO_CHANNELS * done, n);
+        l->sub_fill += (uint32_t)n;
+        done += n;
+        if (l->sub_fill == l->sub_len) {
+            sub_done(l);
+        }
+    }
+
+    for (size_t done = 0; done < count; done += TRUE_PEAK_RUN) {
+        const size_t left = count - done;
+        true_peak_run(l, frames + AUDIO_CHANNELS * done, (left < TRUE_PEAK_RUN) ? left : TRUE_PEAK_RUN);
+    }
+}
+
+// The relative gate sits 10 LU under the mean of everything above the
+// absolute one. Bins are 0.1 LU so the one straddling it is taken whole.
+LoudnessResult loudness_result(const Loudness *l)
+{
+    LoudnessResult r = { -INFINITY, (l->peak > 0.0f) ? 20.0f * log10f(l->peak) : -INFINITY };
+    uint64_t count = 0;
+    double energy = 0.0;
+    for (int b = 0; b < LOUDNESS_BINS; b++) {
+        count += l->count[b];
+        energy += l->energy[b];
+    }
+    if (count == 0) {
+        return r;
+    }
+
+    const double gate = block_lufs(energy / count) - 10.0;
+    int first = (int)floor((gate - LOUDNESS_GATE) * 10.0);
+    first = (first > 0) ? first : 0;
+    count = 0;
+    energy = 0.0;
+    for (int b = first; b < LOUDNESS_BINS; b++) {
+        count += l->count[b];
+        energy += l->energy[b];
+    }
+    r.lufs = (float)block_lufs(energy / count);
+    return r;
+}
+
+// Linear gain that brings the track to target LUFS, held back so the true
+// peak stays under PEAK_CEILING. Silence gets left alone.
+float loudness_gain(const LoudnessResult *r, const float target)
+{
+    if (!isfinite(r->lufs)) {
+        return 1.0f;
+    }
+    float db = target - r->lufs;
+    if (isfinite(r->peak) && r->peak + db > PEAK_CEILING) {
+        db = PEAK_CEILING - r->peak;
+    }
+    return powf(10.0f, db / 20.0f);
+}
+
+// One line per measured file in the "loudness" cache: lufs, peak, size,
+// mtime, then the path to the end of the line.
+// The cache is keyed on the absolute path, size and mtime, so an edited
+// file gets measured again. Later lines win.
+static int cache_key(const char *path, char *abs, struct stat *st)
+{
+    if (stat(path, st) < 0 || !realpath(path, abs)) {
+        return 0;
+    }
+    return strchr(abs, '\n') == NULL;
+}
+
+int loudness_cache_find(const char *path, LoudnessResult *r)
+{
+    char abs[PATH_MAX], cache[PATH_MAX];
+    struct stat st;
+    if (!cache_key(path, abs, &st) || !cache_path(cache, sizeof(cache), "loudness", 0)) {
+        return 0;
+    }
+
+    FILE *file = fopen(cache, "r");
+    if (!file) {
+        return 0;
+    }
+
+    char line[PATH_MAX + 128];
+    int found = 0;
+    while (fgets(line, sizeof(line), file)) {
+        float lufs, peak;
+        long long size, mtime;
+        int off = 0;
+        if (sscanf(line, "%f %f %lld %lld %n", &lufs, &peak, &size, &mtime, &off) != 4) {
+            continue;
+        }
+        line[strcspn(line, "\n")] = '\0';
+        if (size == (long long)st.st_size && mtime == (long long)st.st_mtime && strcmp(line + off, abs) == 0) {
+            r->lufs = lufs;
+            r->peak = peak;
+            found = 1;
+        }
+    }
+
+    if (fclose(file) == EOF) {
+        printf("Failed to close file: %s\n", strerror(errno));
+    }
+    return found;
+}
+
+void loudness_cache_store(const char *path, const LoudnessResult *r)
+{
+    char abs[PATH_MAX], cache[PATH_MAX];
+    struct stat st;
+    if (!cache_key(path, abs, &st) || !cache_path(cache, sizeof(cache), "loudness", 1)) {
+        return;
+    }
+
+    FILE *file = fopen(cache, "a");
+    if (!file) {
+        printf("Could not open %s: %s\n", cache, strerror(errno));
+        return;
+    }
+    fprintf(file, "%.2f %.2f %lld %lld %s\n", r->lufs, r->peak, (long long)st.st_size, (long long)st.st_mtime, abs);
+    if (fclose(file) == EOF) {
+        printf("Failed to close file: %s\n", strerror(errno));
+    }
+}
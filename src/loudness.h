@@ -0,0 +1,65 @@
+#ifndef LOUDNESS_H
+#define LOUDNESS_H
+
+#include "audio.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Blocks quieter than this never count (BS.1770 absolute gate).
+#define LOUDNESS_GATE -70.0
+// Gated blocks are kept as a histogram of 0.1 LU bins from the gate up to
+// +10 LUFS, so a track of any length takes the same memory.
+#define LOUDNESS_BINS 800
+#define TRUE_PEAK_PHASES 4
+#define TRUE_PEAK_TAPS 12
+// Frames per true peak run, see loudness_feed.
+#define TRUE_PEAK_RUN 1024
+
+typedef struct
+{
+    double b0, b1, b2, a1, a2;
+} Biquad;
+
+// ITU-R BS.1770 / EBU R128 integrated loudness and true peak, fed with
+// interleaved frames as they're decoded. K-weighting is a high shelf and a
+// high pass per channel, 400 ms blocks overlap by 75% so the energy is kept
+// per 100 ms and every block is the last four of those.
+typedef struct
+{
+    int sr;
+    Biquad shelf;
+    Biquad highpass;
+    // Transposed direct form II state, shelf then high pass.
+    double z[AUDIO_CHANNELS][4];
+
+    uint32_t sub_len;
+    uint32_t sub_fill;
+    double sub;
+    double subs[4];
+    uint64_t subc;
+
+    uint32_t count[LOUDNESS_BINS];
+    double energy[LOUDNESS_BINS];
+
+    // 4x polyphase interpolator, tail holds the last input of each channel.
+    float fir[TRUE_PEAK_PHASES][TRUE_PEAK_TAPS];
+    float tail[AUDIO_CHANNELS][TRUE_PEAK_TAPS - 1];
+    float peak;
+} Loudness;
+
+typedef struct
+{
+    // -inf for silence.
+    float lufs;
+    // dBTP.
+    float peak;
+} LoudnessResult;
+
+void loudness_init(Loudness *l, int sr);
+void loudness_feed(Loudness *l, const float *frames, size_t count);
+LoudnessResult loudness_result(const Loudness *l);
+float loudness_gain(const LoudnessResult *r, float target);
+int loudness_cache_find(const char *path, LoudnessResult *r);
+void loudness_cache_store(const char *path, const LoudnessResult *r);
+
+#endif
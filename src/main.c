@@ -4,11 +4,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "analysis.h"
 #include "audio.h"
+#include "audit.h"
+#include "batch.h"
+#include "config.h"
 #include "entry.h"
 #include "fft.h"
+#include "fft_simd.h"
+#include "post.h"
+#include "record.h"
 #include "renderer.h"
+#include "rhythm.h"
 #include "rndrdef.h"
+#include "trace.h"
+#include "worker.h"
 
 #include <GL/gl.h>
 #include <SDL2/SDL.h>
@@ -17,18 +27,26 @@
 #include <errno.h>
 #include <time.h>
 
+// What the post chain made of the latest analysis for the renderer. The
+// pulses follow the playback position, not the smoothing.
 typedef struct
 {
-    Compf out_buffer[BUFFER_SIZE];
-    float out_half[BUFFER_SIZE];
-} Raw;
+    float level[DIVISOR];
+    float trail[DIVISOR];
+    PostChain post;
+    float beat;
+    float onset;
+} Transformed;
 
+// Frames drawn and analyses done since the last report, the two run at their
+// own rates.
 typedef struct
 {
-    float sums[DIVISOR];
-    float ssmooth[DIVISOR];
-    float ssmear[DIVISOR];
-} Transformed;
+    uint64_t start;
+    uint64_t frames;
+    uint64_t analyses;
+    uint64_t busy;
+} Rates;
 
 static SDL_Window *make_window(const char *argv);
 static AParams *begin_audio_file(const Entry *e);
@@ -40,17 +58,36 @@ static AParams *find_queued(int *attempts, const Entry **current, const Entry *e
 static void *free_params(AParams *p);
 static void _fail(int *run, int attempts);
 static uint32_t _scount(uint32_t remaining);
-static void wipe(Transformed *tf, Raw *raw);
+static void wipe(Transformed *tf);
+static void print_rates(Rates *r, Worker *w);
+static AParams *change_track(Worker *w, Transformed *tf, Rates *rates, AParams *p, int *attempts,
+                             const Entry **current, const Entry *estart, const Entry *eend, int dir);
 
 int main(int argc, char **argv)
 {
     srand(time(NULL));
-    if (argc < 2 || argc > 2) {
-        printf("Usage: ./3dmv <directory>\n");
+    Config cfg;
+    if (!config_parse(&cfg, argc, argv)) {
         return 0;
     }
+    config_print(&cfg);
+    audio_configure(cfg.fft_size);
+    audio_normalize(cfg.normalize, cfg.loudness_target);
+    if (!trace_init(cfg.trace)) {
+        return 1;
+    }
+    audit_init(cfg.audit);
 
-    const char *directory = argv[1];
+    if (cfg.analyze) {
+        gen_bins(DIVISOR + 1);
+        return batch_run(&cfg) ? 0 : 1;
+    }
+    if (cfg.replay) {
+        gen_bins(DIVISOR + 1);
+        return replay_run(&cfg) ? 0 : 1;
+    }
+
+    const char *directory = cfg.directory;
     Entries ents = read_directory(directory);
 
     if (ents.size == 0) {
@@ -138,17 +175,39 @@ int main(int argc, char **argv)
     }
     gl_data_construct(&rd);
 
+    Worker worker;
+    Transformed tf = { 0 };
+
+    // The bar frequencies have to be there before the worker's first analysis.
+    gen_bins(DIVISOR + 1);
+
+    if (!worker_start(&worker, &cfg)) {
+        if (ents.list) {
+            free(ents.list);
+        }
+
+        glDeleteProgram(rd.shader_program_id);
+        SDL_GL_DeleteContext(glcontext);
+        SDL_DestroyWindow(win);
+        SDL_Quit();
+        return 1;
+    }
+    printf("FFT kernel: %s\n", worker.raw.plan->kernel->name);
+
+    Recorder recorder;
+    const int recording = cfg.record && recorder_start(&recorder, &cfg, cfg.record);
+    if (recording) {
+        audio_record(&recorder);
+    }
+
     Entry *const estart = ents.list;
     Entry *const eend = ents.list + ents.size;
     const Entry *current = estart;
     AParams *p = begin_audio_file(current);
+    worker_attach(&worker, p, current->fullpath);
+    Rates rates = { SDL_GetPerformanceCounter(), 0, 0, 0 };
 
-    float hambuf[BUFFER_SIZE];
-    Raw raw = { 0 };
-    Transformed tf = { 0 };
-
-    calculate_window(hambuf);
-    gen_bins(DIVISOR + 1);
+    post_init(&tf.post, &cfg.post, FRAME_RATE);
 
     const int MAX_ATTEMPTS = 6;
     int song_queued = 0, attempts = 0;
@@ -160,8 +219,10 @@ int main(int argc, char **argv)
 
     while (run) {
         const uint32_t start = SDL_GetTicks64();
+        const uint64_t frame_start = trace_now();
         gl_clear_canvas();
 
+        uint64_t traced = trace_now();
         SDL_Event e;
         while (SDL_PollEvent(&e)) {
             switch (e.type) {
@@ -178,6 +239,11 @@ int main(int argc, char **argv)
                     toggle_pause();
                 } break;
 
+                case SDLK_t:
+                {
+                    trace_request_dump();
+                } break;
+
                 case SDLK_DOWN:
                 {
                     _vol(-0.1);
@@ -192,11 +258,7 @@ int main(int argc, char **argv)
                 {
                     float cd = 100;
                     if (SDL_GetTicks64() - lastinput >= cd) {
-                        audio_end();
-                        wipe(&tf, &raw);
-                        AParams *tmp = p;
-                        p = find_queued(&attempts, &current, estart, eend, -1);
-                        tmp = free_params(tmp);
+                        p = change_track(&worker, &tf, &rates, p, &attempts, &current, estart, eend, -1);
                         lastinput = SDL_GetTicks64();
                     }
                 } break;
@@ -205,11 +267,7 @@ int main(int argc, char **argv)
                 {
                     float cd = 100;
                     if (SDL_GetTicks64() - lastinput >= cd) {
-                        audio_end();
-                        wipe(&tf, &raw);
-                        AParams *tmp = p;
-                        p = find_queued(&attempts, &current, estart, eend, 1);
-                        tmp = free_params(tmp);
+                        p = change_track(&worker, &tf, &rates, p, &attempts, &current, estart, eend, 1);
                         lastinput = SDL_GetTicks64();
                     }
                 } break;
@@ -236,41 +294,50 @@ int main(int argc, char **argv)
             }
         }
 
+        trace_end(TRACE_EVENTS_POLL, traced);
+
         song_queued = query_audio_position(&p);
         if (song_queued && p) {
-            audio_end();
-            wipe(&tf, &raw);
-            AParams *tmp = p;
-            p = find_queued(&attempts, &current, estart, eend, 1);
-            tmp = free_params(tmp);
+            p = change_track(&worker, &tf, &rates, p, &attempts, &current, estart, eend, 1);
 
         } else if (!song_queued && !p) {
-            audio_end();
-            wipe(&tf, &raw);
-            p = find_queued(&attempts, &current, estart, eend, 1);
+            p = change_track(&worker, &tf, &rates, p, &attempts, &current, estart, eend, 1);
             if (!p && attempts > MAX_ATTEMPTS) {
                 _fail(&run, attempts);
             }
         }
 
+        // Whatever the worker published last, the bars move at the frame rate
+        // and the analysis at its own.
+        const BarFrame *const bars = worker_latest(&worker);
         if (p && p->buffer && get_audio_state() == SDL_AUDIO_PLAYING) {
-            float snapshot[BUFFER_SIZE];
-            memset(&raw, 0, sizeof(Raw));
-            memset(tf.sums, 0, sizeof(float) * DIVISOR);
-            memcpy(snapshot, p->sample_buffer, sizeof(float) * BUFFER_SIZE);
-
-            wfunc(snapshot, hambuf, BUFFER_SIZE);
-            iter_fft(snapshot, raw.out_buffer, BUFFER_SIZE);
-            compf_to_float(raw.out_half, raw.out_buffer);
-            section_bins(p->sr, raw.out_half, tf.sums);
-            interpolate(tf.sums, tf.ssmooth, tf.ssmear, 60);
+            traced = trace_now();
+            const uint64_t now = audio_position(p);
+            post_run(&tf.post, bars->sums, tf.level, tf.trail);
+            tf.beat = rhythm_pulse(&bars->beat, now, p->sr);
+            tf.onset = rhythm_pulse(&bars->onset, now, p->sr);
+            trace_end(TRACE_SMOOTHING, traced);
         }
 
-        gl_draw_buffer(&rd, tf.ssmooth, tf.ssmear);
+        traced = trace_now();
+        for (int i = 0; i < worker.raw.features.count; i++) {
+            gl_set_feature(&rd, worker.raw.features.ex[i]->name, bars->features[i]);
+        }
+        gl_set_feature(&rd, "beat", tf.beat);
+        gl_set_feature(&rd, "onset", tf.onset);
+        gl_set_feature(&rd, "tempo", bars->bpm);
+        gl_draw_buffer(&rd, tf.level, tf.trail);
+        trace_end(TRACE_DRAW, traced);
+        traced = trace_now();
         SDL_GL_SwapWindow(win);
+        trace_end(TRACE_SWAP, traced);
+        rates.frames++;
+        trace_end(TRACE_FRAME, frame_start);
+        trace_poll();
+        audit_poll();
 
         const uint32_t duration = SDL_GetTicks64() - start;
-        const uint32_t delta = 1000 / 60;
+        const uint32_t delta = 1000 / FRAME_RATE;
 
         if (duration < delta) {
             SDL_Delay(delta - duration);
@@ -279,7 +346,16 @@ int main(int argc, char **argv)
 
     // Close before freeing params - if there is queued audio after free that would be be bad
     audio_end();
+    print_rates(&rates, &worker);
+    worker_stop(&worker);
     close_device();
+    if (recording) {
+        audio_record(NULL);
+        recorder_stop(&recorder);
+    }
+    trace_report();
+    trace_free();
+    audit_report();
 
     p = free_params(p);
     if (ents.list) {
@@ -353,6 +429,7 @@ static AParams *begin_audio_file(const Entry *e)
     if (e && e->is_audio_file) {
         AParams *p = read_file(e->fullpath);
         if ((p && p->valid) && dev_from_data(p)) {
+            audio_record_track(e->fullpath, p);
             return __begin_ok(p);
         } else {
             return __begin_bad(p);
@@ -368,6 +445,10 @@ static void *free_params(AParams *p)
             free(p->buffer);
         }
 
+        if (p->sample_buffer) {
+            free(p->sample_buffer);
+        }
+
         free(p);
     }
     return NULL;
@@ -413,10 +494,49 @@ static uint32_t _scount(const uint32_t remaining)
     return (BUFFER_SIZE < remaining) ? BUFFER_SIZE : remaining;
 }
 
-static void wipe(Transformed *tf, Raw *raw)
+static void wipe(Transformed *tf)
+{
+    memset(tf->level, 0, sizeof(tf->level));
+    memset(tf->trail, 0, sizeof(tf->trail));
+    post_reset(&tf->post);
+    tf->beat = 0.0f;
+    tf->onset = 0.0f;
+}
+
+// Render frames and analyses per second since the last report, with the
+// average time an analysis takes.
+static void print_rates(Rates *r, Worker *w)
 {
-    memset(tf, 0, sizeof(Transformed));
-    memset(raw, 0, sizeof(Raw));
+    const uint64_t now = SDL_GetPerformanceCounter();
+    const double seconds = (double)(now - r->start) / (double)SDL_GetPerformanceFrequency();
+    const uint64_t analyses = atomic_load(&w->analyses);
+    const uint64_t busy = atomic_load(&w->busy);
+    const uint64_t done = analyses - r->analyses;
+    if (seconds > 0.0) {
+        printf("RATES: render %.1f fps, analysis %.1f per second, %.0f us each\n", (double)r->frames / seconds,
+               (double)done / seconds, done ? (double)(busy - r->busy) / (double)done : 0.0);
+    }
+    r->start = now;
+    r->frames = 0;
+    r->analyses = analyses;
+    r->busy = busy;
+}
+
+// The worker lets go of the old track before it's freed and picks up the next
+// one once it's loaded.
+static AParams *change_track(Worker *w, Transformed *tf, Rates *rates, AParams *p, int *attempts,
+                             const Entry **current, const Entry *estart, const Entry *eend, const int dir)
+{
+    audio_end();
+    worker_attach(w, NULL, NULL);
+    if (p) {
+        print_rates(rates, w);
+    }
+    wipe(tf);
+    AParams *const next = find_queued(attempts, current, estart, eend, dir);
+    free_params(p);
+    worker_attach(w, next, next ? (*current)->fullpath : NULL);
+    return next;
 }
 
 static AParams *find_queued(int *attempts, const Entry **current, const Entry *const estart, const Entry *eend, const int dir)
@@ -0,0 +1,105 @@
+#include "multires.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void multires_free(MultiRes *m)
+{
+    for (int l = 0; l < m->levels; l++) {
+        ResLevel *const lv = &m->level[l];
+        lv->plan = fft_plan_destroy(lv->plan);
+        free(lv->window);
+        for (int c = 0; c < 2; c++) {
+            free(lv->buf[c]);
+            spectrum_free(&lv->spec[c]);
+        }
+    }
+    memset(m, 0, sizeof(MultiRes));
+}
+
+int multires_init(MultiRes *m, const size_t size, const WindowType type, const float beta)
+{
+    memset(m, 0, sizeof(MultiRes));
+    for (size_t n = size; n >= MULTIRES_MIN_SIZE && m->levels < MULTIRES_LEVELS; n >>= 1) {
+        ResLevel *const lv = &m->level[m->levels++];
+        lv->size = n;
+        lv->plan = fft_plan_create(n);
+        lv->window = fft_alloc(n, sizeof(float));
+        lv->buf[0] = fft_alloc(n, sizeof(float));
+        lv->buf[1] = fft_alloc(n, sizeof(float));
+        if (!lv->plan || !lv->window || !lv->buf[0] || !lv->buf[1]) {
+            printf("Could not allocate memory: %s\n", strerror(errno));
+            multires_free(m);
+            return 0;
+        }
+
+        if (!spectrum_init(&lv->spec[0], n / 2) || !spectrum_init(&lv->spec[1], n / 2)) {
+            multires_free(m);
+            return 0;
+        }
+
+        // Each level scaled by its own window gain so a sine reads the same
+        // level whichever FFT it lands in.
+        calculate_window(lv->window, n, type, beta);
+        lv->norm = power_norm(lv->window, n);
+    }
+    return 1;
+}
+
+// Bar k spans about f * (ratio - 1) Hz. It goes to the shortest level whose
+// bin spacing fits inside that, bars too narrow for any level stay on the
+// longest one.
+static void multires_rate(MultiRes *m, const int sr)
+{
+    const float ratio = bar_frequency(1) / bar_frequency(0);
+    int bar = DIVISOR;
+    for (int l = m->levels - 1; l >= 0; l--) {
+        ResLevel *const lv = &m->level[l];
+        const float spacing = (float)sr / (float)lv->size;
+        lv->last = bar;
+        while (bar > 0 && (l == 0 || bar_frequency(bar - 1) * (ratio - 1.0f) >= spacing)) {
+            bar--;
+        }
+        lv->first = bar;
+        barmap_build(&lv->map, sr, lv->size);
+    }
+    m->sr = sr;
+
+    for (int l = 0; l < m->levels; l++) {
+        const ResLevel *const lv = &m->level[l];
+        if (lv->first < lv->last) {
+            printf("Multires: %zu point FFT for %.0f - %.0f Hz (%.1f ms)\n", lv->size, bar_frequency(lv->first),
+                   bar_frequency(lv->last - 1), 1000.0f * lv->size / sr);
+        }
+    }
+}
+
+// a (and b in stereo) hold the newest m->level[0].size frames, oldest first.
+void multires_bars(MultiRes *m, const int sr, const float *a, const float *b, float *sums_a, float *sums_b)
+{
+    if (m->sr != sr) {
+        multires_rate(m, sr);
+    }
+
+    const size_t size = m->level[0].size;
+    for (int l = 0; l < m->levels; l++) {
+        ResLevel *const lv = &m->level[l];
+        if (lv->first >= lv->last) {
+            continue;
+        }
+
+        const size_t offset = size - lv->size;
+        memcpy(lv->buf[0], a + offset, lv->size * sizeof(float));
+        wfunc(lv->buf[0], lv->window, (int)lv->size);
+        if (b) {
+            memcpy(lv->buf[1], b + offset, lv->size * sizeof(float));
+            wfunc(lv->buf[1], lv->window, (int)lv->size);
+            stereo_fft_split(lv->plan, lv->buf[0], lv->buf[1], &lv->spec[0], &lv->spec[1]);
+            section_power_bars(&lv->map, &lv->spec[1], lv->norm, lv->first, lv->last, sums_b);
+        } else {
+            real_fft_split(lv->plan, lv->buf[0], &lv->spec[0]);
+        }
+        section_power_bars(&lv->map, &lv->spec[0], lv->norm, lv->first, lv->last, sums_a);
+    }
+}
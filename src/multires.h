@@ -0,0 +1,40 @@
+#ifndef MULTIRES_H
+#define MULTIRES_H
+
+#include "fft.h"
+#include "rndrdef.h"
+
+// Levels halve the FFT size from the configured one down to this.
+#define MULTIRES_MIN_SIZE 256
+#define MULTIRES_LEVELS 8
+
+// One FFT size and the bars it's responsible for.
+typedef struct
+{
+    size_t size;
+    FFTPlan *plan;
+    float *window;
+    float *buf[2];
+    Spectrum spec[2];
+    // power_norm of this level's window.
+    float norm;
+    BarMap map;
+    int first;
+    int last;
+} ResLevel;
+
+// Every bar is read from the shortest FFT whose bins are still narrower than
+// the bar, so the treble follows transients with a few ms of window while the
+// bass keeps the full length. All windows end at the newest frame.
+typedef struct
+{
+    int sr;
+    int levels;
+    ResLevel level[MULTIRES_LEVELS];
+} MultiRes;
+
+int multires_init(MultiRes *m, size_t size, WindowType type, float beta);
+void multires_free(MultiRes *m);
+void multires_bars(MultiRes *m, int sr, const float *a, const float *b, float *sums_a, float *sums_b);
+
+#endif
@@ -0,0 +1,269 @@
+#include "post.h"
+#include "fft.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+static const struct
+{
+    PostStage stage;
+    const char *name;
+} stage_names[] = {
+    { POST_GAIN, "gain" },
+    { POST_AWEIGHT, "a-weight" },
+    { POST_DB, "db" },
+    { POST_ENVELOPE, "envelope" },
+    { POST_PEAK, "peak" },
+    { POST_SMEAR, "smear" },
+};
+
+static const size_t stagec = sizeof(stage_names) / sizeof(stage_names[0]);
+
+// The old fixed smoothing, 8 / 60 of the way per frame at 60 fps, is about
+// a 115 ms time constant.
+void post_defaults(PostConfig *cfg)
+{
+    const PostStage stages[] = { POST_GAIN, POST_DB, POST_ENVELOPE, POST_SMEAR };
+    cfg->count = sizeof(stages) / sizeof(stages[0]);
+    memcpy(cfg->stages, stages, sizeof(stages));
+    cfg->gain = 0.0f;
+    cfg->floor = -70.0f;
+    cfg->ceil = -10.0f;
+    cfg->attack = 115.0f;
+    cfg->release = 115.0f;
+    cfg->hold = 500.0f;
+    cfg->fall = 1.0f;
+    cfg->smear = 115.0f;
+}
+
+const char *post_stage_name(const PostStage stage)
+{
+    for (size_t i = 0; i < stagec; i++) {
+        if (stage_names[i].stage == stage) {
+            return stage_names[i].name;
+        }
+    }
+    return "unknown";
+}
+
+static int is_trail(const PostStage stage)
+{
+    return stage == POST_PEAK || stage == POST_SMEAR;
+}
+
+// Comma separated stage names in the order they run. Each stage can appear
+// once, gain and a-weight scale power so they go before db, and the trail
+// stages have to come last, they only see the finished level.
+int post_parse_stages(PostConfig *cfg, const char *list)
+{
+    char buf[256];
+    if (strlen(list) >= sizeof(buf)) {
+        printf("post stage list is too long\n");
+        return 0;
+    }
+    strcpy(buf, list);
+
+    PostStage stages[POST_MAX_STAGES];
+    int count = 0, trail = 0, db = 0;
+    for (char *name = strtok(buf, ", "); name; name = strtok(NULL, ", ")) {
+        size_t i = 0;
+        while (i < stagec && strcmp(stage_names[i].name, name) != 0) {
+            i++;
+        }
+        if (i == stagec) {
+            printf("Unknown post stage: %s\n", name);
+            return 0;
+        }
+
+        const PostStage stage = stage_names[i].stage;
+        for (int j = 0; j < count; j++) {
+            if (stages[j] == stage) {
+                printf("post stage %s is listed twice\n", name);
+                return 0;
+            }
+        }
+        if (trail && !is_trail(stage)) {
+            printf("post stage %s has to come before peak and smear\n", name);
+            return 0;
+        }
+        if (db && (stage == POST_GAIN || stage == POST_AWEIGHT)) {
+            printf("post stage %s has to come before db\n", name);
+            return 0;
+        }
+        trail |= is_trail(stage);
+        db |= stage == POST_DB;
+        stages[count++] = stage;
+    }
+
+    memcpy(cfg->stages, stages, count * sizeof(PostStage));
+    cfg->count = count;
+    return 1;
+}
+
+// IEC 61672 A-weighting in dB, 0 at 1 kHz.
+static double a_weight(const double f)
+{
+    const double f2 = f * f;
+    const double num = 12194.0 * 12194.0 * f2 * f2;
+    const double den = (f2 + 20.6 * 20.6) * sqrt((f2 + 107.7 * 107.7) * (f2 + 737.9 * 737.9)) * (f2 + 12194.0 * 12194.0);
+    return 20.0 * log10(num / den) + 2.0;
+}
+
+// One pole smoothing that gets 1 - 1 / e of the way there in ms.
+static float time_coeff(const float ms, const int rate)
+{
+    return (ms > 0.0f) ? (float)(1.0 - exp(-1000.0 / (ms * rate))) : 1.0f;
+}
+
+// Needs gen_bins to have run for the A-weighting.
+void post_init(PostChain *p, const PostConfig *cfg, const int rate)
+{
+    memset(p, 0, sizeof(PostChain));
+
+    // Everything is power until the dB stage, so gains are 10^(dB / 10).
+    int scaled = 0;
+    for (int b = 0; b < DIVISOR; b++) {
+        p->gain[b] = 1.0f;
+    }
+    for (int s = 0; s < cfg->count; s++) {
+        const PostStage stage = cfg->stages[s];
+        if (stage == POST_GAIN || stage == POST_AWEIGHT) {
+            for (int b = 0; b < DIVISOR; b++) {
+                const double db = (stage == POST_GAIN) ? cfg->gain : a_weight(bar_frequency(b));
+                p->gain[b] *= (float)pow(10.0, db / 10.0);
+            }
+            if (!scaled) {
+                p->level[p->levels++] = POST_GAIN;
+            }
+            scaled = 1;
+        } else if (is_trail(stage)) {
+            p->trail[p->trails++] = stage;
+        } else {
+            p->level[p->levels++] = stage;
+        }
+    }
+
+    p->base = cfg->floor;
+    p->span = 1.0f / (cfg->ceil - cfg->floor);
+    p->attack = time_coeff(cfg->attack, rate);
+    p->release = time_coeff(cfg->release, rate);
+    p->hold = cfg->hold * rate / 1000.0f;
+    p->fall = cfg->fall / rate;
+    p->smear = time_coeff(cfg->smear, rate);
+}
+
+void post_reset(PostChain *p)
+{
+    memset(p->env, 0, sizeof(p->env));
+    memset(p->peak, 0, sizeof(p->peak));
+    memset(p->held, 0, sizeof(p->held));
+    memset(p->smeared, 0, sizeof(p->smeared));
+}
+
+// The stages, each on one block. Fixed trip counts so every loop is a
+// handful of vector instructions.
+static inline void stage_gain(float *restrict v, const float *restrict gain)
+{
+    for (int l = 0; l < POST_LANES; l++) {
+        v[l] *= gain[l];
+    }
+}
+
+// 10 log10(p) = 10 log10(2) log2(p), 1e-20 keeps silence out of log(0).
+static inline void stage_db(float *restrict v, const float base, const float span)
+{
+    const float db = 3.01029996f;
+    for (int l = 0; l < POST_LANES; l++) {
+        const float p = (v[l] > 1e-20f) ? v[l] : 1e-20f;
+        const float h = (db * fast_log2f(p) - base) * span;
+        v[l] = (h < 0.0f) ? 0.0f : (h > 1.0f) ? 1.0f : h;
+    }
+}
+
+// Below this the envelopes are silence. Left alone they decay on into
+// denormals, which makes the whole chain over twice as slow on silent bars.
+static const float POST_FLOOR = 1e-12f;
+
+static inline void stage_envelope(float *restrict v, float *restrict env, const float attack, const float release)
+{
+    for (int l = 0; l < POST_LANES; l++) {
+        const float k = (v[l] > env[l]) ? attack : release;
+        const float e = env[l] + (v[l] - env[l]) * k;
+        env[l] = (e > POST_FLOOR) ? e : 0.0f;
+        v[l] = env[l];
+    }
+}
+
+// Jumps to anything higher, holds it for hold frames, then falls at a fixed
+// rate but never below the level.
+static inline void stage_peak(float *restrict t, float *restrict peak, float *restrict held, const float hold,
+                              const float fall)
+{
+    for (int l = 0; l < POST_LANES; l++) {
+        const int up = t[l] >= peak[l];
+        const float down = (peak[l] - fall > t[l]) ? peak[l] - fall : t[l];
+        peak[l] = up ? t[l] : (held[l] > 0.0f) ? peak[l] : down;
+        held[l] = up ? hold : (held[l] > 1.0f) ? held[l] - 1.0f : 0.0f;
+        t[l] = peak[l];
+    }
+}
+
+static inline void stage_smear(float *restrict t, float *restrict smeared, const float k)
+{
+    for (int l = 0; l < POST_LANES; l++) {
+        const float m = smeared[l] + (t[l] - smeared[l]) * k;
+        smeared[l] = (m > POST_FLOOR) ? m : 0.0f;
+        t[l] = smeared[l];
+    }
+}
+
+// power is the calibrated bar power from the analysis, a full scale sine is
+// 1. Runs once per displayed frame whether or not there's a new analysis, the
+// envelopes need the steady tick. level and trail come out clamped to 0 - 1.
+SPECTRUM_CLONES void post_run(PostChain *p, const float *power, float *level, float *trail)
+{
+    for (int b = 0; b < DIVISOR; b += POST_LANES) {
+        float v[POST_LANES], t[POST_LANES];
+        memcpy(v, &power[b], sizeof(v));
+
+        for (int s = 0; s < p->levels; s++) {
+            switch (p->level[s]) {
+            case POST_GAIN:
+            {
+                stage_gain(v, &p->gain[b]);
+            } break;
+            case POST_DB:
+            {
+                stage_db(v, p->base, p->span);
+            } break;
+            case POST_ENVELOPE:
+            {
+                stage_envelope(v, &p->env[b], p->attack, p->release);
+            } break;
+            default:
+                break;
+            }
+        }
+
+        memcpy(t, v, sizeof(t));
+        for (int s = 0; s < p->trails; s++) {
+            switch (p->trail[s]) {
+            case POST_PEAK:
+            {
+                stage_peak(t, &p->peak[b], &p->held[b], p->hold, p->fall);
+            } break;
+            case POST_SMEAR:
+            {
+                stage_smear(t, &p->smeared[b], p->smear);
+            } break;
+            default:
+                break;
+            }
+        }
+
+        for (int l = 0; l < POST_LANES; l++) {
+            level[b + l] = (v[l] < 0.0f) ? 0.0f : (v[l] > 1.0f) ? 1.0f : v[l];
+            trail[b + l] = (t[l] < 0.0f) ? 0.0f : (t[l] > 1.0f) ? 1.0f : t[l];
+        }
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef POST_H
+#define POST_H
+
+#include "rndrdef.h"
+
+#define POST_MAX_STAGES 8
+// Bars handled per step of the fused loop, one AVX-512 register of floats.
+#define POST_LANES 16
+
+#if DIVISOR % POST_LANES != 0
+#error "DIVISOR has to be a multiple of POST_LANES"
+#endif
+
+// Everything between the analysis and the renderer. The level stages shape
+// the bar itself, the trail stages (peak, smear) build the second layer drawn
+// above it out of the finished level.
+typedef enum
+{
+    POST_GAIN,
+    POST_AWEIGHT,
+    POST_DB,
+    POST_ENVELOPE,
+    POST_PEAK,
+    POST_SMEAR,
+} PostStage;
+
+// The chain as configured, times are in ms.
+typedef struct
+{
+    PostStage stages[POST_MAX_STAGES];
+    int count;
+    float gain;
+    float floor;
+    float ceil;
+    float attack;
+    float release;
+    float hold;
+    // Bar heights per second.
+    float fall;
+    float smear;
+} PostConfig;
+
+// The chain compiled for one frame rate. Gain and A-weighting fold into one
+// per bar multiply, times become per frame coefficients. post_run makes a
+// single pass over the bars, every stage runs on a block of POST_LANES bars
+// while it's still in registers.
+typedef struct
+{
+    PostStage level[POST_MAX_STAGES];
+    PostStage trail[POST_MAX_STAGES];
+    int levels;
+    int trails;
+    float gain[DIVISOR];
+    float base;
+    float span;
+    float attack;
+    float release;
+    float hold;
+    float fall;
+    float smear;
+    // Per bar state.
+    float env[DIVISOR];
+    float peak[DIVISOR];
+    float held[DIVISOR];
+    float smeared[DIVISOR];
+} PostChain;
+
+void post_defaults(PostConfig *cfg);
+int post_parse_stages(PostConfig *cfg, const char *list);
+const char *post_stage_name(PostStage stage);
+void post_init(PostChain *p, const PostConfig *cfg, int rate);
+void post_reset(PostChain *p);
+void post_run(PostChain *p, const float *power, float *level, float *trail);
+
+#endif
@@ -0,0 +1,489 @@
+#include "record.h"
+#include "post.h"
+#include "rndrdef.h"
+#include "trace.h"
+#include "worker.h"
+#include <SDL2/SDL.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char RECORD_MAGIC[8] = { 'R', 'T', 'A', 'V', 'R', 'E', 'C', '\0' };
+
+static uint64_t elapsed_ns(const uint64_t since)
+{
+    const uint64_t ticks = SDL_GetPerformanceCounter() - since;
+    const uint64_t freq = SDL_GetPerformanceFrequency();
+    return ticks / freq * 1000000000ull + ticks % freq * 1000000000ull / freq;
+}
+
+// Drains the ring into the file, sleeps when there's nothing to write.
+static int recorder_main(void *data)
+{
+    Recorder *const r = (Recorder *)data;
+    for (;;) {
+        const int run = atomic_load_explicit(&r->run, memory_order_acquire);
+        const unsigned head = atomic_load_explicit(&r->head, memory_order_acquire);
+        unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        if (tail == head) {
+            if (!run) {
+                break;
+            }
+            SDL_Delay(10);
+            continue;
+        }
+
+        for (; tail != head; tail++) {
+            const RecordSlot *const slot = &r->slots[tail % RECORD_SLOTS];
+            const size_t bytes = (slot->entry.kind == RECORD_TRACK) ? slot->entry.count
+                                                                    : slot->entry.count * sizeof(float);
+            if (r->file && (fwrite(&slot->entry, sizeof(RecordEntry), 1, r->file) != 1 ||
+                            fwrite(slot->samples, 1, bytes, r->file) != bytes)) {
+                printf("Could not write the recording: %s\n", strerror(errno));
+                fclose(r->file);
+                r->file = NULL;
+            }
+            r->written++;
+            atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+        }
+    }
+    return 0;
+}
+
+int recorder_start(Recorder *r, const Config *cfg, const char *path)
+{
+    memset(r, 0, sizeof(Recorder));
+    atomic_init(&r->head, 0u);
+    atomic_init(&r->tail, 0u);
+    atomic_init(&r->dropped, 0u);
+    atomic_init(&r->run, 1);
+    r->start = SDL_GetPerformanceCounter();
+
+    if (!(r->slots = calloc(RECORD_SLOTS, sizeof(RecordSlot)))) {
+        printf("Could not allocate memory: %s\n", strerror(errno));
+        return 0;
+    }
+    // The callback fills these, fault them in now rather than there.
+    audio_prefault(r->slots, RECORD_SLOTS * sizeof(RecordSlot));
+    if (!(r->file = fopen(path, "wb"))) {
+        printf("Could not open %s: %s\n", path, strerror(errno));
+        free(r->slots);
+        return 0;
+    }
+
+    RecordHeader head = {
+        .version = RECORD_VERSION,
+        .channels = AUDIO_CHANNELS,
+        .fft_size = (uint32_t)cfg->fft_size,
+        .hop = cfg->hop,
+    };
+    memcpy(head.magic, RECORD_MAGIC, sizeof(head.magic));
+    if (fwrite(&head, sizeof(head), 1, r->file) != 1) {
+        printf("Could not write %s: %s\n", path, strerror(errno));
+        fclose(r->file);
+        free(r->slots);
+        return 0;
+    }
+
+    if (!(r->thread = SDL_CreateThread(recorder_main, "recorder", r))) {
+        printf("Could not start the recorder thread: %s\n", SDL_GetError());
+        fclose(r->file);
+        free(r->slots);
+        return 0;
+    }
+    printf("Recording the audio callback to %s\n", path);
+    return 1;
+}
+
+// Takes the next free slot, NULL if the writer is a whole ring behind.
+static RecordSlot *recorder_claim(Recorder *r)
+{
+    const unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&r->tail, memory_order_acquire) >= RECORD_SLOTS) {
+        atomic_fetch_add_explicit(&r->dropped, 1u, memory_order_relaxed);
+        return NULL;
+    }
+    return &r->slots[head % RECORD_SLOTS];
+}
+
+static void recorder_publish(Recorder *r)
+{
+    atomic_fetch_add_explicit(&r->head, 1u, memory_order_release);
+}
+
+// From main, with the device opened for the track but not started yet.
+void recorder_track(Recorder *r, const char *path, const int sr, const uint32_t latency)
+{
+    RecordSlot *const slot = recorder_claim(r);
+    if (!slot) {
+        return;
+    }
+    const size_t len = strlen(path);
+    slot->entry = (RecordEntry){ RECORD_TRACK, (uint32_t)((len < PATH_MAX) ? len : PATH_MAX), elapsed_ns(r->start), 0,
+                                 (uint32_t)sr, latency };
+    memcpy(slot->samples, path, slot->entry.count);
+    recorder_publish(r);
+}
+
+// From the callback: a copy and a counter bump, never a wait. Devices that
+// ask for more than a slot holds get the chunk split.
+void recorder_chunk(Recorder *r, uint64_t pushed, const float *src, uint32_t samples)
+{
+    const uint64_t now = elapsed_ns(r->start);
+    while (samples > 0) {
+        RecordSlot *const slot = recorder_claim(r);
+        if (!slot) {
+            return;
+        }
+        const uint32_t count = (samples < BUFFER_SIZE) ? samples : BUFFER_SIZE;
+        slot->entry = (RecordEntry){ RECORD_CHUNK, count, now, pushed, 0, 0 };
+        memcpy(slot->samples, src, count * sizeof(float));
+        recorder_publish(r);
+        src += count;
+        pushed += count;
+        samples -= count;
+    }
+}
+
+// After the device is closed, so nothing else comes in.
+void recorder_stop(Recorder *r)
+{
+    if (r->thread) {
+        atomic_store_explicit(&r->run, 0, memory_order_release);
+        SDL_WaitThread(r->thread, NULL);
+        r->thread = NULL;
+    }
+    if (r->file && fclose(r->file) == EOF) {
+        printf("Failed to close file: %s\n", strerror(errno));
+    }
+    r->file = NULL;
+
+    printf("Recorded %llu entries, %u chunks dropped with the writer behind\n", (unsigned long long)r->written,
+           atomic_load(&r->dropped));
+    free(r->slots);
+    r->slots = NULL;
+}
+
+typedef struct
+{
+    uint64_t time_ns;
+    uint64_t pushed;
+    uint32_t count;
+    // Samples into the track's audio.
+    size_t offset;
+} ReplayChunk;
+
+// A recorded track: every chunk it pushed back to back makes up its audio.
+typedef struct
+{
+    char path[PATH_MAX];
+    int sr;
+    uint32_t latency;
+    ReplayChunk *chunks;
+    size_t chunkc;
+    size_t chunk_cap;
+    float *audio;
+    size_t samples;
+    size_t audio_cap;
+} ReplayTrack;
+
+typedef struct
+{
+    RecordHeader head;
+    ReplayTrack *tracks;
+    size_t trackc;
+} Replay;
+
+static void replay_free(Replay *r)
+{
+    for (size_t i = 0; i < r->trackc; i++) {
+        free(r->tracks[i].chunks);
+        free(r->tracks[i].audio);
+    }
+    free(r->tracks);
+    memset(r, 0, sizeof(Replay));
+}
+
+// Doubles *cap until it holds need, so a long track isn't copied per chunk.
+static int replay_grow(void **buf, size_t *cap, const size_t need, const size_t size)
+{
+    if (need <= *cap) {
+        return 1;
+    }
+    size_t next = *cap ? *cap : 256;
+    while (next < need) {
+        next *= 2;
+    }
+    void *tmp = realloc(*buf, next * size);
+    if (!tmp) {
+        printf("Could not allocate memory: %s\n", strerror(errno));
+        return 0;
+    }
+    *buf = tmp;
+    *cap = next;
+    return 1;
+}
+
+static int replay_chunk(ReplayTrack *t, const RecordEntry *e, FILE *f)
+{
+    if (!replay_grow((void **)&t->chunks, &t->chunk_cap, t->chunkc + 1, sizeof(ReplayChunk)) ||
+        !replay_grow((void **)&t->audio, &t->audio_cap, t->samples + e->count, sizeof(float))) {
+        return 0;
+    }
+
+    if (fread(t->audio + t->samples, sizeof(float), e->count, f) != e->count) {
+        printf("Recording ends partway through a chunk\n");
+        return 0;
+    }
+    t->chunks[t->chunkc++] = (ReplayChunk){ e->time_ns, e->pushed, e->count, t->samples };
+    t->samples += e->count;
+    return 1;
+}
+
+static int replay_load(Replay *r, const char *path)
+{
+    memset(r, 0, sizeof(Replay));
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        printf("Could not open %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    if (fread(&r->head, sizeof(RecordHeader), 1, f) != 1 || memcmp(r->head.magic, RECORD_MAGIC, 8) != 0 ||
+        r->head.version != RECORD_VERSION || r->head.channels != AUDIO_CHANNELS) {
+        printf("%s isn't a recording this version can play\n", path);
+        fclose(f);
+        return 0;
+    }
+
+    RecordEntry e;
+    int ok = 1;
+    while (ok && fread(&e, sizeof(e), 1, f) == 1) {
+        if (e.kind == RECORD_TRACK) {
+            if (e.count >= PATH_MAX) {
+                printf("Recording is broken\n");
+                ok = 0;
+                break;
+            }
+            ReplayTrack *tracks = realloc(r->tracks, (r->trackc + 1) * sizeof(ReplayTrack));
+            if (!tracks) {
+                printf("Could not allocate memory: %s\n", strerror(errno));
+                ok = 0;
+                break;
+            }
+            r->tracks = tracks;
+            ReplayTrack *const t = &r->tracks[r->trackc++];
+            memset(t, 0, sizeof(ReplayTrack));
+            t->sr = (int)e.sr;
+            t->latency = e.latency;
+            ok = fread(t->path, 1, e.count, f) == e.count;
+        } else if (e.kind == RECORD_CHUNK && r->trackc > 0) {
+            ok = replay_chunk(&r->tracks[r->trackc - 1], &e, f);
+        } else {
+            printf("Recording is broken\n");
+            ok = 0;
+        }
+    }
+    fclose(f);
+    if (!ok) {
+        replay_free(r);
+    }
+    return ok;
+}
+
+// What the render loop would do with each frame short of drawing it, and a
+// hash of every analysis the worker published so two builds can be checked
+// for the same output.
+typedef struct
+{
+    PostChain post;
+    float level[DIVISOR];
+    float trail[DIVISOR];
+    uint64_t seq;
+    uint64_t hash;
+    uint64_t frames;
+} ReplayView;
+
+static void replay_hash(uint64_t *hash, const void *data, const size_t len)
+{
+    const unsigned char *const b = (const unsigned char *)data;
+    for (size_t i = 0; i < len; i++) {
+        *hash = (*hash ^ b[i]) * 1099511628211ull;
+    }
+}
+
+static void replay_frame(ReplayView *v, Worker *w)
+{
+    const BarFrame *const bars = worker_latest(w);
+    if (bars->seq != v->seq) {
+        v->seq = bars->seq;
+        replay_hash(&v->hash, &bars->pos, sizeof(bars->pos));
+        replay_hash(&v->hash, bars->sums, sizeof(bars->sums));
+        replay_hash(&v->hash, bars->features, sizeof(float) * (size_t)w->raw.features.count);
+    }
+    const uint64_t t = trace_now();
+    post_run(&v->post, bars->sums, v->level, v->trail);
+    trace_end(TRACE_SMOOTHING, t);
+    v->frames++;
+    trace_poll();
+}
+
+// The device's callback at recorded speed: each call pushes every chunk that
+// was pushed by the same point of the recording, the stream itself is
+// silence.
+typedef struct
+{
+    AParams *p;
+    const ReplayTrack *track;
+    uint64_t start;
+    atomic_size_t next;
+} ReplayFeed;
+
+static void replay_callback(void *user, unsigned char *stream, int len)
+{
+    ReplayFeed *const feed = (ReplayFeed *)user;
+    memset(stream, 0, (size_t)len);
+    const ReplayTrack *const t = feed->track;
+    const uint64_t now = elapsed_ns(feed->start);
+    size_t next = atomic_load_explicit(&feed->next, memory_order_relaxed);
+    for (; next < t->chunkc && t->chunks[next].time_ns - t->chunks[0].time_ns <= now; next++) {
+        const ReplayChunk *const c = &t->chunks[next];
+        fft_push(feed->p, t->audio + c->offset, c->count);
+        feed->p->position = (uint32_t)(c->offset + c->count);
+    }
+    atomic_store_explicit(&feed->next, next, memory_order_release);
+}
+
+static int replay_recorded(Worker *w, AParams *p, const ReplayTrack *t, ReplayView *v)
+{
+    ReplayFeed feed = { p, t, 0, 0 };
+    atomic_init(&feed.next, 0);
+    if (!dev_from_callback(p, replay_callback, &feed)) {
+        return 0;
+    }
+    worker_attach(w, p, NULL);
+    feed.start = SDL_GetPerformanceCounter();
+    audio_start();
+    while (atomic_load_explicit(&feed.next, memory_order_acquire) < t->chunkc) {
+        const uint32_t start = SDL_GetTicks64();
+        replay_frame(v, w);
+        const uint32_t duration = SDL_GetTicks64() - start;
+        if (duration < 1000 / FRAME_RATE) {
+            SDL_Delay(1000 / FRAME_RATE - duration);
+        }
+    }
+    audio_end();
+    worker_attach(w, NULL, NULL);
+    close_device();
+    return 1;
+}
+
+// No device and no sleeping: every chunk is pushed, the worker gets the one
+// round it would have had between two callbacks, and the render frames that
+// fell in between run on what it published.
+static int replay_fast(Worker *w, AParams *p, const ReplayTrack *t, ReplayView *v)
+{
+    const uint64_t frame_ns = 1000000000ull / FRAME_RATE;
+    uint64_t next_frame = 0;
+    worker_attach(w, p, NULL);
+    for (size_t i = 0; i < t->chunkc; i++) {
+        const ReplayChunk *const c = &t->chunks[i];
+        fft_push(p, t->audio + c->offset, c->count);
+        p->position = (uint32_t)(c->offset + c->count);
+        worker_poll(w);
+        for (; next_frame <= c->time_ns - t->chunks[0].time_ns; next_frame += frame_ns) {
+            replay_frame(v, w);
+        }
+    }
+    worker_attach(w, NULL, NULL);
+    worker_poll(w);
+    return 1;
+}
+
+// Headless --replay: the recorded chunks go through the worker and the post
+// chain in place of the audio device, either when they were pushed (on SDL's
+// dummy audio driver unless SDL_AUDIODRIVER says otherwise) or as fast as
+// they can be taken.
+int replay_run(const Config *cfg)
+{
+    Replay r;
+    if (!replay_load(&r, cfg->replay)) {
+        return 0;
+    }
+    if (r.head.fft_size != cfg->fft_size || r.head.hop != cfg->hop) {
+        printf("Recorded with fft-size %u and hop %u, replaying with %zu and %u\n", r.head.fft_size, r.head.hop,
+               cfg->fft_size, cfg->hop);
+    }
+
+    // A cached spectrogram would be looked up instead of analysed.
+    Config rc = *cfg;
+    rc.spectrogram = 0;
+
+    if (!cfg->replay_fast) {
+        SDL_setenv("SDL_AUDIODRIVER", "dummy", 0);
+        if (SDL_Init(SDL_INIT_AUDIO) < 0) {
+            printf("Could not initialize SDL2: %s\n", SDL_GetError());
+            replay_free(&r);
+            return 0;
+        }
+    }
+
+    Worker w;
+    if (!(cfg->replay_fast ? worker_init(&w, &rc) : worker_start(&w, &rc))) {
+        replay_free(&r);
+        SDL_Quit();
+        return 0;
+    }
+
+    const uint64_t freq = SDL_GetPerformanceFrequency();
+    int ok = 1;
+    for (size_t i = 0; ok && i < r.trackc; i++) {
+        const ReplayTrack *const t = &r.tracks[i];
+        AParams p = { 0 };
+        p.valid = 1;
+        p.buffer = t->audio;
+        p.len = (uint32_t)t->samples;
+        p.samples = t->samples;
+        p.bytes = t->samples * sizeof(float);
+        p.channels = AUDIO_CHANNELS;
+        p.sr = t->sr;
+        p.gain = 1.0f;
+        p.history = audio_history();
+        if (t->chunkc == 0) {
+            printf("[%zu/%zu] %s: skipped, no chunks were recorded\n", i + 1, r.trackc, t->path);
+            continue;
+        }
+        if (!(p.sample_buffer = calloc(p.history, sizeof(float)))) {
+            printf("[%zu/%zu] %s: skipped, could not allocate memory: %s\n", i + 1, r.trackc, t->path,
+                   strerror(errno));
+            continue;
+        }
+
+        ReplayView v = { .hash = 14695981039346656037ull };
+        post_init(&v.post, &cfg->post, FRAME_RATE);
+        const uint64_t analyses = atomic_load(&w.analyses);
+        const uint64_t busy = atomic_load(&w.busy);
+        audio_replay(1, t->latency);
+        const uint64_t started = SDL_GetPerformanceCounter();
+        ok = cfg->replay_fast ? replay_fast(&w, &p, t, &v) : replay_recorded(&w, &p, t, &v);
+        const double wall = (double)(SDL_GetPerformanceCounter() - started) / freq;
+        audio_replay(0, 0);
+
+        const double seconds = (double)t->samples / AUDIO_CHANNELS / t->sr;
+        const uint64_t n = atomic_load(&w.analyses) - analyses;
+        printf("[%zu/%zu] %s: %zu chunks, %.1f s of audio in %.2f s (%.0fx), %llu analyses at %.1f us, %llu frames, "
+               "output %016llx\n",
+               i + 1, r.trackc, t->path, t->chunkc, seconds, wall, (wall > 0.0) ? seconds / wall : 0.0,
+               (unsigned long long)n, n ? (double)(atomic_load(&w.busy) - busy) / n : 0.0,
+               (unsigned long long)v.frames, (unsigned long long)v.hash);
+        free(p.sample_buffer);
+    }
+
+    worker_stop(&w);
+    trace_report();
+    replay_free(&r);
+    if (!cfg->replay_fast) {
+        SDL_Quit();
+    }
+    return ok;
+}
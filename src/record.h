@@ -0,0 +1,77 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include "audio.h"
+#include "config.h"
+#include <SDL2/SDL_thread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define RECORD_VERSION 1
+// Chunks the callback can get ahead of the writer by, about 1.5 s of audio
+// at the default device size.
+#define RECORD_SLOTS 64
+
+typedef enum
+{
+    RECORD_TRACK,
+    RECORD_CHUNK,
+} RecordKind;
+
+// --record files start with this, then entries until the end of the file.
+// A track entry is followed by count bytes of path, a chunk entry by count
+// floats of interleaved audio exactly as the callback pushed them. time_ns
+// counts from the start of the recording, pushed is the stream position in
+// samples before the chunk.
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t channels;
+    uint32_t fft_size;
+    uint32_t hop;
+} RecordHeader;
+
+typedef struct
+{
+    uint32_t kind;
+    uint32_t count;
+    uint64_t time_ns;
+    uint64_t pushed;
+    uint32_t sr;
+    // Samples the device held back, the analysis runs this far behind.
+    uint32_t latency;
+} RecordEntry;
+
+typedef struct
+{
+    RecordEntry entry;
+    float samples[BUFFER_SIZE];
+} RecordSlot;
+
+// The callback is the only writer of chunks and the thread the only reader.
+// Tracks are written from main while the device is paused, so there is only
+// ever one producer at a time. A full ring drops the chunk rather than make
+// the callback wait.
+struct Recorder
+{
+    FILE *file;
+    RecordSlot *slots;
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_uint dropped;
+    atomic_int run;
+    SDL_Thread *thread;
+    uint64_t start;
+    uint64_t written;
+};
+
+int recorder_start(Recorder *r, const Config *cfg, const char *path);
+void recorder_track(Recorder *r, const char *path, int sr, uint32_t latency);
+void recorder_chunk(Recorder *r, uint64_t pushed, const float *src, uint32_t samples);
+void recorder_stop(Recorder *r);
+
+int replay_run(const Config *cfg);
+
+#endif
@@ -123,6 +123,17 @@ static void light_at(unsigned int sid, const float xpos, const float ypos,
     glUniform3f(vploc, (float)RENDER_WIDTH / 2, (float)RENDER_HEIGHT / 2, 10.0);
 }
 
+// Analysis features go to the shaders as feature_<name>. Shaders that don't
+// use one just don't have the uniform, GL ignores the -1 location.
+void gl_set_feature(const Renderer_Data *rd, const char *name,
+                    const float value)
+{
+    char uniform[64];
+    snprintf(uniform, sizeof(uniform), "feature_%s", name);
+    gl_prog_use(rd->shader_program_id);
+    glUniform1f(glGetUniformLocation(rd->shader_program_id, uniform), value);
+}
+
 static void gl_uniform_and_draw(const unsigned int sid, const MatObj *const mo,
                                 const MatModel *const mm,
                                 const unsigned int VAO)
@@ -14,6 +14,7 @@ typedef struct
 void gl_clear_canvas(void);
 void gl_draw_buffer(Renderer_Data *rd, const float *smthframes,
                     const float *smrframes);
+void gl_set_feature(const Renderer_Data *rd, const char *name, float value);
 void sdl_gl_set_flags(void);
 void gl_viewport_update(SDL_Window *w, int *ww, int *wh);
 int check_link_state(const unsigned int *program);
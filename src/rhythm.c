@@ -0,0 +1,212 @@
+#include "rhythm.h"
+#include "fft.h"
+#include <math.h>
+#include <string.h>
+
+// Mean rise in log2 power per bar (x3 for dB) that never counts as an onset,
+// keeps hiss and silence from triggering.
+static const float FLUX_FLOOR = 0.05f;
+// Powers below -90 dB are all the same silence.
+static const float POWER_FLOOR = 1e-9f;
+static const float STATS_SECONDS = 0.5f;
+static const float TEMPO_SECONDS = 8.0f;
+static const float REFRACTORY_SECONDS = 0.06f;
+static const float PULSE_SECONDS = 0.12f;
+// Lags are weighted by a log gaussian an octave wide around this, which
+// settles most of the half and double tempo ambiguity.
+static const float PREFERRED_BPM = 120.0f;
+// The best lag has to stand this far above the average to count as a tempo.
+static const float TEMPO_CLARITY = 1.5f;
+
+void rhythm_init(Rhythm *r, const float threshold)
+{
+    memset(r, 0, sizeof(Rhythm));
+    r->threshold = threshold;
+}
+
+// Forgets the song but keeps the settings, the rates are rebuilt on the next
+// update.
+void rhythm_reset(Rhythm *r) { rhythm_init(r, r->threshold); }
+
+static void rhythm_rate(Rhythm *r, const int sr, const uint32_t hop)
+{
+    rhythm_reset(r);
+    r->sr = sr;
+    r->hop = hop;
+
+    const float hop_seconds = (float)hop / (float)sr;
+    r->follow = 1.0f - expf(-hop_seconds / STATS_SECONDS);
+    r->decay = expf(-hop_seconds / TEMPO_SECONDS);
+    r->refractory = (uint32_t)ceilf(REFRACTORY_SECONDS / hop_seconds);
+    r->refractory = (r->refractory > 0) ? r->refractory : 1;
+
+    const float bpm_lag = 60.0f / hop_seconds;
+    r->lag_min = (int)floorf(bpm_lag / RHYTHM_MAX_BPM);
+    r->lag_max = (int)ceilf(bpm_lag / RHYTHM_MIN_BPM);
+    r->lag_min = (r->lag_min > 2) ? r->lag_min : 2;
+    r->lag_max = (r->lag_max < RHYTHM_HISTORY - 2) ? r->lag_max : RHYTHM_HISTORY - 2;
+
+    const float preferred = bpm_lag / PREFERRED_BPM;
+    for (int lag = r->lag_min; lag <= r->lag_max; lag++) {
+        const float octaves = log2f((float)lag / preferred);
+        r->weight[lag] = expf(-0.5f * octaves * octaves);
+    }
+}
+
+// One hop of onset strength into the history and the autocorrelation.
+static void rhythm_push(Rhythm *r, const float o)
+{
+    r->t++;
+    r->odf[r->t % RHYTHM_HISTORY] = o;
+    for (int lag = r->lag_min; lag <= r->lag_max; lag++) {
+        r->acc[lag] = r->decay * r->acc[lag] + o * r->odf[(r->t - lag) % RHYTHM_HISTORY];
+    }
+}
+
+// Strongest weighted lag, refined between hops with a parabola through its
+// neighbours. Leaves period at 0 while there's no clear pulse.
+static void rhythm_tempo(Rhythm *r)
+{
+    r->period = 0.0f;
+    if (r->t < 2 * (uint64_t)r->lag_max) {
+        return;
+    }
+
+    int best = r->lag_min;
+    float sum = 0.0f;
+    for (int lag = r->lag_min; lag <= r->lag_max; lag++) {
+        const float s = r->acc[lag] * r->weight[lag];
+        sum += s;
+        best = (s > r->acc[best] * r->weight[best]) ? lag : best;
+    }
+
+    const float peak = r->acc[best] * r->weight[best];
+    const float mean = sum / (float)(r->lag_max - r->lag_min + 1);
+    if (peak <= 0.0f || peak < TEMPO_CLARITY * mean) {
+        return;
+    }
+
+    float shift = 0.0f;
+    if (best > r->lag_min && best < r->lag_max) {
+        const float a = r->acc[best - 1], b = r->acc[best], c = r->acc[best + 1];
+        const float curve = a - 2.0f * b + c;
+        shift = (curve < 0.0f) ? 0.5f * (a - c) / curve : 0.0f;
+    }
+    r->period = (float)best + shift;
+    r->bpm = 60.0f * (float)r->sr / (r->period * (float)r->hop);
+}
+
+// Onsets become beats when one is due, at least 0.7 of a period after the
+// last. Without an onset a predicted beat goes out on time, and an onset
+// shortly after it only pulls the phase over.
+static int rhythm_beat(Rhythm *r, const int onset, const uint64_t pos)
+{
+    const double t = (double)r->t;
+    if (r->period <= 0.0f) {
+        if (onset) {
+            r->beat = r->onset;
+            r->last_beat = t;
+            r->next = t;
+            r->anchored = 1;
+        }
+        return onset ? RHYTHM_BEAT : 0;
+    }
+
+    const double period = r->period;
+    if (r->next <= r->last_beat) {
+        r->next = r->last_beat + period;
+    }
+
+    const double since = t - r->last_beat;
+    if (onset && since >= 0.7 * period) {
+        r->beat = r->onset;
+        r->last_beat = t;
+        r->next = t + period;
+        r->anchored = 1;
+        return RHYTHM_BEAT;
+    }
+
+    if (onset && !r->anchored && since <= 0.3 * period) {
+        r->last_beat = t;
+        r->next = t + period;
+        r->anchored = 1;
+        return 0;
+    }
+
+    if (!onset && t >= r->next) {
+        const uint64_t late = (uint64_t)((t - r->next) * r->hop);
+        r->beat.pos = (pos > late) ? pos - late : 0;
+        r->beat.strength = 0.5f;
+        r->beat.predicted = 1;
+        r->last_beat = r->next;
+        r->next += period;
+        r->anchored = 0;
+        return RHYTHM_BEAT;
+    }
+    return 0;
+}
+
+// power is the calibrated bar power of the analysis that ended at stream
+// position pos, hops how many hops passed since the last one (sched_due).
+// Returns RHYTHM_ONSET and/or RHYTHM_BEAT, the events are in r->onset and
+// r->beat.
+int rhythm_update(Rhythm *r, const float *power, const int sr, const uint32_t hop, const uint32_t hops,
+                  const uint64_t pos)
+{
+    if (r->sr != sr || r->hop != hop || hops > RHYTHM_HISTORY) {
+        rhythm_rate(r, sr, hop);
+    }
+    if (hops == 0) {
+        return 0;
+    }
+
+    float rise = 0.0f;
+    for (int b = 0; b < DIVISOR; b++) {
+        const float l = fast_log2f((power[b] > POWER_FLOOR) ? power[b] : POWER_FLOOR);
+        const float d = l - r->prev[b];
+        rise += (d > 0.0f) ? d : 0.0f;
+        r->prev[b] = l;
+    }
+    const float flux = rise / DIVISOR;
+
+    // Nothing to compare the first hop against. Skipped hops count as no
+    // change so the lags stay in step with the audio.
+    const int first = r->t == 0;
+    for (uint32_t i = 1; i < hops; i++) {
+        rhythm_push(r, 0.0f);
+    }
+    rhythm_push(r, (!first && flux > r->mean) ? flux - r->mean : 0.0f);
+
+    int flags = 0;
+    const float threshold = r->mean + r->threshold * r->dev + FLUX_FLOOR;
+    if (!first && flux > threshold && flux > r->flux && r->t - r->last_onset >= r->refractory) {
+        const float strength = (flux - r->mean) / (4.0f * r->dev + FLUX_FLOOR);
+        r->onset.pos = pos;
+        r->onset.strength = (strength < 1.0f) ? strength : 1.0f;
+        r->onset.predicted = 0;
+        r->last_onset = r->t;
+        flags |= RHYTHM_ONSET;
+    }
+
+    // The stats only see the hop after it's been judged, an onset doesn't
+    // raise its own bar.
+    if (!first) {
+        r->mean += (flux - r->mean) * r->follow;
+        r->dev += (fabsf(flux - r->mean) - r->dev) * r->follow;
+    }
+    r->flux = flux;
+
+    rhythm_tempo(r);
+    return flags | rhythm_beat(r, flags & RHYTHM_ONSET, pos);
+}
+
+// Decaying pulse for the renderer, 1 at the event and gone in a few tenths
+// of a second. now is the playback position on the same clock as pos.
+float rhythm_pulse(const RhythmEvent *e, const uint64_t now, const int sr)
+{
+    if (e->strength <= 0.0f || now < e->pos || sr <= 0) {
+        return 0.0f;
+    }
+    const float age = (float)(now - e->pos) / (float)sr;
+    return e->strength * expf(-age / PULSE_SECONDS);
+}
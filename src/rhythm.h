@@ -0,0 +1,71 @@
+#ifndef RHYTHM_H
+#define RHYTHM_H
+
+#include "rndrdef.h"
+#include <stdint.h>
+
+// Hops of onset strength kept for the tempo search, also the longest lag.
+#define RHYTHM_HISTORY 512
+#define RHYTHM_MIN_BPM 60.0f
+#define RHYTHM_MAX_BPM 200.0f
+
+#define RHYTHM_ONSET 1
+#define RHYTHM_BEAT 2
+
+// Something that happened at stream position pos (frames, the same clock as
+// audio_snapshot). predicted beats come from the tempo alone, the rest landed
+// on an onset.
+typedef struct
+{
+    uint64_t pos;
+    float strength;
+    int predicted;
+} RhythmEvent;
+
+// Onsets and beats from the bar power, one update per analysis hop. Onsets
+// are rises in log power summed over the bars, compared against a running
+// mean and deviation of that flux. The tempo is the strongest lag of a
+// decaying autocorrelation of the onset strength, beats follow it like a
+// flywheel: they snap to onsets near where one is due and carry on at the
+// tempo when nothing lands. Every update is O(bars + lags), nothing grows
+// with the song.
+typedef struct
+{
+    int sr;
+    uint32_t hop;
+    float threshold;
+    // Per hop rates, from sr and hop.
+    float follow;
+    float decay;
+    uint32_t refractory;
+
+    float prev[DIVISOR];
+    float flux;
+    float mean;
+    float dev;
+    uint64_t t;
+    uint64_t last_onset;
+
+    float odf[RHYTHM_HISTORY];
+    float acc[RHYTHM_HISTORY];
+    float weight[RHYTHM_HISTORY];
+    int lag_min;
+    int lag_max;
+
+    // In hops, 0 until there's a tempo to follow.
+    float period;
+    double next;
+    double last_beat;
+    int anchored;
+
+    float bpm;
+    RhythmEvent onset;
+    RhythmEvent beat;
+} Rhythm;
+
+void rhythm_init(Rhythm *r, float threshold);
+void rhythm_reset(Rhythm *r);
+int rhythm_update(Rhythm *r, const float *power, int sr, uint32_t hop, uint32_t hops, uint64_t pos);
+float rhythm_pulse(const RhythmEvent *e, uint64_t now, int sr);
+
+#endif
@@ -3,4 +3,5 @@
 #define RENDER_WIDTH  640
 #define RENDER_HEIGHT 480
 #define DIVISOR       80
+#define FRAME_RATE    60
 #endif
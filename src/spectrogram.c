@@ -0,0 +1,330 @@
+#include "spectrogram.h"
+#include "entry.h"
+#include "worker.h"
+#include <SDL2/SDL.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char SPECTROGRAM_MAGIC[8] = { 'R', 'T', 'A', 'V', 'S', 'P', 'E', 'C' };
+
+static uint64_t fnv1a(uint64_t h, const void *data, const size_t len)
+{
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static size_t spectrogram_stride(const Config *cfg) { return DIVISOR + (size_t)cfg->featurec; }
+
+// Scale factors then SPECTROGRAM_BLOCK frames of codes, which keeps every
+// block a multiple of four bytes so the scales stay aligned.
+static size_t spectrogram_block_bytes(const Config *cfg)
+{
+    return sizeof(QuantScale) * (1 + (size_t)cfg->featurec) +
+           SPECTROGRAM_BLOCK * spectrogram_stride(cfg) * (size_t)(cfg->spectrogram_bits / 8);
+}
+
+static size_t spectrogram_len(const Config *cfg, const uint64_t frames)
+{
+    const uint64_t blocks = (frames + SPECTROGRAM_BLOCK - 1) / SPECTROGRAM_BLOCK;
+    return sizeof(SpectrogramHeader) + blocks * spectrogram_block_bytes(cfg);
+}
+
+// Quantises count frames of stride floats into one block. Bars go to log2
+// first, where a step is the same number of dB anywhere in the range, and
+// each column gets the block's own range so quiet passages keep their detail.
+static void spectrogram_encode(float *frames, const size_t count, const Config *cfg, unsigned char *out)
+{
+    const size_t stride = spectrogram_stride(cfg);
+    const int bits = cfg->spectrogram_bits;
+    const float levels = (float)((1u << bits) - 1);
+    QuantScale *const scale = (QuantScale *)out;
+    unsigned char *const codes = out + sizeof(QuantScale) * (1 + (size_t)cfg->featurec);
+    memset(codes, 0, SPECTROGRAM_BLOCK * stride * (size_t)(bits / 8));
+
+    for (size_t k = 0; k < count; k++) {
+        for (int b = 0; b < DIVISOR; b++) {
+            const float v = frames[k * stride + b];
+            frames[k * stride + b] = log2f((v > SPECTROGRAM_FLOOR) ? v : SPECTROGRAM_FLOOR);
+        }
+    }
+
+    for (int c = 0; c <= cfg->featurec; c++) {
+        const size_t first = (c == 0) ? 0 : DIVISOR + (size_t)c - 1;
+        const size_t width = (c == 0) ? DIVISOR : 1;
+        float lo = INFINITY, hi = -INFINITY;
+        for (size_t k = 0; k < count; k++) {
+            for (size_t i = first; i < first + width; i++) {
+                lo = (frames[k * stride + i] < lo) ? frames[k * stride + i] : lo;
+                hi = (frames[k * stride + i] > hi) ? frames[k * stride + i] : hi;
+            }
+        }
+        lo = (count > 0) ? lo : 0.0f;
+        scale[c].base = lo;
+        scale[c].step = (count > 0 && hi > lo) ? (hi - lo) / levels : 0.0f;
+
+        for (size_t k = 0; k < count; k++) {
+            for (size_t i = first; i < first + width; i++) {
+                const long q = (scale[c].step > 0.0f) ? lroundf((frames[k * stride + i] - lo) / scale[c].step) : 0;
+                if (bits == 8) {
+                    codes[k * stride + i] = (uint8_t)q;
+                } else {
+                    ((uint16_t *)codes)[k * stride + i] = (uint16_t)q;
+                }
+            }
+        }
+    }
+}
+
+static SPECTRUM_CLONES void decode_bars8(const uint8_t *q, const QuantScale s, float *out)
+{
+    for (int b = 0; b < DIVISOR; b++) {
+        out[b] = fast_exp2f(s.base + s.step * (float)q[b]);
+    }
+}
+
+static SPECTRUM_CLONES void decode_bars16(const uint16_t *q, const QuantScale s, float *out)
+{
+    for (int b = 0; b < DIVISOR; b++) {
+        out[b] = fast_exp2f(s.base + s.step * (float)q[b]);
+    }
+}
+
+// Everything the frames depend on goes into the key: the file as it is on
+// disk, its sample rate and every analysis setting.
+static int spectrogram_key(Spectrogram *s, const char *path)
+{
+    char abs[PATH_MAX];
+    struct stat st;
+    if (stat(path, &st) < 0 || !realpath(path, abs)) {
+        return 0;
+    }
+
+    const Config *const cfg = s->cfg;
+    char key[PATH_MAX + 256];
+    const int n = snprintf(key, sizeof(key), "%s|%lld|%lld|%d|%zu|%u|%d|%.4f|%d|%d|%d|%d|%d", abs,
+                           (long long)st.st_size, (long long)st.st_mtime, s->p->sr, cfg->fft_size, cfg->hop,
+                           (int)cfg->window, cfg->kaiser_beta, (int)cfg->mode, (int)cfg->channels, DIVISOR,
+                           cfg->spectrogram_bits, SPECTROGRAM_VERSION);
+    if (n < 0 || n >= (int)sizeof(key)) {
+        return 0;
+    }
+
+    uint64_t h = fnv1a(0xcbf29ce484222325ULL, key, (size_t)n);
+    for (int i = 0; i < cfg->featurec; i++) {
+        h = fnv1a(h, cfg->features[i]->name, strlen(cfg->features[i]->name) + 1);
+    }
+    s->key = h;
+
+    char name[64];
+    snprintf(name, sizeof(name), "spectra/%016llx", (unsigned long long)h);
+    return cache_path(s->path, sizeof(s->path), name, 0);
+}
+
+// Only a file written for exactly this key and track length gets mapped,
+// anything else is treated as missing and filled again.
+static int spectrogram_map(Spectrogram *s)
+{
+    const size_t stride = spectrogram_stride(s->cfg);
+    const size_t len = spectrogram_len(s->cfg, s->frames);
+    const int fd = open(s->path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size != len) {
+        close(fd);
+        return 0;
+    }
+    void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        printf("Could not map %s: %s\n", s->path, strerror(errno));
+        return 0;
+    }
+
+    const SpectrogramHeader *const head = map;
+    if (memcmp(head->magic, SPECTROGRAM_MAGIC, sizeof(head->magic)) != 0 || head->version != SPECTROGRAM_VERSION ||
+        head->stride != stride || head->hop != s->cfg->hop || head->featurec != (uint32_t)s->cfg->featurec ||
+        head->key != s->key || head->frames != s->frames || head->bits != (uint32_t)s->cfg->spectrogram_bits ||
+        head->block_bytes != spectrogram_block_bytes(s->cfg)) {
+        munmap(map, len);
+        return 0;
+    }
+
+    s->map = map;
+    s->map_len = len;
+    s->head = head;
+    s->data = (const unsigned char *)(head + 1);
+    return 1;
+}
+
+// Runs the same analysis as the worker over the whole track into a temporary
+// file a block at a time, renamed into place once it's complete so a half
+// written one is never mapped.
+static int spectrogram_fill(void *data)
+{
+    Spectrogram *const s = (Spectrogram *)data;
+    const AParams *const p = s->p;
+    const size_t stride = spectrogram_stride(s->cfg);
+    const uint64_t started = SDL_GetPerformanceCounter();
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+
+    Raw raw = { 0 };
+    char dir[PATH_MAX], tmp[PATH_MAX];
+    const size_t block_bytes = spectrogram_block_bytes(s->cfg);
+    float *const frames = malloc(SPECTROGRAM_BLOCK * stride * sizeof(float));
+    unsigned char *const packed = malloc(block_bytes);
+    float *const chunk = fft_alloc(s->cfg->fft_size * AUDIO_CHANNELS, sizeof(float));
+    FILE *file = NULL;
+
+    int ok = raw_init(&raw, s->cfg) && frames && packed && chunk;
+    if (ok && cache_path(dir, sizeof(dir), "spectra", 1) && (mkdir(dir, 0755) == 0 || errno == EEXIST) &&
+        snprintf(tmp, sizeof(tmp), "%s.%d.tmp", s->path, (int)getpid()) < (int)sizeof(tmp)) {
+        if (!(file = fopen(tmp, "wb"))) {
+            printf("Could not open %s: %s\n", tmp, strerror(errno));
+        }
+    }
+    ok = ok && file;
+
+    SpectrogramHeader head = {
+        .version = SPECTROGRAM_VERSION,
+        .stride = (uint32_t)stride,
+        .hop = s->cfg->hop,
+        .featurec = (uint32_t)s->cfg->featurec,
+        .key = s->key,
+        .frames = s->frames,
+        .bits = (uint32_t)s->cfg->spectrogram_bits,
+        .block_bytes = (uint32_t)block_bytes,
+    };
+    memcpy(head.magic, SPECTROGRAM_MAGIC, sizeof(head.magic));
+    ok = ok && fwrite(&head, sizeof(head), 1, file) == 1;
+
+    for (uint64_t k = 0; ok && k < s->frames; k++) {
+        if (atomic_load_explicit(&s->cancel, memory_order_relaxed)) {
+            ok = 0;
+            break;
+        }
+        analyze_frame(&raw, p, k, chunk, frames + (k % SPECTROGRAM_BLOCK) * stride);
+        if (k % SPECTROGRAM_BLOCK == SPECTROGRAM_BLOCK - 1 || k + 1 == s->frames) {
+            spectrogram_encode(frames, k % SPECTROGRAM_BLOCK + 1, s->cfg, packed);
+            ok = fwrite(packed, 1, block_bytes, file) == block_bytes;
+        }
+    }
+
+    if (file) {
+        if (fclose(file) == EOF) {
+            printf("Failed to close file: %s\n", strerror(errno));
+            ok = 0;
+        }
+        if (ok && rename(tmp, s->path) < 0) {
+            printf("Could not store %s: %s\n", s->path, strerror(errno));
+            ok = 0;
+        }
+        if (!ok) {
+            remove(tmp);
+        }
+    }
+
+    if (ok) {
+        const double seconds = (double)(SDL_GetPerformanceCounter() - started) / (double)SDL_GetPerformanceFrequency();
+        printf("Spectrogram of %llu frames cached in %.2f s\n", (unsigned long long)s->frames, seconds);
+        atomic_store_explicit(&s->filled, 1, memory_order_release);
+    }
+    raw_free(&raw);
+    free(frames);
+    free(packed);
+    free(chunk);
+    return 0;
+}
+
+// Maps the track's spectrogram if it's cached, otherwise starts filling it.
+// Only for the windowed modes, the sliding DFT has no frames to store.
+void spectrogram_open(Spectrogram *s, const Config *cfg, const char *path, const AParams *p)
+{
+    memset(s, 0, sizeof(Spectrogram));
+    s->cfg = cfg;
+    s->p = p;
+    atomic_init(&s->cancel, 0);
+    atomic_init(&s->filled, 0);
+    if (!cfg->spectrogram || cfg->mode == ANALYZE_SDFT || !path || !p || !p->buffer || p->sr <= 0) {
+        return;
+    }
+
+    s->frames = p->len / AUDIO_CHANNELS / cfg->hop + 1;
+    if (!spectrogram_key(s, path)) {
+        return;
+    }
+    if (spectrogram_map(s)) {
+        printf("Spectrogram: cached\n");
+        return;
+    }
+    if (!(s->thread = SDL_CreateThread(spectrogram_fill, "spectrogram", s))) {
+        printf("Could not start the spectrogram thread: %s\n", SDL_GetError());
+    }
+}
+
+// Whether frames can be looked up, maps the file the first time after the
+// fill thread finishes it.
+int spectrogram_ready(Spectrogram *s)
+{
+    if (!s->data && atomic_load_explicit(&s->filled, memory_order_acquire)) {
+        atomic_store_explicit(&s->filled, 0, memory_order_relaxed);
+        SDL_WaitThread(s->thread, NULL);
+        s->thread = NULL;
+        spectrogram_map(s);
+    }
+    return s->data != NULL;
+}
+
+// Decodes the frame whose window ends at or just before stream position pos
+// into bar power and feature values, only once spectrogram_ready says so.
+void spectrogram_frame(const Spectrogram *s, const uint64_t pos, float *sums, float *features)
+{
+    const SpectrogramHeader *const head = s->head;
+    uint64_t k = pos / head->hop;
+    k = (k < s->frames) ? k : s->frames - 1;
+
+    const unsigned char *const block = s->data + (k / SPECTROGRAM_BLOCK) * head->block_bytes;
+    const QuantScale *const scale = (const QuantScale *)block;
+    const unsigned char *const codes =
+        block + sizeof(QuantScale) * (1 + head->featurec) + (k % SPECTROGRAM_BLOCK) * head->stride * (head->bits / 8);
+
+    if (head->bits == 8) {
+        decode_bars8(codes, scale[0], sums);
+        for (uint32_t f = 0; f < head->featurec; f++) {
+            features[f] = scale[1 + f].base + scale[1 + f].step * (float)codes[DIVISOR + f];
+        }
+    } else {
+        const uint16_t *const codes16 = (const uint16_t *)codes;
+        decode_bars16(codes16, scale[0], sums);
+        for (uint32_t f = 0; f < head->featurec; f++) {
+            features[f] = scale[1 + f].base + scale[1 + f].step * (float)codes16[DIVISOR + f];
+        }
+    }
+}
+
+void spectrogram_close(Spectrogram *s)
+{
+    if (s->thread) {
+        atomic_store_explicit(&s->cancel, 1, memory_order_relaxed);
+        SDL_WaitThread(s->thread, NULL);
+        s->thread = NULL;
+    }
+    if (s->map) {
+        munmap(s->map, s->map_len);
+    }
+    s->map = NULL;
+    s->head = NULL;
+    s->data = NULL;
+}
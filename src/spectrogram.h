@@ -0,0 +1,71 @@
+#ifndef SPECTROGRAM_H
+#define SPECTROGRAM_H
+
+#include "audio.h"
+#include "config.h"
+#include <SDL2/SDL_thread.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bump whenever the analysis changes what it outputs, old files stop matching.
+#define SPECTROGRAM_VERSION 2
+// Frames sharing one set of scale factors.
+#define SPECTROGRAM_BLOCK 64
+// Bar powers under this (-100 dB) are stored as this.
+#define SPECTROGRAM_FLOOR 1e-10f
+
+// Start of every cache file, blocks of SPECTROGRAM_BLOCK frames follow. Each
+// block starts with a QuantScale for the bars and one per feature, then every
+// frame's codes of bits bits: the bars first, then the features in config
+// order. The last block is padded out with zero codes.
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t stride;
+    uint32_t hop;
+    uint32_t featurec;
+    uint64_t key;
+    uint64_t frames;
+    uint32_t bits;
+    uint32_t block_bytes;
+} SpectrogramHeader;
+
+// value = base + step * code. Bars are quantised as log2 power over the
+// block's range, features linearly over theirs.
+typedef struct
+{
+    float base;
+    float step;
+} QuantScale;
+
+// Every analysis of a track precomputed once, frame k is the window ending at
+// k * hop, and kept in ~/.cache/rtav/spectra under a hash of the file and the
+// analysis settings. A track without one gets it filled by a low priority
+// thread while it plays live, after that playback only indexes the mapping.
+typedef struct
+{
+    const Config *cfg;
+    const AParams *p;
+    uint64_t key;
+    uint64_t frames;
+    char path[PATH_MAX];
+
+    SDL_Thread *thread;
+    atomic_int cancel;
+    atomic_int filled;
+
+    void *map;
+    size_t map_len;
+    const SpectrogramHeader *head;
+    const unsigned char *data;
+} Spectrogram;
+
+void spectrogram_open(Spectrogram *s, const Config *cfg, const char *path, const AParams *p);
+int spectrogram_ready(Spectrogram *s);
+void spectrogram_frame(const Spectrogram *s, uint64_t pos, float *sums, float *features);
+void spectrogram_close(Spectrogram *s);
+
+#endif
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 static Entries *dirp_ret(const int broken, Entries *const ents,
                          DIR *const dirp)
@@ -126,3 +127,31 @@ int parse_headers(Entries *ent)
     }
     return accumulator;
 }
+
+// ~/.cache/rtav/<name>, or under XDG_CACHE_HOME. With create the rtav
+// directory is made if it isn't there, name itself is left to the caller.
+int cache_path(char *out, const size_t len, const char *name, const int create)
+{
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char base[PATH_MAX];
+    if (xdg && *xdg) {
+        snprintf(base, sizeof(base), "%s", xdg);
+    } else if (home && *home) {
+        snprintf(base, sizeof(base), "%s/.cache", home);
+    } else {
+        return 0;
+    }
+
+    char dir[PATH_MAX];
+    if (snprintf(dir, sizeof(dir), "%s/rtav", base) >= (int)sizeof(dir)) {
+        return 0;
+    }
+    if (create) {
+        if ((mkdir(base, 0755) < 0 && errno != EEXIST) || (mkdir(dir, 0755) < 0 && errno != EEXIST)) {
+            printf("Could not create %s: %s\n", dir, strerror(errno));
+            return 0;
+        }
+    }
+    return snprintf(out, len, "%s/%s", dir, name) < (int)len;
+}
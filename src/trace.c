@@ -0,0 +1,271 @@
+#include "trace.h"
+#include "entry.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *stage_names[TRACE_STAGES] = {
+    "frame", "events", "smoothing", "draw", "swap", "analysis", "snapshot", "window", "fft", "binning", "features",
+    "callback",
+};
+
+// One per live thread, written only by it. head counts every event ever
+// written, the reader takes what's between its own mark and head, and
+// anything more than a ring behind is gone. A thread gives its ring back when
+// it exits, the next one carries on after its events.
+typedef struct
+{
+    TraceEvent *events;
+    atomic_uint_fast64_t head;
+    atomic_int owned;
+    uint64_t reported;
+} TraceRing;
+
+int trace_enabled = 0;
+static TraceRing rings[TRACE_MAX_THREADS];
+// Highest ring ever claimed plus one, and threads that found none free.
+static atomic_int ring_count = 0;
+static atomic_int untraced = 0;
+static int warned_untraced = 0;
+static pthread_key_t ring_key;
+static int ring_key_made = 0;
+static _Thread_local int ring_index = -1;
+static volatile sig_atomic_t dump_requested = 0;
+static uint64_t last_report = 0;
+static uint32_t *scratch = NULL;
+static int dumps = 0;
+
+// Thread exit, value is the ring index plus one.
+static void release_ring(void *value)
+{
+    const int i = (int)(intptr_t)value - 1;
+    atomic_store_explicit(&rings[i].owned, 0, memory_order_release);
+}
+
+static int claim_ring(void)
+{
+    for (int i = 0; i < TRACE_MAX_THREADS; i++) {
+        int free_ring = 0;
+        if (atomic_compare_exchange_strong(&rings[i].owned, &free_ring, 1)) {
+            int count = atomic_load(&ring_count);
+            while (count < i + 1 && !atomic_compare_exchange_weak(&ring_count, &count, i + 1)) {
+            }
+            pthread_setspecific(ring_key, (void *)(intptr_t)(i + 1));
+            return i;
+        }
+    }
+    atomic_fetch_add_explicit(&untraced, 1, memory_order_relaxed);
+    return TRACE_MAX_THREADS;
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    dump_requested = 1;
+}
+
+// Every ring is allocated here, threads only claim one. SIGUSR1 asks for a
+// dump from then on.
+int trace_init(const int on)
+{
+    if (!on) {
+        return 1;
+    }
+    for (int i = 0; i < TRACE_MAX_THREADS; i++) {
+        if (!(rings[i].events = calloc(TRACE_EVENTS, sizeof(TraceEvent)))) {
+            printf("Could not allocate memory: %s\n", strerror(errno));
+            trace_free();
+            return 0;
+        }
+        atomic_init(&rings[i].head, 0);
+        atomic_init(&rings[i].owned, 0);
+        rings[i].reported = 0;
+    }
+    if (pthread_key_create(&ring_key, release_ring) != 0) {
+        printf("Could not create the trace thread key\n");
+        trace_free();
+        return 0;
+    }
+    ring_key_made = 1;
+    if (!(scratch = malloc((size_t)TRACE_EVENTS * TRACE_MAX_THREADS * sizeof(uint32_t)))) {
+        printf("Could not allocate memory: %s\n", strerror(errno));
+        trace_free();
+        return 0;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGUSR1, &sa, NULL) < 0) {
+        printf("Could not set the trace signal: %s\n", strerror(errno));
+    }
+
+    trace_enabled = 1;
+    last_report = trace_now();
+    printf("Tracing, kill -USR1 %d or press t to dump a trace\n", (int)getpid());
+    return 1;
+}
+
+void trace_free(void)
+{
+    trace_enabled = 0;
+    if (ring_key_made) {
+        pthread_key_delete(ring_key);
+        ring_key_made = 0;
+    }
+    for (int i = 0; i < TRACE_MAX_THREADS; i++) {
+        free(rings[i].events);
+        rings[i].events = NULL;
+    }
+    free(scratch);
+    scratch = NULL;
+}
+
+void trace_end(const TraceStage stage, const uint64_t start)
+{
+    if (!trace_enabled) {
+        return;
+    }
+    if (ring_index < 0) {
+        ring_index = claim_ring();
+    }
+    if (ring_index >= TRACE_MAX_THREADS) {
+        return;
+    }
+
+    TraceRing *const r = &rings[ring_index];
+    const uint64_t end = trace_now();
+    const uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    TraceEvent *const e = &r->events[head & (TRACE_EVENTS - 1)];
+    e->start = start;
+    e->dur = (uint32_t)((end - start < UINT32_MAX) ? end - start : UINT32_MAX);
+    e->stage = (uint32_t)stage;
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+void trace_request_dump(void) { dump_requested = 1; }
+
+static int rings_used(void)
+{
+    return atomic_load_explicit(&ring_count, memory_order_relaxed);
+}
+
+// Complete ("X") events in the Chrome trace format, loads in chrome://tracing
+// and ui.perfetto.dev. One track per ring, a thread that took over a
+// ring from one that exited carries on in its track.
+// Whatever a thread writes while this runs may land over what's being read,
+// the events that old are about to drop out of the ring anyway.
+static void trace_dump(void)
+{
+    char name[64], path[PATH_MAX];
+    snprintf(name, sizeof(name), "trace-%d-%d.json", (int)getpid(), dumps++);
+    if (!cache_path(path, sizeof(path), name, 1)) {
+        snprintf(path, sizeof(path), "%s", name);
+    }
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        printf("Could not open %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    int first = 1;
+    size_t count = 0;
+    for (int t = 0; t < rings_used(); t++) {
+        const TraceRing *const r = &rings[t];
+        fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%d\"}}",
+                first ? "" : ",\n", t, t);
+        first = 0;
+        const uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        const uint64_t from = (head > TRACE_EVENTS) ? head - TRACE_EVENTS : 0;
+        for (uint64_t i = from; i < head; i++) {
+            const TraceEvent e = r->events[i & (TRACE_EVENTS - 1)];
+            if (e.stage >= TRACE_STAGES) {
+                continue;
+            }
+            fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                    stage_names[e.stage], t, (double)e.start / 1000.0, (double)e.dur / 1000.0);
+            count++;
+        }
+    }
+    fprintf(f, "\n]}\n");
+
+    if (fclose(f) == EOF) {
+        printf("Failed to close file: %s\n", strerror(errno));
+        return;
+    }
+    printf("Wrote %zu trace events to %s\n", count, path);
+}
+
+static int by_dur(const void *a, const void *b)
+{
+    const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// p50, p99 and max per stage over everything traced since the last report.
+void trace_report(void)
+{
+    if (!trace_enabled) {
+        return;
+    }
+    uint64_t heads[TRACE_MAX_THREADS];
+    const int used = rings_used();
+    for (int t = 0; t < used; t++) {
+        heads[t] = atomic_load_explicit(&rings[t].head, memory_order_acquire);
+        const uint64_t oldest = (heads[t] > TRACE_EVENTS) ? heads[t] - TRACE_EVENTS : 0;
+        rings[t].reported = (rings[t].reported > oldest) ? rings[t].reported : oldest;
+    }
+
+    printf("Stage times (us)     count      p50      p99      max\n");
+    for (int s = 0; s < TRACE_STAGES; s++) {
+        size_t n = 0;
+        for (int t = 0; t < used; t++) {
+            for (uint64_t i = rings[t].reported; i < heads[t]; i++) {
+                const TraceEvent *const e = &rings[t].events[i & (TRACE_EVENTS - 1)];
+                if (e->stage == (uint32_t)s) {
+                    scratch[n++] = e->dur;
+                }
+            }
+        }
+        if (n == 0) {
+            continue;
+        }
+        qsort(scratch, n, sizeof(uint32_t), by_dur);
+        printf("  %-16s %8zu %8.1f %8.1f %8.1f\n", stage_names[s], n, scratch[n / 2] / 1000.0,
+               scratch[n * 99 / 100] / 1000.0, scratch[n - 1] / 1000.0);
+    }
+    for (int t = 0; t < used; t++) {
+        rings[t].reported = heads[t];
+    }
+    const int lost = atomic_load_explicit(&untraced, memory_order_relaxed);
+    if (lost > warned_untraced) {
+        printf("  %d threads untraced, all %d rings were taken\n", lost, TRACE_MAX_THREADS);
+        warned_untraced = lost;
+    }
+}
+
+// From the render loop: dumps if asked to and reports every
+// TRACE_REPORT_MS.
+void trace_poll(void)
+{
+    if (!trace_enabled) {
+        return;
+    }
+    if (dump_requested) {
+        dump_requested = 0;
+        trace_dump();
+    }
+    const uint64_t now = trace_now();
+    if (now - last_report >= (uint64_t)TRACE_REPORT_MS * 1000000ull) {
+        last_report = now;
+        trace_report();
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Events each thread keeps, the oldest are overwritten.
+#define TRACE_EVENTS (1 << 16)
+// Threads that get a ring, any after that aren't traced.
+#define TRACE_MAX_THREADS 16
+// How often trace_poll prints the stage times.
+#define TRACE_REPORT_MS 5000
+
+typedef enum
+{
+    TRACE_FRAME,
+    TRACE_EVENTS_POLL,
+    TRACE_SMOOTHING,
+    TRACE_DRAW,
+    TRACE_SWAP,
+    TRACE_ANALYSIS,
+    TRACE_SNAPSHOT,
+    TRACE_WINDOW,
+    TRACE_FFT,
+    TRACE_BINNING,
+    TRACE_FEATURES,
+    TRACE_CALLBACK,
+    TRACE_STAGES,
+} TraceStage;
+
+typedef struct
+{
+    uint64_t start;
+    uint32_t dur;
+    uint32_t stage;
+} TraceEvent;
+
+extern int trace_enabled;
+
+// Nanoseconds on the monotonic clock, 0 with tracing off so an untraced
+// scope costs a branch.
+static inline uint64_t trace_now(void)
+{
+    if (!trace_enabled) {
+        return 0;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+int trace_init(int on);
+void trace_free(void);
+// The scope that started at start (from trace_now) ends now.
+void trace_end(TraceStage stage, uint64_t start);
+void trace_request_dump(void);
+void trace_poll(void);
+void trace_report(void);
+
+#endif
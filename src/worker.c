@@ -0,0 +1,390 @@
+#include "worker.h"
+#include "trace.h"
+#include <SDL2/SDL.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Set in middle when the writer has put a frame there the reader hasn't seen.
+#define TRIPLE_FRESH 4u
+// How long the worker sleeps while there's nothing playing, in ms.
+#define WORKER_IDLE_MS 5
+
+void triple_init(TripleBuffer *t)
+{
+    memset(t->slot, 0, sizeof(t->slot));
+    t->back = 0;
+    atomic_init(&t->middle, 1u);
+    t->front = 2;
+}
+
+BarFrame *triple_back(TripleBuffer *t) { return &t->slot[t->back]; }
+
+void triple_publish(TripleBuffer *t)
+{
+    const unsigned old = atomic_exchange_explicit(&t->middle, t->back | TRIPLE_FRESH, memory_order_acq_rel);
+    t->back = old & 3u;
+}
+
+// The newest published frame, or the one from last time if nothing new came
+// in. Stays valid until the next call.
+const BarFrame *triple_read(TripleBuffer *t)
+{
+    if (atomic_load_explicit(&t->middle, memory_order_relaxed) & TRIPLE_FRESH) {
+        const unsigned old = atomic_exchange_explicit(&t->middle, t->front, memory_order_acq_rel);
+        t->front = old & 3u;
+    }
+    return &t->slot[t->front];
+}
+
+// One analysis of the deinterleaved signals into sums. The FFT paths read the
+// first raw->size frames, the sliding DFT all of them with the last one at
+// stream position end.
+void analyze(Raw *raw, const int sr, const size_t frames, const uint64_t end, const uint64_t now, float *sums)
+{
+    // The sliding DFT only runs on the mono mix, config_parse makes sure.
+    const int stereo = raw->channels != CHANNELS_MONO;
+    float bars[2][DIVISOR];
+
+    switch (raw->sched.mode) {
+    case ANALYZE_SDFT:
+    {
+        if (raw->sdft.sr != sr) {
+            sdft_init(&raw->sdft, raw->size, sr);
+        }
+        const uint64_t t = trace_now();
+        sdft_advance(&raw->sdft, raw->a, (uint32_t)frames, end, now);
+        sdft_bars(&raw->sdft, bars[0]);
+        trace_end(TRACE_BINNING, t);
+    } break;
+    case ANALYZE_CQT:
+    {
+        // The kernels are windowed already.
+        uint64_t t = trace_now();
+        if (stereo) {
+            stereo_fft_split(raw->plan, raw->a, raw->b, &raw->spec, &raw->spec_b);
+        } else {
+            real_fft_split(raw->plan, raw->a, &raw->spec);
+        }
+        trace_end(TRACE_FFT, t);
+        if (raw->cqt.sr != sr) {
+            cqt_init(&raw->cqt, raw->plan, sr);
+        }
+        if (raw->cqt.sr != sr) {
+            return;
+        }
+        t = trace_now();
+        cqt_bars(&raw->cqt, &raw->spec, bars[0]);
+        if (stereo) {
+            cqt_bars(&raw->cqt, &raw->spec_b, bars[1]);
+        }
+        trace_end(TRACE_BINNING, t);
+    } break;
+    case ANALYZE_FFT:
+    {
+        uint64_t t = trace_now();
+        wfunc(raw->a, raw->window, (int)raw->size);
+        if (stereo) {
+            wfunc(raw->b, raw->window, (int)raw->size);
+        }
+        trace_end(TRACE_WINDOW, t);
+        t = trace_now();
+        if (stereo) {
+            stereo_fft_split(raw->plan, raw->a, raw->b, &raw->spec, &raw->spec_b);
+        } else {
+            real_fft_split(raw->plan, raw->a, &raw->spec);
+        }
+        trace_end(TRACE_FFT, t);
+        if (raw->map.sr != sr) {
+            barmap_build(&raw->map, sr, raw->size);
+        }
+        t = trace_now();
+        section_power(&raw->map, &raw->spec, raw->norm, bars[0]);
+        if (stereo) {
+            section_power(&raw->map, &raw->spec_b, raw->norm, bars[1]);
+        }
+        trace_end(TRACE_BINNING, t);
+        t = trace_now();
+        features_run(&raw->features, &raw->spec, stereo ? &raw->spec_b : NULL);
+        trace_end(TRACE_FEATURES, t);
+    } break;
+    case ANALYZE_MULTIRES:
+    {
+        // The longest level has the same window and size as the fft mode.
+        // Every level is windowed, transformed and binned in one go, it all
+        // counts as the FFT.
+        const ResLevel *const full = &raw->multi.level[0];
+        uint64_t t = trace_now();
+        multires_bars(&raw->multi, sr, raw->a, stereo ? raw->b : NULL, bars[0], bars[1]);
+        trace_end(TRACE_FFT, t);
+        t = trace_now();
+        if (full->first < full->last) {
+            features_run(&raw->features, &full->spec[0], stereo ? &full->spec[1] : NULL);
+        }
+        trace_end(TRACE_FEATURES, t);
+    } break;
+    }
+
+    if (stereo) {
+        stereo_bars(bars[0], bars[1], sums);
+    } else {
+        memcpy(sums, bars[0], sizeof(bars[0]));
+    }
+}
+
+// The size frames of the track ending at frame end, zeros where that reaches
+// past either end. Same as the live ring, which starts out silent.
+static void track_window(const AParams *p, float *dst, const uint64_t end, const size_t size)
+{
+    const uint64_t want = (uint64_t)size * AUDIO_CHANNELS;
+    const uint64_t stop = end * AUDIO_CHANNELS;
+    const uint64_t first = (stop > want) ? stop - want : 0;
+    const uint64_t last = (stop < p->len) ? stop : p->len;
+    const size_t lead = (size_t)(want - (stop - first));
+    const size_t body = (last > first) ? (size_t)(last - first) : 0;
+
+    memset(dst, 0, lead * sizeof(float));
+    memcpy(dst + lead, p->buffer + first, body * sizeof(float));
+    memset(dst + lead + body, 0, (want - lead - body) * sizeof(float));
+}
+
+// Frame k of a whole decoded track, the window ending at k * hop, as bar
+// power followed by the feature values. scratch holds fft-size interleaved
+// frames. Features that compare against the previous frame need k - 1 to
+// have gone through the same Raw first.
+void analyze_frame(Raw *raw, const AParams *p, const uint64_t k, float *scratch, float *out)
+{
+    const uint64_t end = k * raw->sched.hop;
+    track_window(p, scratch, end, raw->size);
+    deinterleave(scratch, raw->a, raw->b, raw->size, raw->channels);
+    analyze(raw, p->sr, raw->size, end, end, out);
+    memcpy(out + DIVISOR, raw->features.value, sizeof(float) * (size_t)raw->features.count);
+}
+
+// Every analysis buffer is sized from the configured FFT size, the window is
+// computed here once and reused for every frame.
+int raw_init(Raw *raw, const Config *cfg)
+{
+    raw->size = cfg->fft_size;
+    raw->plan = fft_plan_create(raw->size);
+    raw->window = fft_alloc(raw->size, sizeof(float));
+    raw->history = fft_alloc(audio_history(), sizeof(float));
+    raw->a = fft_alloc(audio_history() / AUDIO_CHANNELS, sizeof(float));
+    raw->b = fft_alloc(audio_history() / AUDIO_CHANNELS, sizeof(float));
+    if (!raw->plan || !raw->window || !raw->history || !raw->a || !raw->b) {
+        printf("Could not allocate memory: %s\n", strerror(errno));
+        return 0;
+    }
+
+    if (!spectrum_init(&raw->spec, raw->size / 2) || !spectrum_init(&raw->spec_b, raw->size / 2)) {
+        return 0;
+    }
+    raw->channels = cfg->channels;
+
+    calculate_window(raw->window, raw->size, cfg->window, cfg->kaiser_beta);
+    raw->norm = power_norm(raw->window, raw->size);
+    if (cfg->mode == ANALYZE_MULTIRES && !multires_init(&raw->multi, raw->size, cfg->window, cfg->kaiser_beta)) {
+        return 0;
+    }
+    if (!features_init(&raw->features, raw->window, raw->size)) {
+        return 0;
+    }
+    for (int i = 0; i < cfg->featurec; i++) {
+        if (!features_add(&raw->features, cfg->features[i])) {
+            return 0;
+        }
+    }
+    rhythm_init(&raw->rhythm, cfg->onset_threshold);
+    sched_init(&raw->sched, cfg->mode, cfg->hop);
+    return 1;
+}
+
+void raw_free(Raw *raw)
+{
+    raw->plan = fft_plan_destroy(raw->plan);
+    spectrum_free(&raw->spec);
+    spectrum_free(&raw->spec_b);
+    free(raw->window);
+    free(raw->history);
+    free(raw->a);
+    free(raw->b);
+    cqt_free(&raw->cqt);
+    multires_free(&raw->multi);
+    features_free(&raw->features);
+    raw->window = NULL;
+    raw->history = NULL;
+    raw->a = NULL;
+    raw->b = NULL;
+}
+
+// Forgets the track, for a new one.
+void raw_reset(Raw *raw)
+{
+    spectrum_clear(&raw->spec);
+    spectrum_clear(&raw->spec_b);
+    sched_reset(&raw->sched);
+    sdft_reset(&raw->sdft);
+    features_reset(&raw->features);
+    rhythm_reset(&raw->rhythm);
+}
+
+// Takes the track main handed over, if any, and publishes an empty frame so
+// the renderer doesn't keep drawing the old one.
+static void worker_adopt(Worker *w)
+{
+    const unsigned request = atomic_load_explicit(&w->request, memory_order_acquire);
+    if (request == atomic_load_explicit(&w->ack, memory_order_relaxed)) {
+        return;
+    }
+
+    spectrogram_close(&w->spec);
+    w->params = w->next;
+    raw_reset(&w->raw);
+    spectrogram_open(&w->spec, w->cfg, w->next_path, w->params);
+    BarFrame *const f = triple_back(&w->out);
+    memset(f, 0, sizeof(BarFrame));
+    f->seq = atomic_load_explicit(&w->analyses, memory_order_relaxed);
+    triple_publish(&w->out);
+    atomic_store_explicit(&w->ack, request, memory_order_release);
+}
+
+// Analyses when a hop is due and returns how long to sleep for, which is
+// until the next one would be.
+static uint32_t worker_step(Worker *w)
+{
+    Raw *const raw = &w->raw;
+    const AParams *const p = w->params;
+    if (!p || !p->buffer || get_audio_state() != SDL_AUDIO_PLAYING) {
+        return WORKER_IDLE_MS;
+    }
+
+    // With the spectrogram cached there's nothing to analyse, the frame at the
+    // playback position is looked up instead. Otherwise the sliding DFT needs
+    // every sample since its last update, the FFT only needs the window
+    // behind the device latency.
+    const int cached = spectrogram_ready(&w->spec);
+    const uint32_t lag = audio_latency();
+    const uint32_t window = (uint32_t)raw->size * AUDIO_CHANNELS;
+    const uint32_t count = (raw->sched.mode == ANALYZE_SDFT) ? p->history : lag + window;
+    uint64_t end = 0, now = 0;
+    const uint64_t traced = trace_now();
+    if (cached) {
+        now = audio_position(p);
+    } else {
+        const uint64_t pushed = audio_snapshot(p, raw->history, count);
+        // Positions from here on are in frames.
+        end = pushed / AUDIO_CHANNELS;
+        now = (pushed > lag) ? (pushed - lag) / AUDIO_CHANNELS : 0;
+        trace_end(TRACE_SNAPSHOT, traced);
+    }
+
+    const uint32_t hops = sched_due(&raw->sched, now);
+    if (hops) {
+        const uint64_t start = SDL_GetPerformanceCounter();
+        BarFrame *const f = triple_back(&w->out);
+        if (cached) {
+            spectrogram_frame(&w->spec, now, w->sums, raw->features.value);
+        } else {
+            const size_t frames = (raw->sched.mode == ANALYZE_SDFT) ? count / AUDIO_CHANNELS : raw->size;
+            deinterleave(raw->history, raw->a, raw->b, frames, raw->channels);
+            analyze(raw, p->sr, frames, end, now, w->sums);
+        }
+        rhythm_update(&raw->rhythm, w->sums, p->sr, raw->sched.hop, hops, now);
+
+        memcpy(f->sums, w->sums, sizeof(f->sums));
+        memcpy(f->features, raw->features.value, sizeof(float) * raw->features.count);
+        f->bpm = raw->rhythm.bpm;
+        f->beat = raw->rhythm.beat;
+        f->onset = raw->rhythm.onset;
+        f->pos = now;
+        f->seq = atomic_load_explicit(&w->analyses, memory_order_relaxed) + 1;
+        triple_publish(&w->out);
+
+        const uint64_t us = (SDL_GetPerformanceCounter() - start) * 1000000 / SDL_GetPerformanceFrequency();
+        atomic_fetch_add_explicit(&w->busy, us, memory_order_relaxed);
+        atomic_fetch_add_explicit(&w->analyses, 1, memory_order_relaxed);
+        trace_end(TRACE_ANALYSIS, traced);
+    }
+
+    const uint64_t due = raw->sched.done + raw->sched.hop;
+    const uint64_t ms = (due > now) ? (due - now) * 1000 / (uint64_t)p->sr : 0;
+    return (ms > 1) ? (uint32_t)((ms < WORKER_IDLE_MS) ? ms : WORKER_IDLE_MS) : 1;
+}
+
+// One round of the worker's loop, for callers driving it without the
+// thread. Returns how long the thread would sleep.
+uint32_t worker_poll(Worker *w)
+{
+    worker_adopt(w);
+    return worker_step(w);
+}
+
+static int worker_main(void *data)
+{
+    Worker *const w = (Worker *)data;
+    while (atomic_load_explicit(&w->run, memory_order_relaxed)) {
+        SDL_Delay(worker_poll(w));
+    }
+    return 0;
+}
+
+// Everything but the thread, worker_poll runs it by hand.
+int worker_init(Worker *w, const Config *cfg)
+{
+    memset(w, 0, sizeof(Worker));
+    w->cfg = cfg;
+    if (!raw_init(&w->raw, cfg)) {
+        raw_free(&w->raw);
+        return 0;
+    }
+    triple_init(&w->out);
+    atomic_init(&w->run, 1);
+    atomic_init(&w->request, 0u);
+    atomic_init(&w->ack, 0u);
+    atomic_init(&w->analyses, 0);
+    atomic_init(&w->busy, 0);
+    return 1;
+}
+
+int worker_start(Worker *w, const Config *cfg)
+{
+    if (!worker_init(w, cfg)) {
+        return 0;
+    }
+    if (!(w->thread = SDL_CreateThread(worker_main, "analysis", w))) {
+        printf("Could not start the analysis thread: %s\n", SDL_GetError());
+        raw_free(&w->raw);
+        return 0;
+    }
+    return 1;
+}
+
+// Hands the worker a track and the file it came from, NULL for none, and waits until it has let go of
+// the previous one. Blocks for at most one analysis. Without the thread the
+// next worker_poll picks it up.
+void worker_attach(Worker *w, AParams *p, const char *path)
+{
+    if (p == w->next && atomic_load_explicit(&w->ack, memory_order_acquire) == atomic_load(&w->request)) {
+        return;
+    }
+    w->next = p;
+    w->next_path = path;
+    const unsigned request = atomic_fetch_add_explicit(&w->request, 1u, memory_order_release) + 1u;
+    while (w->thread && atomic_load_explicit(&w->ack, memory_order_acquire) != request) {
+        SDL_Delay(1);
+    }
+}
+
+const BarFrame *worker_latest(Worker *w) { return triple_read(&w->out); }
+
+void worker_stop(Worker *w)
+{
+    if (w->thread) {
+        atomic_store_explicit(&w->run, 0, memory_order_relaxed);
+        SDL_WaitThread(w->thread, NULL);
+        w->thread = NULL;
+    }
+    spectrogram_close(&w->spec);
+    raw_free(&w->raw);
+}
@@ -0,0 +1,108 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include "analysis.h"
+#include "audio.h"
+#include "config.h"
+#include "cqt.h"
+#include "extractor.h"
+#include "fft.h"
+#include "multires.h"
+#include "rhythm.h"
+#include "rndrdef.h"
+#include "spectrogram.h"
+#include <SDL2/SDL_thread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+typedef struct
+{
+    size_t size;
+    FFTPlan *plan;
+    Spectrum spec;
+    Spectrum spec_b;
+    float *window;
+    // Interleaved snapshot of the ring, then the two signals pulled out of it.
+    float *history;
+    float *a;
+    float *b;
+    ChannelMode channels;
+    BarMap map;
+    float norm;
+    Scheduler sched;
+    SlidingDFT sdft;
+    CQT cqt;
+    MultiRes multi;
+    Features features;
+    Rhythm rhythm;
+} Raw;
+
+// Everything the renderer takes from one analysis. pos is the stream position
+// (frames) it was made at, seq counts analyses since the worker started.
+typedef struct
+{
+    float sums[DIVISOR];
+    float features[FEATURE_MAX];
+    float bpm;
+    RhythmEvent beat;
+    RhythmEvent onset;
+    uint64_t pos;
+    uint64_t seq;
+} BarFrame;
+
+// One writer, one reader, neither ever waits. The writer fills back and swaps
+// it with middle, the reader swaps front with middle only when the fresh bit
+// says there's something newer. Each side owns its own slot at all times.
+typedef struct
+{
+    BarFrame slot[3];
+    atomic_uint middle;
+    unsigned back;
+    unsigned front;
+} TripleBuffer;
+
+// Analysis on its own thread, paced by the audio instead of the frame rate.
+// The track is handed over with worker_attach, which waits for the worker to
+// let go of the old one so it can be freed right after. Tracks with a cached
+// spectrogram are looked up instead of analysed.
+typedef struct
+{
+    const Config *cfg;
+    Raw raw;
+    Spectrogram spec;
+    TripleBuffer out;
+    SDL_Thread *thread;
+    atomic_int run;
+
+    AParams *next;
+    const char *next_path;
+    AParams *params;
+    // Bar power of the latest analysis, only the worker touches it.
+    float sums[DIVISOR];
+    atomic_uint request;
+    atomic_uint ack;
+
+    // Analyses done and the time spent in them, read by anyone for the rate.
+    atomic_uint_fast64_t analyses;
+    atomic_uint_fast64_t busy;
+} Worker;
+
+void triple_init(TripleBuffer *t);
+BarFrame *triple_back(TripleBuffer *t);
+void triple_publish(TripleBuffer *t);
+const BarFrame *triple_read(TripleBuffer *t);
+
+int raw_init(Raw *raw, const Config *cfg);
+void raw_free(Raw *raw);
+void raw_reset(Raw *raw);
+void analyze(Raw *raw, int sr, size_t frames, uint64_t end, uint64_t now, float *sums);
+void analyze_frame(Raw *raw, const AParams *p, uint64_t k, float *scratch, float *out);
+
+int worker_init(Worker *w, const Config *cfg);
+int worker_start(Worker *w, const Config *cfg);
+uint32_t worker_poll(Worker *w);
+void worker_attach(Worker *w, AParams *p, const char *path);
+const BarFrame *worker_latest(Worker *w);
+void worker_stop(Worker *w);
+
+#endif
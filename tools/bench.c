@@ -0,0 +1,497 @@
+// Times each stage of the analysis on its own and the whole pipeline per
+// mode, on synthetic signals at several FFT sizes.
+//
+// usage: rtav_bench [--sizes 1024,8192,...] [--signals sine,sweep,white,pink]
+//                   [--kernel <name>] [--min-ms <n>] [--out <file>]
+//
+// Every stage runs on one hot frame in batches long enough for the clock, the
+// median batch is what gets reported. Results go to --out (rtav_bench.json by
+// default) as JSON, a table of the same numbers is printed as it goes.
+// Cycles come from the TSC, which counts at the nominal clock whatever the
+// core is actually running at, so they're only comparable on one machine.
+#include "analysis.h"
+#include "config.h"
+#include "cqt.h"
+#include "extractor.h"
+#include "fft.h"
+#include "fft_simd.h"
+#include "multires.h"
+#include "post.h"
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+
+#define BENCH_VERSION 1
+#define BENCH_SR 48000
+#define BENCH_REPEATS 9
+#define MAX_SIZES 16
+
+typedef enum
+{
+    SIGNAL_SINE,
+    SIGNAL_SWEEP,
+    SIGNAL_WHITE,
+    SIGNAL_PINK,
+} Signal;
+
+static const char *signal_names[] = { "sine", "sweep", "white", "pink" };
+static const size_t signalc = sizeof(signal_names) / sizeof(signal_names[0]);
+
+// Everything one size needs, built before any stage is timed.
+typedef struct
+{
+    size_t size;
+    FFTPlan *plan;
+    float *window;
+    float norm;
+    // size frames of interleaved stereo, then the two channels pulled out.
+    float *stream;
+    float *a;
+    float *b;
+    float *framed;
+    Compf *cplx;
+    float *half;
+    Spectrum spec;
+    float *power;
+    BarMap map;
+    Features features;
+    PostChain post;
+    CQT cqt;
+    MultiRes multi;
+    float sums[DIVISOR];
+    float sums_b[DIVISOR];
+    float level[DIVISOR];
+    float trail[DIVISOR];
+} Bench;
+
+typedef struct
+{
+    const char *name;
+    void (*run)(Bench *b);
+} Stage;
+
+typedef struct
+{
+    double ns;
+    double ns_min;
+    double cycles;
+    uint64_t iterations;
+} Timing;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t now_cycles(void)
+{
+#if HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Same xorshift every run so the noise is the same from build to build.
+static uint32_t noise_state = 2463534242u;
+static float white(void)
+{
+    noise_state ^= noise_state << 13;
+    noise_state ^= noise_state >> 17;
+    noise_state ^= noise_state << 5;
+    return (float)noise_state / 2147483648.0f - 1.0f;
+}
+
+// All at -6 dBFS peak or about, L and R the same.
+static void make_signal(float *stream, const size_t frames, const Signal sig)
+{
+    const double two_pi = 6.283185307179586;
+    // Paul Kellet's pink filter.
+    double p0 = 0, p1 = 0, p2 = 0, p3 = 0, p4 = 0, p5 = 0, p6 = 0;
+    noise_state = 2463534242u;
+    for (size_t i = 0; i < frames; i++) {
+        const double t = (double)i / BENCH_SR;
+        double v = 0.0;
+        switch (sig) {
+        case SIGNAL_SINE:
+        {
+            v = 0.5 * sin(two_pi * 1000.0 * t);
+        } break;
+        case SIGNAL_SWEEP:
+        {
+            // 20 Hz to 20 kHz exponentially over the frame.
+            const double span = (double)frames / BENCH_SR;
+            const double k = log(1000.0);
+            v = 0.5 * sin(two_pi * 20.0 * span / k * (exp(k * t / span) - 1.0));
+        } break;
+        case SIGNAL_WHITE:
+        {
+            v = 0.5 * white();
+        } break;
+        case SIGNAL_PINK:
+        {
+            const double w = white();
+            p0 = 0.99886 * p0 + w * 0.0555179;
+            p1 = 0.99332 * p1 + w * 0.0750759;
+            p2 = 0.96900 * p2 + w * 0.1538520;
+            p3 = 0.86650 * p3 + w * 0.3104856;
+            p4 = 0.55000 * p4 + w * 0.5329522;
+            p5 = -0.7616 * p5 - w * 0.0168980;
+            v = 0.5 * (p0 + p1 + p2 + p3 + p4 + p5 + p6 + w * 0.5362) * 0.11;
+            p6 = w * 0.115926;
+        } break;
+        }
+        stream[2 * i] = (float)v;
+        stream[2 * i + 1] = (float)v;
+    }
+}
+
+static void bench_free(Bench *b)
+{
+    b->plan = fft_plan_destroy(b->plan);
+    free(b->window);
+    free(b->stream);
+    free(b->a);
+    free(b->b);
+    free(b->framed);
+    free(b->cplx);
+    free(b->half);
+    free(b->power);
+    spectrum_free(&b->spec);
+    features_free(&b->features);
+    cqt_free(&b->cqt);
+    multires_free(&b->multi);
+}
+
+static int bench_init(Bench *b, const size_t size, const FFTKernel *kernel)
+{
+    memset(b, 0, sizeof(Bench));
+    b->size = size;
+    b->plan = fft_plan_create(size);
+    b->window = fft_alloc(size, sizeof(float));
+    b->stream = fft_alloc(size * 2, sizeof(float));
+    b->a = fft_alloc(size, sizeof(float));
+    b->b = fft_alloc(size, sizeof(float));
+    b->framed = fft_alloc(size, sizeof(float));
+    b->cplx = fft_alloc(size, sizeof(Compf));
+    b->half = fft_alloc(size / 2, sizeof(float));
+    b->power = fft_alloc(size / 2, sizeof(float));
+    if (!b->plan || !b->window || !b->stream || !b->a || !b->b || !b->framed || !b->cplx || !b->half || !b->power) {
+        printf("Could not allocate memory: %s\n", strerror(errno));
+        return 0;
+    }
+    if (kernel) {
+        b->plan->kernel = kernel;
+    }
+    if (!spectrum_init(&b->spec, size / 2)) {
+        return 0;
+    }
+
+    calculate_window(b->window, size, WINDOW_HAMMING, 0.0f);
+    b->norm = power_norm(b->window, size);
+    barmap_build(&b->map, BENCH_SR, size);
+
+    // Every built in feature, what the default config runs.
+    if (!features_init(&b->features, b->window, size)) {
+        return 0;
+    }
+    for (int i = 0; feature_builtin(i); i++) {
+        if (!features_add(&b->features, feature_builtin(i))) {
+            return 0;
+        }
+    }
+
+    PostConfig pc;
+    post_defaults(&pc);
+    post_init(&b->post, &pc, BENCH_SR / DEFAULT_HOP);
+
+    if (!cqt_init(&b->cqt, b->plan, BENCH_SR)) {
+        return 0;
+    }
+    return multires_init(&b->multi, size, WINDOW_HAMMING, 0.0f);
+}
+
+static void stage_deinterleave(Bench *b) { deinterleave(b->stream, b->a, b->b, b->size, CHANNELS_MONO); }
+
+// wfunc works in place, the copy keeps it on the same input every time.
+static void stage_wfunc(Bench *b)
+{
+    memcpy(b->framed, b->a, b->size * sizeof(float));
+    wfunc(b->framed, b->window, (int)b->size);
+}
+
+static void stage_iter_fft(Bench *b) { iter_fft(b->plan, b->framed, b->cplx); }
+
+static void stage_compf_to_float(Bench *b) { compf_to_float(b->half, b->cplx, b->size); }
+
+static void stage_real_fft_split(Bench *b) { real_fft_split(b->plan, b->framed, &b->spec); }
+
+static void stage_spectrum_power(Bench *b) { spectrum_power(&b->spec, b->power); }
+
+static void stage_section_power(Bench *b) { section_power(&b->map, &b->spec, b->norm, b->sums); }
+
+static void stage_features(Bench *b) { features_run(&b->features, &b->spec, NULL); }
+
+static void stage_post(Bench *b) { post_run(&b->post, b->sums, b->level, b->trail); }
+
+static void stage_cqt_bars(Bench *b) { cqt_bars(&b->cqt, &b->spec, b->sums); }
+
+// From the interleaved stream to the renderer's bars, as the worker runs
+// each mode on the mono mix.
+static void pipeline_fft(Bench *b)
+{
+    deinterleave(b->stream, b->a, b->b, b->size, CHANNELS_MONO);
+    wfunc(b->a, b->window, (int)b->size);
+    real_fft_split(b->plan, b->a, &b->spec);
+    section_power(&b->map, &b->spec, b->norm, b->sums);
+    features_run(&b->features, &b->spec, NULL);
+    post_run(&b->post, b->sums, b->level, b->trail);
+}
+
+static void pipeline_cqt(Bench *b)
+{
+    deinterleave(b->stream, b->a, b->b, b->size, CHANNELS_MONO);
+    real_fft_split(b->plan, b->a, &b->spec);
+    cqt_bars(&b->cqt, &b->spec, b->sums);
+    post_run(&b->post, b->sums, b->level, b->trail);
+}
+
+static void pipeline_multires(Bench *b)
+{
+    deinterleave(b->stream, b->a, b->b, b->size, CHANNELS_MONO);
+    multires_bars(&b->multi, BENCH_SR, b->a, NULL, b->sums, b->sums_b);
+    const ResLevel *const full = &b->multi.level[0];
+    if (full->first < full->last) {
+        features_run(&b->features, &full->spec[0], NULL);
+    }
+    post_run(&b->post, b->sums, b->level, b->trail);
+}
+
+// In pipeline order, each stage leaves what the next one reads.
+static const Stage stages[] = {
+    { "deinterleave", stage_deinterleave },
+    { "wfunc", stage_wfunc },
+    { "iter_fft", stage_iter_fft },
+    { "compf_to_float", stage_compf_to_float },
+    { "real_fft_split", stage_real_fft_split },
+    { "spectrum_power", stage_spectrum_power },
+    { "section_power", stage_section_power },
+    { "features", stage_features },
+    { "post", stage_post },
+    { "cqt_bars", stage_cqt_bars },
+    { "pipeline_fft", pipeline_fft },
+    { "pipeline_cqt", pipeline_cqt },
+    { "pipeline_multires", pipeline_multires },
+};
+static const size_t stagec = sizeof(stages) / sizeof(stages[0]);
+
+static int by_value(const void *a, const void *b)
+{
+    const double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Doubles the batch until it takes a tenth of min_ns, then keeps the median
+// of BENCH_REPEATS batches.
+static Timing measure(const Stage *st, Bench *b, const uint64_t min_ns)
+{
+    uint64_t n = 1;
+    for (;;) {
+        const uint64_t t0 = now_ns();
+        for (uint64_t i = 0; i < n; i++) {
+            st->run(b);
+        }
+        if (now_ns() - t0 >= min_ns / BENCH_REPEATS || n >= (1ull << 30)) {
+            break;
+        }
+        n <<= 1;
+    }
+
+    double ns[BENCH_REPEATS], cycles[BENCH_REPEATS];
+    for (int r = 0; r < BENCH_REPEATS; r++) {
+        const uint64_t c0 = now_cycles();
+        const uint64_t t0 = now_ns();
+        for (uint64_t i = 0; i < n; i++) {
+            st->run(b);
+        }
+        const uint64_t t1 = now_ns();
+        const uint64_t c1 = now_cycles();
+        ns[r] = (double)(t1 - t0) / n;
+        cycles[r] = (double)(c1 - c0) / n;
+    }
+    qsort(ns, BENCH_REPEATS, sizeof(double), by_value);
+    qsort(cycles, BENCH_REPEATS, sizeof(double), by_value);
+    return (Timing){ ns[BENCH_REPEATS / 2], ns[0], cycles[BENCH_REPEATS / 2], n };
+}
+
+static int parse_sizes(const char *list, size_t *sizes, size_t *count)
+{
+    *count = 0;
+    const char *c = list;
+    while (*c) {
+        char *end;
+        const unsigned long n = strtoul(c, &end, 10);
+        if (end == c || (*end && *end != ',') || n < MIN_FFT_SIZE || n > MAX_FFT_SIZE || (n & (n - 1)) ||
+            *count >= MAX_SIZES) {
+            printf("sizes must be powers of two from %d to %d, at most %d of them\n", MIN_FFT_SIZE, MAX_FFT_SIZE,
+                   MAX_SIZES);
+            return 0;
+        }
+        sizes[(*count)++] = n;
+        c = *end ? end + 1 : end;
+    }
+    return *count > 0;
+}
+
+static int parse_signals(const char *list, int *on)
+{
+    memset(on, 0, sizeof(int) * signalc);
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", list);
+    for (char *tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+        size_t i = 0;
+        while (i < signalc && strcmp(tok, signal_names[i]) != 0) {
+            i++;
+        }
+        if (i == signalc) {
+            printf("Unknown signal %s, have sine, sweep, white, pink\n", tok);
+            return 0;
+        }
+        on[i] = 1;
+    }
+    return 1;
+}
+
+static void usage(void)
+{
+    printf("Usage: rtav_bench [options]\n");
+    printf("  --sizes <list>         FFT sizes, defaults to 1024,2048,4096,8192,16384,32768,65536\n");
+    printf("  --signals <list>       sine, sweep, white, pink, defaults to all\n");
+    printf("  --kernel <name>        butterfly kernel, defaults to the best this CPU runs\n");
+    printf("  --min-ms <n>           time spent per stage, defaults to 20\n");
+    printf("  --out <file>           JSON results, defaults to rtav_bench.json\n");
+}
+
+int main(int argc, char **argv)
+{
+    size_t sizes[MAX_SIZES];
+    size_t sizec = 0;
+    int signal_on[4] = { 1, 1, 1, 1 };
+    const char *out_path = "rtav_bench.json";
+    const FFTKernel *kernel = NULL;
+    uint64_t min_ns = 20000000ull;
+    parse_sizes("1024,2048,4096,8192,16384,32768,65536", sizes, &sizec);
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (i + 1 >= argc) {
+            usage();
+            return 1;
+        }
+        const char *value = argv[++i];
+        if (strcmp(arg, "--sizes") == 0) {
+            if (!parse_sizes(value, sizes, &sizec)) {
+                return 1;
+            }
+        } else if (strcmp(arg, "--signals") == 0) {
+            if (!parse_signals(value, signal_on)) {
+                return 1;
+            }
+        } else if (strcmp(arg, "--kernel") == 0) {
+            kernel = fft_kernel_find(value);
+            if (!kernel || !kernel->supported()) {
+                printf("Kernel %s isn't there or this CPU can't run it\n", value);
+                return 1;
+            }
+        } else if (strcmp(arg, "--min-ms") == 0) {
+            min_ns = strtoull(value, NULL, 10) * 1000000ull;
+            min_ns = min_ns ? min_ns : 1000000ull;
+        } else if (strcmp(arg, "--out") == 0) {
+            out_path = value;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    FILE *out = fopen(out_path, "w");
+    if (!out) {
+        printf("Could not open %s: %s\n", out_path, strerror(errno));
+        return 1;
+    }
+
+    gen_bins(DIVISOR + 1);
+    const FFTKernel *used = kernel ? kernel : fft_kernel_best();
+    fprintf(out, "{\n  \"version\": %d,\n  \"compiler\": \"%s\",\n  \"kernel\": \"%s\",\n", BENCH_VERSION, __VERSION__,
+            used->name);
+    fprintf(out, "  \"sample_rate\": %d,\n  \"hop\": %d,\n  \"bars\": %d,\n  \"tsc\": %s,\n  \"repeats\": %d,\n",
+            BENCH_SR, DEFAULT_HOP, DIVISOR, HAVE_TSC ? "true" : "false", BENCH_REPEATS);
+    fprintf(out, "  \"results\": [");
+
+    printf("%-18s %6s %6s %12s %12s %10s %9s\n", "stage", "size", "signal", "ns/frame", "frames/s", "cyc/bin",
+           "realtime");
+    int first = 1;
+    int ok = 1;
+    for (size_t s = 0; ok && s < sizec; s++) {
+        Bench b;
+        if (!bench_init(&b, sizes[s], kernel)) {
+            bench_free(&b);
+            ok = 0;
+            break;
+        }
+        const double bins = (double)(sizes[s] / 2);
+        for (size_t g = 0; g < signalc; g++) {
+            if (!signal_on[g]) {
+                continue;
+            }
+            make_signal(b.stream, b.size, (Signal)g);
+            // Every stage reads what the one before it left, so run them all
+            // once before timing any.
+            for (size_t i = 0; i < stagec; i++) {
+                stages[i].run(&b);
+            }
+            for (size_t i = 0; i < stagec; i++) {
+                const Timing t = measure(&stages[i], &b, min_ns);
+                // Real time factor at the default hop, the budget per frame
+                // is hop / sample rate seconds.
+                const double realtime = (double)DEFAULT_HOP / BENCH_SR * 1e9 / t.ns;
+                printf("%-18s %6zu %6s %12.1f %12.0f %10.2f %8.0fx\n", stages[i].name, b.size, signal_names[g], t.ns,
+                       1e9 / t.ns, t.cycles / bins, realtime);
+                fprintf(out, "%s\n    {\"stage\": \"%s\", \"size\": %zu, \"signal\": \"%s\", \"iterations\": %llu, ",
+                        first ? "" : ",", stages[i].name, b.size, signal_names[g], (unsigned long long)t.iterations);
+                fprintf(out, "\"ns_per_frame\": %.2f, \"ns_per_frame_min\": %.2f, \"frames_per_s\": %.1f, ", t.ns,
+                        t.ns_min, 1e9 / t.ns);
+                fprintf(out, "\"msamples_per_s\": %.3f, \"realtime\": %.1f, ", (double)b.size * 1e3 / t.ns, realtime);
+                if (HAVE_TSC) {
+                    fprintf(out, "\"cycles_per_frame\": %.1f, \"cycles_per_bin\": %.4f}", t.cycles, t.cycles / bins);
+                } else {
+                    fprintf(out, "\"cycles_per_frame\": null, \"cycles_per_bin\": null}");
+                }
+                first = 0;
+            }
+        }
+        bench_free(&b);
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    if (fclose(out) == EOF) {
+        printf("Failed to close file: %s\n", strerror(errno));
+        return 1;
+    }
+    if (ok) {
+        printf("Results written to %s\n", out_path);
+    }
+    return ok ? 0 : 1;
+}
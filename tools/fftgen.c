@@ -0,0 +1,146 @@
+// Generates the straight-line FFT leaf codelets linked into rtav.
+//
+// usage: fftgen <output dir> [leaf size]
+//
+// A leaf runs the first log2(leaf) radix-2 stages on one block of already bit
+// reversed values, the same butterflies fft_radix2_stage does but unrolled,
+// with the twiddles folded in as constants and the trivial ones (1 and i)
+// reduced to adds and swaps. Everything stays in locals so a block is read
+// and written once instead of once per stage.
+//
+// One leaf serves every transform size, the later stages stay in the
+// kernels' loops. Whole transforms aren't unrolled per size: 1024 points and
+// up would be megabytes of scalar code giving up the vector stages.
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LEAF 64
+
+// Bigger leaves are scalar code taking over stages the vector kernels do
+// better, 4 came out fastest with every kernel at 8192.
+static const int DEFAULT_LEAF = 4;
+
+// Same values the plan's twiddle table holds: worked out in double, rounded
+// to float once. Printed with enough digits to read back exactly.
+static void constant(char *buf, const size_t len, const double v)
+{
+    snprintf(buf, len, "%.9g", (float)v);
+    if (!strpbrk(buf, ".en")) {
+        strncat(buf, ".0", len - strlen(buf) - 1);
+    }
+    strncat(buf, "f", len - strlen(buf) - 1);
+}
+
+static void emit_leaf(FILE *f, const int leaf)
+{
+    char re[MAX_LEAF][32], im[MAX_LEAF][32];
+
+    fprintf(f, "static inline void fft_leaf%d(Compf *restrict x)\n{\n", leaf);
+    for (int n = 0; n < leaf; n++) {
+        snprintf(re[n], sizeof(re[n]), "r%d", n);
+        snprintf(im[n], sizeof(im[n]), "i%d", n);
+        fprintf(f, "    const float r%d = x[%d].real, i%d = x[%d].imag;\n", n, n, n, n);
+    }
+
+    int stage = 0;
+    for (int half = 1; half < leaf; half <<= 1, stage++) {
+        fprintf(f, "\n    // half %d\n", half);
+        char nre[MAX_LEAF][32], nim[MAX_LEAF][32];
+        for (int k = 0; k < leaf; k += half << 1) {
+            for (int j = 0; j < half; j++) {
+                const int a = k + j, b = a + half;
+                // a + t and a - t, with t = w * b. For w = i that's
+                // (ar - bi, ai + br) and (ar + bi, ai - br).
+                char tr[64], ti[64];
+                const char *radd = "+", *rsub = "-";
+                if (j == 0) {
+                    snprintf(tr, sizeof(tr), "%s", re[b]);
+                    snprintf(ti, sizeof(ti), "%s", im[b]);
+                } else if (2 * j == half) {
+                    snprintf(tr, sizeof(tr), "%s", im[b]);
+                    snprintf(ti, sizeof(ti), "%s", re[b]);
+                    radd = "-";
+                    rsub = "+";
+                } else {
+                    char wr[32], wi[32];
+                    const double theta = M_PI * (double)j / (double)half;
+                    constant(wr, sizeof(wr), cos(theta));
+                    constant(wi, sizeof(wi), sin(theta));
+                    fprintf(f, "    const float t%d_%dr = %s * %s - %s * %s;\n", stage, a, wr, re[b], wi, im[b]);
+                    fprintf(f, "    const float t%d_%di = %s * %s + %s * %s;\n", stage, a, wr, im[b], wi, re[b]);
+                    snprintf(tr, sizeof(tr), "t%d_%dr", stage, a);
+                    snprintf(ti, sizeof(ti), "t%d_%di", stage, a);
+                }
+
+                snprintf(nre[a], sizeof(nre[a]), "r%d_%d", stage, a);
+                snprintf(nim[a], sizeof(nim[a]), "i%d_%d", stage, a);
+                snprintf(nre[b], sizeof(nre[b]), "r%d_%d", stage, b);
+                snprintf(nim[b], sizeof(nim[b]), "i%d_%d", stage, b);
+                fprintf(f, "    const float %s = %s %s %s, %s = %s + %s;\n", nre[a], re[a], radd, tr, nim[a], im[a], ti);
+                fprintf(f, "    const float %s = %s %s %s, %s = %s - %s;\n", nre[b], re[a], rsub, tr, nim[b], im[a], ti);
+            }
+        }
+        memcpy(re, nre, sizeof(re));
+        memcpy(im, nim, sizeof(im));
+    }
+
+    fprintf(f, "\n");
+    for (int n = 0; n < leaf; n++) {
+        fprintf(f, "    x[%d].real = %s;\n    x[%d].imag = %s;\n", n, re[n], n, im[n]);
+    }
+    fprintf(f, "}\n\n");
+}
+
+static FILE *open_out(const char *dir, const char *name)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        printf("Could not open %s: %s\n", path, strerror(errno));
+    }
+    return f;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        printf("usage: fftgen <output dir> [leaf size]\n");
+        return 1;
+    }
+
+    const int leaf = (argc > 2) ? atoi(argv[2]) : DEFAULT_LEAF;
+    if (leaf < 2 || leaf > MAX_LEAF || (leaf & (leaf - 1)) != 0) {
+        printf("leaf size must be a power of two from 2 to %d\n", MAX_LEAF);
+        return 1;
+    }
+
+    FILE *h = open_out(argv[1], "fft_codelets.h");
+    if (!h) {
+        return 1;
+    }
+    fprintf(h, "// Generated by tools/fftgen.c, do not edit.\n");
+    fprintf(h, "#ifndef FFT_CODELETS_H\n#define FFT_CODELETS_H\n\n");
+    fprintf(h, "#include \"fft.h\"\n\n");
+    fprintf(h, "#define FFT_LEAF_SIZE %d\n\n", leaf);
+    fprintf(h, "// Stages with half lengths 1 to FFT_LEAF_SIZE / 2 over every block of\n");
+    fprintf(h, "// bit reversed input, size is a multiple of FFT_LEAF_SIZE.\n");
+    fprintf(h, "void fft_leaves(Compf *out, size_t size);\n\n#endif\n");
+    fclose(h);
+
+    FILE *c = open_out(argv[1], "fft_codelets.c");
+    if (!c) {
+        return 1;
+    }
+    fprintf(c, "// Generated by tools/fftgen.c, do not edit.\n");
+    fprintf(c, "#include \"fft_codelets.h\"\n\n");
+    emit_leaf(c, leaf);
+    fprintf(c, "void fft_leaves(Compf *out, const size_t size)\n{\n");
+    fprintf(c, "    for (size_t k = 0; k < size; k += %d) {\n", leaf);
+    fprintf(c, "        fft_leaf%d(out + k);\n    }\n}\n", leaf);
+    fclose(c);
+    return 0;
+}